@@ -0,0 +1,42 @@
+/*
+ * allocation counter for the micro benchmarks
+ *
+ * malloc(), calloc() and realloc() are interposed and counted, then
+ * handed to the libc allocator.  libc internal allocations (strdup,
+ * opendir, ...) are counted too.  glibc only, elsewhere the counter
+ * simply stays at zero.
+ */
+#include <stdlib.h>
+
+unsigned long bench_allocs;
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+#define count()	__atomic_fetch_add(&bench_allocs,1,__ATOMIC_RELAXED)
+
+void*
+malloc(size_t size)
+{
+    count();
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+    count();
+    return __libc_calloc(nmemb,size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+    count();
+    return __libc_realloc(ptr,size);
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * tiny helpers for the micro benchmarks in bench/
+ *
+ * Results are printed one per line, tab separated:
+ *	name  iterations  ns/op  MB/s  allocs/op
+ * MB/s is 0 for benchmarks which don't process a byte stream.
+ * Allocations are counted by bench/alloc.c (glibc only).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t
+bench_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+extern unsigned long bench_allocs;
+
+static inline void
+bench_report(const char *name, long iterations, uint64_t ns, long bytes,
+	     unsigned long allocs)
+{
+    printf("%-40s\t%ld\t%.1f\t%.1f\t%.2f\n", name, iterations,
+	   (double)ns / iterations,
+	   ns ? (double)bytes * iterations * 1000 / ns : 0.0,
+	   (double)allocs / iterations);
+}
+
+/* keep the compiler from hoisting loop invariant work out of BENCH */
+#define bench_barrier()	__asm__ __volatile__("" ::: "memory")
+
+/* run body until at least 200ms have passed, then report */
+#define BENCH(name, bytes, body)					\
+    do {								\
+	long _n, _iter = 1000;						\
+	uint64_t _start, _ns;						\
+	unsigned long _allocs;						\
+	for (;;) {							\
+	    _allocs = bench_allocs;					\
+	    _start = bench_ns();					\
+	    for (_n = 0; _n < _iter; _n++) {				\
+		body;							\
+		bench_barrier();					\
+	    }								\
+	    _ns = bench_ns() - _start;					\
+	    if (_ns > 200000000)					\
+		break;							\
+	    _iter *= 4;							\
+	}								\
+	bench_report(name, _iter, _ns, bytes, bench_allocs - _allocs);	\
+    } while (0)
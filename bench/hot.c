@@ -0,0 +1,434 @@
+/*
+ * the hot helpers on their own
+ *
+ * parse_request() over a small corpus, get_mime(), quote() /
+ * unquote() / fixpath(), parse_ranges(), mkheader(), ls() on
+ * synthetic directories and get_dir() cache hits from n threads.
+ * The document tree is created below /tmp and removed afterwards.
+ * Output see bench.h, one line per benchmark, so runs of different
+ * commits can be diffed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../httpd.h"
+#include "bench.h"
+
+/* bench/request.c, bench/ls.c */
+void  bench_unquote(char *path, char *qs, char *src);
+void  bench_fixpath(char *path);
+int   bench_parse_ranges(struct REQUEST *req);
+char* bench_ls(time_t now, char *hostname, char *filename, char *path,
+	       int *length);
+
+static struct {
+    char *name;
+    char *req;
+} corpus[] = {
+    {
+	.name = "curl",
+	.req  =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"User-Agent: curl/8.5.0\r\n"
+	"Accept: */*\r\n"
+	"\r\n",
+    },{
+	.name = "browser",
+	.req  =
+	"GET /docs/page.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Connection: keep-alive\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://localhost/docs/\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"If-Modified-Since: Tue, 14 May 2024 08:12:31 GMT\r\n"
+	"\r\n",
+    },{
+	.name = "quoted",
+	.req  =
+	"GET /docs/./sub//a%20b%2Bc.txt?lang=en&q=a+b HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+    },{
+	.name = "ranges",
+	.req  =
+	"GET /large.bin HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Range: bytes=0-99,4096-8191,-512\r\n"
+	"\r\n",
+    },{
+	.name = "listing",
+	.req  =
+	"GET /small/ HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+    },{
+	.name = "notfound",
+	.req  =
+	"GET /missing.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+    }
+};
+
+static char root[64];
+static char hbuf[MAX_HEADER+1];
+
+/* ---------------------------------------------------------------------- */
+
+static void
+mkfile(char *name, int size)
+{
+    char path[256];
+    int fd;
+
+    snprintf(path,sizeof(path),"%s/%s",root,name);
+    if (-1 == (fd = open(path,O_WRONLY|O_CREAT|O_TRUNC,0644)) ||
+	-1 == ftruncate(fd,size)) {
+	perror(path);
+	exit(1);
+    }
+    close(fd);
+}
+
+static void
+mkdirectory(char *name, int entries)
+{
+    char path[256];
+    int i;
+
+    snprintf(path,sizeof(path),"%s/%s",root,name);
+    mkdir(path,0755);
+    for (i = 0; i < entries; i++) {
+	snprintf(path,sizeof(path),"%s/file-%04d.txt",name,i);
+	mkfile(path,i);
+    }
+}
+
+static void
+rmtree(void)
+{
+    char cmd[128];
+
+    snprintf(cmd,sizeof(cmd),"rm -rf %s",root);
+    if (0 != system(cmd))
+	fprintf(stderr,"failed to remove %s\n",root);
+}
+
+/* what the mainloop does once a request is finished */
+static void
+done(struct REQUEST *req)
+{
+    if (req->bfd != -1) {
+	close(req->bfd);
+	req->bfd = -1;
+    }
+    if (req->dir) {
+	free_dir(req->dir);
+	req->dir = NULL;
+    }
+    if (req->r_start) { free(req->r_start); req->r_start = NULL; }
+    if (req->r_end)   { free(req->r_end);   req->r_end   = NULL; }
+    if (req->r_head)  { free(req->r_head);  req->r_head  = NULL; }
+    if (req->r_hlen)  { free(req->r_hlen);  req->r_hlen  = NULL; }
+    req->ranges        = 0;
+    req->auth[0]       = 0;
+    req->if_modified   = NULL;
+    req->if_unmodified = NULL;
+    req->if_range      = NULL;
+    req->range_hdr     = NULL;
+    req->ctype         = NULL;
+    req->inmode        = IN_NONE;
+    req->body          = NULL;
+    req->head_only     = 0;
+    req->hostname[0]   = 0;
+    req->path[0]       = 0;
+    req->query[0]      = 0;
+    memset(req->mtime, 0, sizeof(req->mtime));
+}
+
+static int
+request(struct REQUEST *req, char *text, int len)
+{
+    memcpy(req->hreq,text,len);
+    req->hdata  = len;
+    req->hscan  = 0;
+    req->hstate = 0;
+    req->nhdr   = 0;
+    if (1 != scan_request(req))
+	return -1;
+    parse_request(req);
+    return req->status;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+bench_parse(void)
+{
+    static struct REQUEST req;
+    char name[64];
+    int i, len, status = 0;
+
+    req.hreq  = hbuf;
+    req.ahreq = sizeof(hbuf);
+    req.bfd   = -1;
+    for (i = 0; i < sizeof(corpus)/sizeof(corpus[0]); i++) {
+	len = strlen(corpus[i].req);
+	/* first round fills the path and dir caches */
+	if (request(&req,corpus[i].req,len) <= 0) {
+	    fprintf(stderr,"%s: parse failed\n",corpus[i].name);
+	    exit(1);
+	}
+	done(&req);
+	snprintf(name,sizeof(name),"parse_request/%s",corpus[i].name);
+	BENCH(name, len, {
+	    status = request(&req,corpus[i].req,len);
+	    done(&req);
+	});
+    }
+    if (status != 404) {
+	fprintf(stderr,"notfound: got %d\n",status);
+	exit(1);
+    }
+}
+
+static void
+bench_mime(void)
+{
+    static char *files[] = { "index.html", "photo.JPG", "archive.tar.gz",
+			     "README" };
+    char name[64], *type = NULL;
+    int i;
+
+    for (i = 0; i < sizeof(files)/sizeof(files[0]); i++) {
+	snprintf(name,sizeof(name),"get_mime/%s",files[i]);
+	BENCH(name, 0, type = get_mime(files[i]));
+    }
+    if (NULL == type)
+	exit(1);
+}
+
+static void
+bench_paths(void)
+{
+    static char *plain  = "/docs/manual/chapter-03/section-2.html";
+    static char *quoted = "/docs/~user/My%20Documents/r%C3%A9sum%C3%A9.pdf?v=1&q=a+b";
+    static char *dotted = "/docs/./manual//chapter-03/./section-2.html";
+    static char *spaces = "/docs/My Documents/notes #1 (draft).txt";
+    char path[MAX_PATH+1], qs[MAX_PATH+1], buf[3*MAX_PATH+1];
+    int len;
+
+    len = strlen(plain);
+    BENCH("quote/plain", len, quote((unsigned char*)plain,len,buf,sizeof(buf)));
+    len = strlen(spaces);
+    BENCH("quote/spaces", len, quote((unsigned char*)spaces,len,buf,sizeof(buf)));
+
+    len = strlen(plain);
+    BENCH("unquote/plain", len, bench_unquote(path,qs,plain));
+    len = strlen(quoted);
+    BENCH("unquote/quoted", len, bench_unquote(path,qs,quoted));
+
+    len = strlen(plain);
+    BENCH("fixpath/plain", len, {
+	memcpy(path,plain,len+1);
+	bench_fixpath(path);
+    });
+    len = strlen(dotted);
+    BENCH("fixpath/dotted", len, {
+	memcpy(path,dotted,len+1);
+	bench_fixpath(path);
+    });
+}
+
+static void
+free_ranges(struct REQUEST *req)
+{
+    free(req->r_start); req->r_start = NULL;
+    free(req->r_end);   req->r_end   = NULL;
+    free(req->r_head);  req->r_head  = NULL;
+    free(req->r_hlen);  req->r_hlen  = NULL;
+}
+
+static void
+bench_ranges(void)
+{
+    static struct REQUEST req;
+    static char one[]   = "0-1023";
+    static char multi[] = "0-99,4096-8191,65536-,-512";
+    int rc = 0;
+
+    req.bst.st_size = 1024*1024;
+    req.range_hdr = one;
+    BENCH("parse_ranges/one", 0, {
+	rc |= bench_parse_ranges(&req);
+	free_ranges(&req);
+    });
+    req.range_hdr = multi;
+    BENCH("parse_ranges/multi", 0, {
+	rc |= bench_parse_ranges(&req);
+	free_ranges(&req);
+    });
+    if (rc)
+	exit(1);
+}
+
+static void
+bench_header(void)
+{
+    static struct REQUEST req;
+    static char multi[] = "0-99,4096-8191,-512";
+    char file[128];
+
+    snprintf(file,sizeof(file),"%s/large.bin",root);
+    stat(file,&req.bst);
+    strftime(req.mtime,sizeof(req.mtime),RFC1123,gmtime(&req.bst.st_mtime));
+    req.mime       = "text/html";
+    req.keep_alive = 1;
+    BENCH("mkheader/200", 0, mkheader(&req,200));
+
+    req.range_hdr = multi;
+    if (0 != bench_parse_ranges(&req))
+	exit(1);
+    BENCH("mkheader/206-multi", 0, mkheader(&req,206));
+    free_ranges(&req);
+}
+
+static void
+bench_listing(char *dir, char *uri)
+{
+    char file[128], name[64], *html;
+    int len;
+
+    snprintf(file,sizeof(file),"%s%s",root,uri);
+    snprintf(name,sizeof(name),"ls/%s",dir);
+    BENCH(name, 0, {
+	html = bench_ls(now,"localhost",file,uri,&len);
+	free(html);
+    });
+}
+
+/* ---------------------------------------------------------------------- */
+/* get_dir() hits, the lock_dircache + refcount round trip                */
+/* (plus the dup() + close() of the directory fd get_dir() takes over)    */
+
+#define GETDIR_ITER 200000
+
+static char getdir_file[128];
+static char getdir_mtime[40];
+static int  getdir_fd;
+
+static void*
+getdir_loop(void *arg)
+{
+    struct REQUEST req;
+    struct DIRCACHE *dir;
+    long i, n = (long)arg;
+
+    memset(&req,0,sizeof(req));
+    strcpy(req.hostname,"localhost");
+    strcpy(req.path,"/small/");
+    strcpy(req.mtime,getdir_mtime);
+    for (i = 0; i < n; i++) {
+	dir = get_dir(&req,getdir_file,dup(getdir_fd));
+	free_dir(dir);
+    }
+    return NULL;
+}
+
+static void
+bench_getdir(void)
+{
+    struct stat st;
+    char name[64];
+    uint64_t start, ns;
+    unsigned long a;
+    int t, threads;
+
+    snprintf(getdir_file,sizeof(getdir_file),"%s/small/",root);
+    getdir_fd = open(getdir_file,O_RDONLY|O_DIRECTORY);
+    fstat(getdir_fd,&st);
+    strftime(getdir_mtime,sizeof(getdir_mtime),RFC1123,gmtime(&st.st_mtime));
+    getdir_loop((void*)1L);
+
+#ifdef USE_THREADS
+    for (threads = 1; threads <= 8; threads *= 2) {
+	pthread_t tid[8];
+
+	a = bench_allocs;
+	start = bench_ns();
+	for (t = 0; t < threads; t++)
+	    pthread_create(&tid[t],NULL,getdir_loop,(void*)(long)GETDIR_ITER);
+	for (t = 0; t < threads; t++)
+	    pthread_join(tid[t],NULL);
+	ns = bench_ns() - start;
+	/* per call, as seen by each thread */
+	snprintf(name,sizeof(name),"get_dir/threads-%d",threads);
+	bench_report(name,GETDIR_ITER,ns,0,(bench_allocs - a) / threads);
+    }
+#else
+    threads = 1;
+    a = bench_allocs;
+    start = bench_ns();
+    for (t = 0; t < threads; t++)
+	getdir_loop((void*)(long)GETDIR_ITER);
+    ns = bench_ns() - start;
+    snprintf(name,sizeof(name),"get_dir/threads-%d",threads);
+    bench_report(name,GETDIR_ITER,ns,0,bench_allocs - a);
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+int
+main(int argc, char *argv[])
+{
+    strcpy(root,"/tmp/webfsd-hot.XXXXXX");
+    if (NULL == mkdtemp(root)) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    mkfile("index.html",1024);
+    mkfile("large.bin",1024*1024);
+    mkdirectory("docs",0);
+    mkdirectory("docs/sub",0);
+    mkfile("docs/page.html",4096);
+    mkfile("docs/sub/a b+c.txt",100);
+    mkdirectory("small",16);
+    mkdirectory("big",1000);
+
+    doc_root = root;
+    debug    = 0;
+    now      = time(NULL);
+    strcpy(server_host,"localhost");
+#ifdef USE_THREADS
+    /* listings inline, no worker pool */
+    ls_threads = 0;
+#endif
+    init_mime(argc > 1 ? argv[1] : "/etc/mime.types","text/plain");
+    init_quote();
+    init_scan();
+    init_docroot();
+
+    bench_parse();
+    bench_mime();
+    bench_paths();
+    bench_ranges();
+    bench_header();
+    bench_listing("small","/small/");
+    bench_listing("big","/big/");
+    bench_getdir();
+
+    rmtree();
+    return 0;
+}
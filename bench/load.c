@@ -0,0 +1,548 @@
+/*
+ * http load generator for the benchmark scenarios (linux, epoll)
+ *
+ * Keeps n connections busy with GET requests for the given paths
+ * (round robin), optionally pipelined, with ranges or extra headers,
+ * over tls or without keep-alive.  Prints one line, tab separated:
+ *	name  requests  req/s  p50 us  p99 us  MB/s  server cpu us/req  errors
+ * The server cpu time is taken from /proc/<pid>/stat (-p).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef USE_SSL
+# include <openssl/ssl.h>
+# include <openssl/err.h>
+#endif
+
+#include "bench.h"
+
+#define MAX_PIPE   64
+#define IN_SIZE    (64*1024)
+
+/* latency histogram: 16 linear steps per power of two (microseconds) */
+#define H_SUB      16
+#define H_BUCKETS  (40*H_SUB)
+
+#define P_HEADER      0
+#define P_BODY        1
+#define P_CHUNK_SIZE  2
+#define P_CHUNK_DATA  3
+#define P_CHUNK_CRLF  4
+#define P_TRAILER     5
+
+struct conn {
+    int       fd;
+#ifdef USE_SSL
+    SSL       *ssl;
+#endif
+    char      out[MAX_PIPE*1024];
+    int       olen,opos;
+    uint64_t  sent[MAX_PIPE];     /* ring: send times of the requests */
+    int       head,inflight;
+
+    char      in[IN_SIZE];
+    int       ilen,ipos;
+    int       pstate,status;
+    long long left;
+};
+
+static struct addrinfo *addr;
+static char   *host = "localhost";
+static char   **paths;
+static int    npaths, next_path;
+static char   extra[4096];
+static int    nconns = 32, depth = 1, keepalive = 1, duration = 5, tls;
+static int    epfd;
+static long   requests, errors;
+static long long bytes;
+static long   hist[H_BUCKETS];
+#ifdef USE_SSL
+static SSL_CTX *ssl_ctx;
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+static void
+hist_add(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int shift = 0;
+
+    while ((us >> shift) >= 2*H_SUB)
+	shift++;
+    if (shift == 0)
+	hist[us]++;
+    else if ((shift+1)*H_SUB + (us >> shift) - H_SUB < H_BUCKETS)
+	hist[(shift+1)*H_SUB + (us >> shift) - H_SUB]++;
+    else
+	hist[H_BUCKETS-1]++;
+}
+
+static uint64_t
+hist_pct(double pct)
+{
+    long want = requests * pct / 100, sum = 0;
+    int i, shift;
+
+    if (!requests)
+	return 0; /* nothing completed, no latency */
+    for (i = 0; i < H_BUCKETS; i++) {
+	sum += hist[i];
+	if (sum > want)
+	    break;
+    }
+    if (i < 2*H_SUB)
+	return i;
+    shift = i / H_SUB - 1;
+    return (uint64_t)(i - (shift+1)*H_SUB + H_SUB) << shift;
+}
+
+static long long
+server_cpu(int pid)
+{
+    char file[64], buf[1024], *h;
+    unsigned long utime, stime;
+    FILE *fp;
+
+    snprintf(file,sizeof(file),"/proc/%d/stat",pid);
+    if (NULL == (fp = fopen(file,"r")))
+	return 0;
+    h = fgets(buf,sizeof(buf),fp);
+    fclose(fp);
+    /* the command name may contain spaces */
+    if (NULL == h || NULL == (h = strrchr(buf,')')))
+	return 0;
+    if (2 != sscanf(h+2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		    &utime,&stime))
+	return 0;
+    /* microseconds */
+    return (long long)(utime + stime) * 1000000 / sysconf(_SC_CLK_TCK);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void conn_open(struct conn *c);
+
+static void
+conn_close(struct conn *c)
+{
+    epoll_ctl(epfd,EPOLL_CTL_DEL,c->fd,NULL);
+#ifdef USE_SSL
+    if (c->ssl) {
+	SSL_free(c->ssl);
+	c->ssl = NULL;
+    }
+#endif
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* queue requests until the pipeline is full */
+static void
+conn_fill(struct conn *c)
+{
+    uint64_t t = bench_ns();
+    int n;
+
+    if (c->opos == c->olen)
+	c->opos = c->olen = 0;
+    while (c->inflight < depth && c->olen < (int)sizeof(c->out) - 1024) {
+	n = snprintf(c->out + c->olen, sizeof(c->out) - c->olen,
+		     "GET %s HTTP/1.1\r\n"
+		     "Host: %s\r\n"
+		     "%s"
+		     "%s"
+		     "\r\n",
+		     paths[next_path], host, extra,
+		     keepalive ? "" : "Connection: close\r\n");
+	next_path = (next_path + 1) % npaths;
+	c->olen += n;
+	c->sent[(c->head + c->inflight) % MAX_PIPE] = t;
+	c->inflight++;
+	if (!keepalive)
+	    break;
+    }
+}
+
+static void
+conn_events(struct conn *c)
+{
+    struct epoll_event ev;
+
+    memset(&ev,0,sizeof(ev));
+    ev.events  = EPOLLIN | (c->opos < c->olen ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd,EPOLL_CTL_MOD,c->fd,&ev);
+}
+
+static void
+conn_open(struct conn *c)
+{
+    struct epoll_event ev;
+    int on = 1;
+
+    c->fd = socket(addr->ai_family,SOCK_STREAM,0);
+    if (-1 == c->fd || -1 == connect(c->fd,addr->ai_addr,addr->ai_addrlen)) {
+	perror("connect");
+	exit(1);
+    }
+    setsockopt(c->fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+#ifdef USE_SSL
+    if (tls) {
+	/* handshake blocking, it's loopback.  With a timeout though,
+	 * the server doesn't accept() beyond its -c limit */
+	struct timeval tv = { 5, 0 };
+	setsockopt(c->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+	c->ssl = SSL_new(ssl_ctx);
+	SSL_set_fd(c->ssl,c->fd);
+	SSL_set_tlsext_host_name(c->ssl,host);
+	if (1 != SSL_connect(c->ssl)) {
+	    fprintf(stderr,"tls handshake failed (server -c limit?)\n");
+	    ERR_print_errors_fp(stderr);
+	    exit(1);
+	}
+	memset(&tv,0,sizeof(tv));
+	setsockopt(c->fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    }
+#endif
+    fcntl(c->fd,F_SETFL,O_NONBLOCK);
+    c->olen = c->opos = 0;
+    c->ilen = c->ipos = 0;
+    c->head = c->inflight = 0;
+    c->pstate = P_HEADER;
+    conn_fill(c);
+
+    memset(&ev,0,sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    epoll_ctl(epfd,EPOLL_CTL_ADD,c->fd,&ev);
+}
+
+static int
+conn_read(struct conn *c, char *buf, int len)
+{
+#ifdef USE_SSL
+    int rc;
+
+    if (c->ssl) {
+	rc = SSL_read(c->ssl,buf,len);
+	if (rc > 0)
+	    return rc;
+	switch (SSL_get_error(c->ssl,rc)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    errno = EAGAIN;
+	    return -1;
+	case SSL_ERROR_ZERO_RETURN:
+	    return 0;
+	}
+	errno = EIO;
+	return -1;
+    }
+#endif
+    return read(c->fd,buf,len);
+}
+
+static int
+conn_write(struct conn *c, char *buf, int len)
+{
+#ifdef USE_SSL
+    int rc;
+
+    if (c->ssl) {
+	rc = SSL_write(c->ssl,buf,len);
+	if (rc > 0)
+	    return rc;
+	switch (SSL_get_error(c->ssl,rc)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    errno = EAGAIN;
+	    return -1;
+	}
+	errno = EIO;
+	return -1;
+    }
+#endif
+    return write(c->fd,buf,len);
+}
+
+/* one response is complete */
+static void
+conn_done(struct conn *c)
+{
+    hist_add(bench_ns() - c->sent[c->head]);
+    c->head = (c->head + 1) % MAX_PIPE;
+    c->inflight--;
+    requests++;
+    if (c->status >= 400)
+	errors++;
+    c->pstate = P_HEADER;
+}
+
+/* find the line end in the input, returns its length or -1 */
+static int
+conn_line(struct conn *c)
+{
+    char *h = memchr(c->in + c->ipos, '\n', c->ilen - c->ipos);
+
+    return h ? h - (c->in + c->ipos) + 1 : -1;
+}
+
+/* consume responses, returns -1 on protocol errors */
+static int
+conn_parse(struct conn *c)
+{
+    char *h, *end;
+    int n, avail;
+
+    for (;;) {
+	avail = c->ilen - c->ipos;
+	switch (c->pstate) {
+	case P_HEADER:
+	    if (avail < 4)
+		return 0;
+	    h   = c->in + c->ipos;
+	    end = memmem(h, avail, "\r\n\r\n", 4);
+	    if (NULL == end)
+		return (c->ipos == 0 && c->ilen == IN_SIZE) ? -1 : 0;
+	    end[2] = 0;
+	    if (1 != sscanf(h,"HTTP/1.%*d %d",&c->status))
+		return -1;
+	    c->left   = -1;
+	    c->pstate = P_BODY;
+	    for (h = strchr(h,'\n'); h && h+1 < end; h = strchr(h+1,'\n')) {
+		if (0 == strncasecmp(h+1,"Content-Length:",15))
+		    c->left = strtoll(h+16,NULL,10);
+		if (0 == strncasecmp(h+1,"Transfer-Encoding: chunked",26))
+		    c->pstate = P_CHUNK_SIZE;
+	    }
+	    c->ipos = end + 4 - c->in;
+	    if (304 == c->status || 204 == c->status ||
+		(P_BODY == c->pstate && 0 == c->left)) {
+		conn_done(c);
+		break;
+	    }
+	    if (P_BODY == c->pstate && -1 == c->left)
+		/* delimited by close, not used here */
+		return -1;
+	    break;
+	case P_BODY:
+	case P_CHUNK_DATA:
+	    if (0 == avail)
+		return 0;
+	    n = avail < c->left ? avail : c->left;
+	    c->ipos += n;
+	    c->left -= n;
+	    if (c->left)
+		return 0;
+	    if (P_BODY == c->pstate)
+		conn_done(c);
+	    else
+		c->pstate = P_CHUNK_CRLF;
+	    break;
+	case P_CHUNK_CRLF:
+	    if (avail < 2)
+		return 0;
+	    c->ipos += 2;
+	    c->pstate = P_CHUNK_SIZE;
+	    break;
+	case P_CHUNK_SIZE:
+	    if (-1 == (n = conn_line(c)))
+		return 0;
+	    c->left = strtoll(c->in + c->ipos, NULL, 16);
+	    c->ipos += n;
+	    c->pstate = c->left ? P_CHUNK_DATA : P_TRAILER;
+	    break;
+	case P_TRAILER:
+	    if (-1 == (n = conn_line(c)))
+		return 0;
+	    c->ipos += n;
+	    if (n <= 2)
+		/* empty line */
+		conn_done(c);
+	    break;
+	}
+    }
+}
+
+static void
+conn_io(struct conn *c, int events)
+{
+    int rc;
+
+    if (events & EPOLLOUT) {
+	while (c->opos < c->olen) {
+	    rc = conn_write(c, c->out + c->opos, c->olen - c->opos);
+	    if (rc <= 0)
+		break;
+	    c->opos += rc;
+	}
+    }
+    for (;;) {
+	if (c->ipos == c->ilen) {
+	    c->ipos = c->ilen = 0;
+	} else if (c->ilen == IN_SIZE) {
+	    memmove(c->in, c->in + c->ipos, c->ilen - c->ipos);
+	    c->ilen -= c->ipos;
+	    c->ipos  = 0;
+	}
+	rc = conn_read(c, c->in + c->ilen, IN_SIZE - c->ilen);
+	if (-1 == rc && EAGAIN == errno)
+	    break;
+	if (rc <= 0)
+	    goto reconnect;
+	bytes   += rc;
+	c->ilen += rc;
+	if (-1 == conn_parse(c))
+	    goto reconnect;
+	if (!keepalive && 0 == c->inflight) {
+	    conn_close(c);
+	    conn_open(c);
+	    return;
+	}
+    }
+    conn_fill(c);
+    conn_events(c);
+    return;
+
+ reconnect:
+    /* server closed (or garbage), count what was outstanding */
+    errors += c->inflight;
+    conn_close(c);
+    conn_open(c);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+usage(char *prog)
+{
+    fprintf(stderr,
+	    "usage: %s [ options ] host:port path ...\n"
+	    "  -n name  scenario name for the report\n"
+	    "  -c n     connections                        [%d]\n"
+	    "  -d sec   duration                           [%d]\n"
+	    "  -P n     pipeline n requests per connection [%d]\n"
+	    "  -C       no keep-alive, connect per request\n"
+	    "  -R list  byte ranges, i.e. 0-99,1000-1099\n"
+	    "  -H line  extra request header (repeatable)\n"
+	    "  -p pid   report the cpu time of server >pid<\n"
+#ifdef USE_SSL
+	    "  -S       use tls\n"
+#endif
+	    , prog, nconns, duration, depth);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct addrinfo ask;
+    struct epoll_event ev[64];
+    struct conn *conns;
+    char *name = "load", *port;
+    uint64_t start, ns;
+    long long cpu = 0;
+    int c, i, n, pid = 0, len = 0;
+
+    for (;;) {
+	if (-1 == (c = getopt(argc,argv,"hn:c:d:P:CR:H:p:S")))
+	    break;
+	switch (c) {
+	case 'n': name      = optarg;       break;
+	case 'c': nconns    = atoi(optarg); break;
+	case 'd': duration  = atoi(optarg); break;
+	case 'P': depth     = atoi(optarg); break;
+	case 'C': keepalive = 0;            break;
+	case 'p': pid       = atoi(optarg); break;
+	case 'S': tls       = 1;            break;
+	case 'R':
+	    len += snprintf(extra+len, sizeof(extra)-len,
+			    "Range: bytes=%s\r\n", optarg);
+	    break;
+	case 'H':
+	    len += snprintf(extra+len, sizeof(extra)-len, "%s\r\n", optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind + 2 > argc || nconns < 1 || depth < 1 || depth > MAX_PIPE ||
+	len >= (int)sizeof(extra) - 1)
+	usage(argv[0]);
+    if (!keepalive)
+	depth = 1;
+
+    host = strdup(argv[optind]);
+    if (NULL == (port = strrchr(host,':')))
+	usage(argv[0]);
+    *(port++) = 0;
+    paths  = argv + optind + 1;
+    npaths = argc - optind - 1;
+
+    memset(&ask,0,sizeof(ask));
+    ask.ai_socktype = SOCK_STREAM;
+    if (0 != getaddrinfo(host,port,&ask,&addr)) {
+	fprintf(stderr,"%s: can't resolve %s\n",argv[0],host);
+	exit(1);
+    }
+#ifdef USE_SSL
+    if (tls) {
+	SSL_library_init();
+	SSL_load_error_strings();
+	ssl_ctx = SSL_CTX_new(SSLv23_client_method());
+	/* no session reuse, each -C connection does the full handshake */
+	SSL_CTX_set_session_cache_mode(ssl_ctx,SSL_SESS_CACHE_OFF);
+    }
+#else
+    if (tls) {
+	fprintf(stderr,"%s: compiled without tls support\n",argv[0]);
+	exit(1);
+    }
+#endif
+    signal(SIGPIPE,SIG_IGN);
+
+    epfd  = epoll_create1(0);
+    conns = calloc(nconns,sizeof(struct conn));
+    if (NULL == conns) {
+	perror("calloc");
+	exit(1);
+    }
+    if (pid)
+	cpu = server_cpu(pid);
+    start = bench_ns();
+    for (i = 0; i < nconns; i++)
+	conn_open(conns+i);
+
+    while ((ns = bench_ns() - start) < (uint64_t)duration * 1000000000) {
+	n = epoll_wait(epfd,ev,64,100);
+	for (i = 0; i < n; i++)
+	    conn_io(ev[i].data.ptr,ev[i].events);
+    }
+    if (pid)
+	cpu = server_cpu(pid) - cpu;
+
+    printf("%-24s\t%ld\t%.0f\t%" PRIu64 "\t%" PRIu64 "\t%.1f\t%.1f\t%ld\n",
+	   name, requests, (double)requests * 1000000000 / ns,
+	   hist_pct(50), hist_pct(99),
+	   (double)bytes * 1000 / ns,
+	   requests ? (double)cpu / requests : 0.0,
+	   errors);
+    return requests ? 0 : 1;
+}
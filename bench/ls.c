@@ -0,0 +1,17 @@
+/*
+ * ls.c with the static helpers made callable for bench/hot
+ */
+#include "../ls.c"
+
+char* bench_ls(time_t now, char *hostname, char *filename, char *path,
+	       int *length);
+
+char*
+bench_ls(time_t now, char *hostname, char *filename, char *path, int *length)
+{
+    int fd;
+
+    if (-1 == (fd = open(filename,O_RDONLY|O_DIRECTORY)))
+	return NULL;
+    return ls(now,hostname,fd,filename,path,length);
+}
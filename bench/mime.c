@@ -0,0 +1,90 @@
+/*
+ * mime type lookup: hash table vs. the old linear scan
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../httpd.h"
+#include "bench.h"
+
+/* reference: one array, strcasecmp on every entry */
+static struct {
+    char *ext;
+    char *type;
+} *linear;
+static int nlinear;
+
+static void
+load_linear(char *file)
+{
+    FILE *fp;
+    char line[1024], *type, *ext, *save;
+
+    if (NULL == (fp = fopen(file,"r"))) {
+	perror(file);
+	exit(1);
+    }
+    while (NULL != fgets(line,sizeof(line),fp)) {
+	if (line[0] == '#')
+	    continue;
+	if (NULL == (type = strtok_r(line," \t\r\n",&save)))
+	    continue;
+	while (NULL != (ext = strtok_r(NULL," \t\r\n",&save))) {
+	    if (0 == (nlinear % 64))
+		linear = realloc(linear,(nlinear+64)*sizeof(*linear));
+	    linear[nlinear].ext  = strdup(ext);
+	    linear[nlinear].type = strdup(type);
+	    nlinear++;
+	}
+    }
+    fclose(fp);
+}
+
+static char*
+get_mime_linear(char *file)
+{
+    char *ext;
+    int i;
+
+    ext = strrchr(file,'.');
+    if (NULL == ext)
+	return "text/plain";
+    ext++;
+    for (i = 0; i < nlinear; i++)
+	if (0 == strcasecmp(ext,linear[i].ext))
+	    return linear[i].type;
+    return "text/plain";
+}
+
+static char *files[] = {
+    "index.html", "logo.PNG", "app.js", "font.woff2",	/* hits */
+    "core.1234", "notes.unknown",			/* misses */
+};
+
+int
+main(int argc, char *argv[])
+{
+    char *file = argc > 1 ? argv[1] : "/etc/mime.types";
+    char name[64], *type = NULL;
+    int i;
+
+    init_mime(file,"text/plain");
+    load_linear(file);
+
+    for (i = 0; i < sizeof(files)/sizeof(files[0]); i++) {
+	if (0 != strcmp(get_mime(files[i]),get_mime_linear(files[i]))) {
+	    fprintf(stderr,"%s: hash and linear scan disagree\n",files[i]);
+	    exit(1);
+	}
+	snprintf(name,sizeof(name),"mime-hash/%s",files[i]);
+	BENCH(name, 0, type = get_mime(files[i]));
+	snprintf(name,sizeof(name),"mime-linear/%s",files[i]);
+	BENCH(name, 0, type = get_mime_linear(files[i]));
+    }
+    return type ? 0 : 1;
+}
@@ -0,0 +1,140 @@
+/*
+ * PUT upload throughput
+ *
+ * A child streams the body over tcp loopback, the parent runs
+ * put_request() + read_body() on it like the server does: splice()
+ * socket -> pipe -> file against read() + write() through the 16k
+ * request buffer (the tls path).  The target directory (default
+ * /var/tmp) and the upload size in MB (default 64) can be given on
+ * the command line, the files are removed afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../httpd.h"
+#include "bench.h"
+
+static int
+writer(struct sockaddr_in *sin, off_t size)
+{
+    static char buf[1024*1024];
+    off_t done;
+    int s, rc, pid;
+
+    if (0 != (pid = fork()))
+	return pid;
+    s = socket(AF_INET,SOCK_STREAM,0);
+    if (-1 == connect(s,(struct sockaddr*)sin,sizeof(*sin)))
+	_exit(1);
+    memset(buf,'x',sizeof(buf));
+    for (done = 0; done < size; done += rc) {
+	rc = write(s,buf,size - done > sizeof(buf) ? sizeof(buf) : size - done);
+	if (rc <= 0)
+	    _exit(1);
+    }
+    close(s);
+    _exit(0);
+}
+
+static int
+upload(int lsock, struct sockaddr_in *sin, struct REQUEST *req,
+       off_t size, int splice)
+{
+    int pid, ok;
+
+    pid = writer(sin,size);
+    req->fd = accept(lsock,NULL,NULL);
+    req->state     = STATE_READ_HEADER;
+    req->keep_alive = 1;
+    req->inmode    = IN_LENGTH;
+    req->inleft    = size;
+    req->inpos     = 0;
+    req->hdata     = 0;
+    req->lreq      = 0;
+    req->cgisplice = 0;
+    put_request(req);
+    if (!splice)
+	req->cgisplice = 0;
+    while (-1 != req->infd)
+	read_body(req);
+    ok = (201 == req->status || 204 == req->status);
+    close(req->fd);
+    waitpid(pid,NULL,0);
+    return ok;
+}
+
+static void
+run(char *name, int lsock, struct sockaddr_in *sin, struct REQUEST *req,
+    off_t size, int splice)
+{
+    uint64_t start, ns = 0;
+    unsigned long allocs = 0, a;
+    long n;
+
+    for (n = 0; n < 3 || ns < 1000000000; n++) {
+	a = bench_allocs;
+	start = bench_ns();
+	if (!upload(lsock,sin,req,size,splice)) {
+	    fprintf(stderr,"%s: upload failed (%d)\n",name,req->status);
+	    exit(1);
+	}
+	ns += bench_ns() - start;
+	allocs += bench_allocs - a;
+    }
+    bench_report(name,n,ns,size,allocs);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct REQUEST req;
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    char dir[MAX_PATH], file[MAX_PATH+16];
+    off_t size;
+    int lsock;
+
+    snprintf(dir,sizeof(dir),"%s/webfsd-put.XXXXXX",
+	     argc > 1 ? argv[1] : "/var/tmp");
+    size = (off_t)(argc > 2 ? atoi(argv[2]) : 64) << 20;
+    if (NULL == mkdtemp(dir)) {
+	perror("mkdtemp");
+	exit(1);
+    }
+    doc_root = dir;
+    putpath  = "/";
+    debug    = 0;
+    init_docroot();
+
+    memset(&sin,0,sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lsock = socket(AF_INET,SOCK_STREAM,0);
+    if (-1 == bind(lsock,(struct sockaddr*)&sin,sizeof(sin)) ||
+	-1 == listen(lsock,4) ||
+	-1 == getsockname(lsock,(struct sockaddr*)&sin,&len)) {
+	perror("listen");
+	exit(1);
+    }
+
+    memset(&req,0,sizeof(req));
+    req.infd = -1;
+    strcpy(req.type,"PUT");
+    strcpy(req.uri,"/upload");
+    strcpy(req.path,"/upload");
+
+    run("put-write",lsock,&sin,&req,size,0);
+    run("put-splice",lsock,&sin,&req,size,1);
+
+    snprintf(file,sizeof(file),"%s/upload",dir);
+    unlink(file);
+    rmdir(dir);
+    return 0;
+}
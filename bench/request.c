@@ -0,0 +1,26 @@
+/*
+ * request.c with the static helpers made callable for bench/hot
+ */
+#include "../request.c"
+
+void bench_unquote(char *path, char *qs, char *src);
+void bench_fixpath(char *path);
+int  bench_parse_ranges(struct REQUEST *req);
+
+void
+bench_unquote(char *path, char *qs, char *src)
+{
+    unquote((unsigned char*)path,(unsigned char*)qs,(unsigned char*)src);
+}
+
+void
+bench_fixpath(char *path)
+{
+    fixpath(path);
+}
+
+int
+bench_parse_ranges(struct REQUEST *req)
+{
+    return parse_ranges(req);
+}
@@ -0,0 +1,112 @@
+#!/bin/sh
+#
+# benchmark scenarios, used by "make bench"
+#
+# Starts webfsd on a generated fixture tree and runs bench/load for
+# each scenario.  Environment:
+#	BENCH_TIME	seconds per scenario                   [5]
+#	BENCH_PORT	first tcp port to use                  [8089]
+#	BENCH_ARGS	extra webfsd options, i.e. "-y 4"
+#	BENCH_ONLY	run only scenarios matching this regex
+#
+# Results go to stdout, tab separated, see bench/load.c.
+#
+
+top="$(cd "$(dirname "$0")/.." && pwd)"
+webfsd="$top/webfsd"
+load="$top/bench/load"
+time="${BENCH_TIME:-5}"
+port="${BENCH_PORT:-8089}"
+only="${BENCH_ONLY:-.}"
+tmp="$(mktemp -d /tmp/webfsd-bench.XXXXXX)" || exit 1
+pid=""
+
+cleanup() {
+	test -n "$pid" && kill "$pid" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+# --- fixture tree -------------------------------------------------------
+
+www="$tmp/www"
+mkdir -p "$www/dir" "$www/cgi"
+i=0
+while test $i -lt 100; do
+	head -c 128 /dev/zero | tr '\0' 'x' > "$www/tiny$i.html"
+	i=$((i+1))
+done
+head -c $((64*1024*1024)) /dev/zero > "$www/large.bin"
+head -c $((4*1024*1024)) /dev/zero > "$www/medium.bin"
+i=0
+while test $i -lt 1000; do
+	: > "$www/dir/entry-$i.txt"
+	i=$((i+1))
+done
+cat > "$www/cgi/hello" <<EOF
+#!/bin/sh
+echo "Content-Type: text/plain"
+echo "Cache-Control: max-age=60"
+echo
+echo "hello, world"
+EOF
+chmod 755 "$www/cgi/hello"
+mtime="$(LC_ALL=C date -u -r "$www/tiny0.html" '+%a, %d %b %Y %H:%M:%S GMT')"
+tiny="$(i=0; while test $i -lt 100; do echo /tiny$i.html; i=$((i+1)); done)"
+
+# --- helpers ------------------------------------------------------------
+
+start() {
+	test -n "$pid" && kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+	port=$((port+1))
+	"$webfsd" -F -p "$port" -r "$www" -x /cgi/ -c 1024 $BENCH_ARGS "$@" \
+		>/dev/null 2>&1 &
+	pid=$!
+	sleep 1
+	if ! kill -0 "$pid" 2>/dev/null; then
+		echo "webfsd $* failed to start" >&2
+		exit 1
+	fi
+}
+
+run() {
+	name="$1"
+	shift
+	echo "$name" | grep -Eq -- "$only" || return 0
+	"$load" -n "$name" -d "$time" -p "$pid" "$@" || echo "$name: failed" >&2
+}
+
+# --- scenarios ----------------------------------------------------------
+
+printf "%-24s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+	"# scenario" "reqs" "req/s" "p50us" "p99us" "MB/s" "cpu-us/req" "errors"
+
+start
+run tiny		-c 64 127.0.0.1:$port $tiny
+run tiny-pipeline	-c 64 -P 16 127.0.0.1:$port $tiny
+run tiny-close		-c 64 -C 127.0.0.1:$port $tiny
+run large-sendfile	-c 8 127.0.0.1:$port /large.bin
+run multi-range		-c 64 -R 0-99,65536-131071,33554432-33558527 \
+			127.0.0.1:$port /large.bin
+run listing		-c 64 127.0.0.1:$port /dir/
+run revalidate-304	-c 64 -H "If-Modified-Since: $mtime" \
+			127.0.0.1:$port /tiny0.html
+run cgi			-c 16 127.0.0.1:$port /cgi/hello
+
+start -M 5
+run cgi-microcache	-c 64 127.0.0.1:$port /cgi/hello
+
+if "$webfsd" -h 2>&1 | grep -q -- "-S " &&
+   "$load" -h 2>&1 | grep -q -- "-S " &&
+   openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+	-keyout "$tmp/key.pem" -out "$tmp/cert.pem" >/dev/null 2>&1; then
+	cat "$tmp/key.pem" "$tmp/cert.pem" > "$tmp/server.pem"
+	start -S -C "$tmp/server.pem"
+	run tls-tiny		-c 64 -S 127.0.0.1:$port $tiny
+	# a 64 MB file doesn't finish within a short BENCH_TIME over tls
+	run tls-large		-c 8 -S 127.0.0.1:$port /medium.bin
+	run tls-handshake	-c 16 -S -C 127.0.0.1:$port /tiny0.html
+else
+	echo "# tls: skipped (webfsd or bench/load without ssl, or no openssl)"
+fi
@@ -0,0 +1,55 @@
+/*
+ * byte scanning kernels, every implementation the cpu supports
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "../httpd.h"
+#include "bench.h"
+
+static int sizes[] = { 16, 64, 256, 4096 };
+
+int
+main(int argc, char *argv[])
+{
+    static char buf[4096];
+    struct SCANNER *s;
+    char name[64];
+    int i, len, rc = 0;
+
+    /* plain header value bytes, the match is the very last byte */
+    memset(buf,'a',sizeof(buf));
+
+    for (s = scanners; NULL != s->name; s++) {
+	if (!scan_supported(s))
+	    continue;
+	for (i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+	    len = sizes[i];
+
+	    buf[len-1] = '\r';
+	    if (len-1 != s->ctl(buf,len) || len-1 != s->target(buf,len)) {
+		fprintf(stderr,"%s: wrong result\n",s->name);
+		exit(1);
+	    }
+	    snprintf(name,sizeof(name),"ctl/%s/%d",s->name,len);
+	    BENCH(name, len, rc += s->ctl(buf,len));
+	    snprintf(name,sizeof(name),"target/%s/%d",s->name,len);
+	    BENCH(name, len, rc += s->target(buf,len));
+
+	    buf[len-1] = '%';
+	    if (len-1 != s->delim(buf,len)) {
+		fprintf(stderr,"%s: wrong result\n",s->name);
+		exit(1);
+	    }
+	    snprintf(name,sizeof(name),"delim/%s/%d",s->name,len);
+	    BENCH(name, len, rc += s->delim(buf,len));
+
+	    buf[len-1] = 'a';
+	}
+    }
+    return rc ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+/*
+ * the server objects minus main(), for linking the micro benchmarks
+ */
+#define main webfsd_main
+int webfsd_main(int argc, char *argv[]);
+
+#include "../webfsd.c"
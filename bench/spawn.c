@@ -0,0 +1,107 @@
+/*
+ * cgi launch latency vs. server size
+ *
+ * Measures how long the event loop is blocked starting a script:
+ * cgi_request() (posix_spawn) against the old fork() + execve() in
+ * the child.  The server size is simulated by touching n MB of heap
+ * before, the sizes (in MB) can be given on the command line.
+ * Waiting for the script to exit is not part of the measurement.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "../httpd.h"
+#include "bench.h"
+
+#define SCRIPT  "/bin/true"
+
+/* the old way, the child builds the environment itself */
+static int
+launch_fork(void)
+{
+    char *argv[] = { SCRIPT, NULL };
+    char *envp[] = { "GATEWAY_INTERFACE=CGI/1.1", NULL };
+    int pid;
+
+    if (0 == (pid = fork())) {
+	execve(SCRIPT,argv,envp);
+	_exit(1);
+    }
+    return pid;
+}
+
+static int
+launch_spawn(struct REQUEST *req)
+{
+    req->cgipid  = 0;
+    req->cgipipe = -1;
+    cgi_request(req);
+    if (-1 != req->cgipipe)
+	close(req->cgipipe);
+    return req->cgipid;
+}
+
+static void
+run(char *name, int mb, struct REQUEST *req)
+{
+    char label[64];
+    uint64_t start, ns = 0;
+    unsigned long allocs = 0, a;
+    long n;
+    int pid;
+
+    for (n = 0; n < 20 || ns < 200000000; n++) {
+	a = bench_allocs;
+	start = bench_ns();
+	pid = req ? launch_spawn(req) : launch_fork();
+	ns += bench_ns() - start;
+	allocs += bench_allocs - a;
+	if (pid <= 0) {
+	    fprintf(stderr,"%s: launch failed\n",name);
+	    exit(1);
+	}
+	waitpid(pid,NULL,0);
+    }
+    snprintf(label,sizeof(label),"%s/%dMB",name,mb);
+    bench_report(label,n,ns,0,allocs);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static int defsizes[] = { 0, 128, 1024 };
+    struct REQUEST req;
+    char *heap = NULL;
+    int i, mb, nsizes;
+
+    /* cgi_request() maps "/true" below doc_root "/bin" */
+    doc_root = "/bin";
+    cgipath  = "/";
+    debug    = 0;
+    memset(&req,0,sizeof(req));
+    req.fd = -1;
+    strcpy(req.type,"GET");
+    strcpy(req.uri,"/true");
+    strcpy(req.path,"/true");
+
+    nsizes = argc > 1 ? argc-1 : sizeof(defsizes)/sizeof(defsizes[0]);
+    for (i = 0; i < nsizes; i++) {
+	mb = argc > 1 ? atoi(argv[i+1]) : defsizes[i];
+	free(heap);
+	if (mb && NULL == (heap = malloc((size_t)mb << 20))) {
+	    perror("malloc");
+	    exit(1);
+	}
+	if (mb)
+	    memset(heap,1,(size_t)mb << 20);
+	run("cgi-fork",mb,NULL);
+	run("cgi-spawn",mb,&req);
+    }
+    return 0;
+}
@@ -8,6 +8,10 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <signal.h>
+#include <spawn.h>
+#include <syslog.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -20,6 +24,8 @@
 
 /* ---------------------------------------------------------------------- */
 
+#define CGI_PIPE_SIZE   (1024*1024)
+
 extern char **environ;
 
 static char *env_wlist[] = {
@@ -27,34 +33,61 @@ static char *env_wlist[] = {
     NULL
 };
 
-static void env_add(struct strlist **list, char *name, char *value)
-{
-    char *line;
+/*
+ * The environment for the script is built in the parent, in a per
+ * thread arena which is allocated once, so the child has nothing to
+ * do but exec.
+ */
+struct ENVARENA {
+    char  *buf;
+    int   len,size;
+    char  **env;
+    int   n,max;
+    int   overflow;
+};
 
-    line = malloc(strlen(name) + strlen(value) + 2);
-    sprintf(line,"%s=%s",name,value);
-    if (debug)
-	fprintf(stderr,"cgi: env %s\n",line);
-    list_add(list,line,1);
+static THREAD_LOCAL struct ENVARENA arena;
+
+static int env_init(void)
+{
+    if (NULL == arena.buf) {
+	/* request line + headers, HTTP_ prefixes, our own vars */
+	arena.size = 3*max_header + 4096;
+	arena.max  = max_header/3 + 64;
+	arena.buf  = malloc(arena.size);
+	arena.env  = malloc(arena.max * sizeof(char*));
+	if (NULL == arena.buf || NULL == arena.env) {
+	    free(arena.buf);
+	    free(arena.env);
+	    arena.buf = NULL;
+	    arena.env = NULL;
+	    return -1;
+	}
+    }
+    arena.len      = 0;
+    arena.n        = 0;
+    arena.overflow = 0;
+    return 0;
 }
 
-static char**
-env_convert(struct strlist *list)
+static void env_add(void *ctx, char *name, char *value)
 {
-    struct strlist *elem;
-    char **env;
-    int i;
-
-    for (i = 2, elem = list; NULL != elem; elem = elem->next)
-	i++;
-    env = malloc(sizeof(char*)*i);
-    for (i = 0, elem = list; NULL != elem; elem = elem->next)
-	env[i++] = elem->line;
-    env[i++] = NULL;
-    return env;
+    struct ENVARENA *a = ctx;
+    int len = strlen(name) + strlen(value) + 2;
+
+    if (a->len + len > a->size || a->n + 2 > a->max) {
+	a->overflow = 1;
+	return;
+    }
+    a->env[a->n] = a->buf + a->len;
+    sprintf(a->env[a->n],"%s=%s",name,value);
+    if (debug)
+	fprintf(stderr,"cgi: env %s\n",a->env[a->n]);
+    a->n++;
+    a->len += len;
 }
 
-static void env_copy(struct strlist **list)
+static void env_copy(struct ENVARENA *a)
 {
     int i,j,l;
 
@@ -63,7 +96,7 @@ static void env_copy(struct strlist **list)
 	    l = strlen(env_wlist[j]);
 	    if (0 == strncmp(environ[i],env_wlist[j],l) &&
 		environ[i][l] == '=') {
-		env_add(list,env_wlist[j],environ[i]+l+1);
+		env_add(a,env_wlist[j],environ[i]+l+1);
 		break;
 	    }
 	}
@@ -72,129 +105,272 @@ static void env_copy(struct strlist **list)
 
 /* ---------------------------------------------------------------------- */
 
+/* the cgi variables, for the environment or FastCGI params */
 void
-cgi_request(struct REQUEST *req)
+cgi_vars(struct REQUEST *req, void (*add)(void *ctx, char *name, char *value),
+	 void *ctx)
 {
     struct sockaddr_storage addr;
-    struct strlist *env = NULL, *item;
     char host[65],serv[9];
-    char filename[1024], *h, *argv[2], envname[128];
-    int pid,p[2],i,length;
+    char filename[1024], *h, envname[128], clen[24];
+    int i,j,length;
 
-    if (debug)
-	fprintf(stderr,"%03d: is cgi request\n",req->fd);
-    if (-1 == pipe(p)) {
-	mkerror(req,500,0);
-	return;
-    }
-    pid = fork();
-    switch (pid) {
-    case -1:
-	/* error */
-	if (debug)
-	    perror("fork");
-	mkerror(req,500,0);
-	return;
-    case 0:
-	break;
-    default:
-	/* parent - webfsd */
-	close(p[1]);
-	req->cgipid  = pid;
-	req->cgipipe = p[0];
-	req->state   = STATE_CGI_HEADER;
-	close_on_exec(req->cgipipe);
-	fcntl(req->cgipipe,F_SETFL,O_NONBLOCK);
-	return;
-    }
-
-    /* -------- below is the child process (cgi) code -------- */
-
-    /* lookup local socket (before it gets closed) */
+    /* lookup local socket */
     socklen_t addr_length = sizeof(addr);
+    host[0] = 0;
+    serv[0] = 0;
     getsockname(req->fd,(struct sockaddr*)&addr,&addr_length);
     getnameinfo((struct sockaddr*)&addr,addr_length,host,64,serv,8,
 		NI_NUMERICHOST | NI_NUMERICSERV);
-    
-    /* setup file descriptors */
-    dup2(p[1],1); /* pipe -> stdout */
-    if (have_tty) {
-	int devnull = open("/dev/null",O_RDWR);
-	dup2(devnull,0); /* stdin  */
-	dup2(devnull,2); /* stderr */
-	close(devnull);
-    } else {
-	/* nothing -- already attached to /dev/null */
+
+    add(ctx,"DOCUMENT_ROOT",doc_root);
+    add(ctx,"GATEWAY_INTERFACE","CGI/1.1");
+    add(ctx,"QUERY_STRING",req->query);
+    add(ctx,"REQUEST_URI",req->uri);
+    add(ctx,"REMOTE_ADDR",req->peerhost);
+    add(ctx,"REMOTE_PORT",req->peerserv);
+    add(ctx,"REQUEST_METHOD",req->type);
+    add(ctx,"SERVER_ADMIN","root@localhost");
+    add(ctx,"SERVER_NAME",server_host);
+    add(ctx,"SERVER_PROTOCOL","HTTP/1.1");
+    add(ctx,"SERVER_SOFTWARE",server_name);
+    add(ctx,"SERVER_ADDR",host);
+    add(ctx,"SERVER_PORT",serv);
+    if (IN_LENGTH == req->inmode || IN_EOF == req->inmode) {
+	/* chunked bodies have no length, the script reads until eof */
+	snprintf(clen,sizeof(clen),"%" PRId64,(int64_t)req->inleft);
+	add(ctx,"CONTENT_LENGTH",clen);
     }
-    close_on_exec(p[0]);
-    close_on_exec(p[1]);
+    if (req->ctype)
+	add(ctx,"CONTENT_TYPE",req->ctype);
 
-    /* setup environment */
-    env_copy(&env);
-
-    env_add(&env,"DOCUMENT_ROOT",doc_root);
-    env_add(&env,"GATEWAY_INTERFACE","CGI/1.1");
-    env_add(&env,"QUERY_STRING",req->query);
-    env_add(&env,"REQUEST_URI",req->uri);
-    env_add(&env,"REMOTE_ADDR",req->peerhost);
-    env_add(&env,"REMOTE_PORT",req->peerserv);
-    env_add(&env,"REQUEST_METHOD",req->type);
-    env_add(&env,"SERVER_ADMIN","root@localhost");
-    env_add(&env,"SERVER_NAME",server_host);
-    env_add(&env,"SERVER_PROTOCOL","HTTP/1.1");
-    env_add(&env,"SERVER_SOFTWARE",server_name);
-    env_add(&env,"SERVER_ADDR",host);
-    env_add(&env,"SERVER_PORT",serv);
-
-    for (item = req->header; NULL != item; item = item->next) {
-	strcpy(envname,"HTTP_");
-	if (1 != sscanf(item->line,"%120[-A-Za-z]: %n",envname+5,&length))
+    for (i = 0; i < req->nhdr; i++) {
+	length = req->hdr[i].name.len;
+	if (length > 120)
 	    continue;
-	for (i = 0; envname[i]; i++) {
-	    if (isalpha(envname[i]))
-		envname[i] = toupper(envname[i]);
-	    if ('-' == envname[i])
-		envname[i] = '_';
+	strcpy(envname,"HTTP_");
+	memcpy(envname+5,req->hreq + req->hdr[i].name.off,length);
+	envname[5+length] = 0;
+	for (j = 5; envname[j]; j++) {
+	    if (isalpha(envname[j]))
+		envname[j] = toupper(envname[j]);
+	    else if ('-' == envname[j])
+		envname[j] = '_';
+	    else
+		break;
 	}
-	env_add(&env,envname,item->line+length);
+	if (envname[j])
+	    continue;
+	/* parse_request() has NUL-terminated the value */
+	add(ctx,envname,req->hreq + req->hdr[i].value.off);
     }
 
     h = req->path + strlen(cgipath);
     h = strchr(h,'/');
     if (h) {
-	env_add(&env,"PATH_INFO",h);
+	add(ctx,"PATH_INFO",h);
 	*h = 0;
     } else {
-	env_add(&env,"PATH_INFO","");
+	add(ctx,"PATH_INFO","");
     }
-    env_add(&env,"SCRIPT_NAME",req->path);
+    add(ctx,"SCRIPT_NAME",req->path);
     snprintf(filename,sizeof(filename)-1,"%s%s",doc_root,req->path);
-    env_add(&env,"SCRIPT_FILENAME",filename);
+    add(ctx,"SCRIPT_FILENAME",filename);
+    if (h)
+	*h = '/';
+}
+
+void
+cgi_request(struct REQUEST *req)
+{
+    posix_spawn_file_actions_t fa;
+    char *h, *argv[2];
+    int rc,len,pid,p[2],in[2] = { -1, -1 };
+
+    if (debug)
+	fprintf(stderr,"%03d: is cgi request\n",req->fd);
+    if (fcgi_socket) {
+	fcgi_request(req);
+	return;
+    }
 
-    /* start cgi app */
-    argv[0] = filename;
+    /* setup environment */
+    if (-1 == env_init()) {
+	mkerror(req,500,0);
+	return;
+    }
+    env_copy(&arena);
+    cgi_vars(req,env_add,&arena);
+    arena.env[arena.n] = NULL;
+
+    /* script filename */
+    h = strchr(req->path + strlen(cgipath),'/');
+    if (h)
+	*h = 0;
+    argv[0] = arena.buf + arena.len;
     argv[1] = NULL;
-    execve(filename,argv,env_convert(env));
-
-    /* exec failed ... */
-    printf("Content-Type: text/plain\n"
-	   "\n"
-	   "execve %s: %s\n",
-	   filename,strerror(errno));
-    exit(1);
+    len = snprintf(argv[0],arena.size - arena.len,"%s%s",doc_root,req->path);
+    if (h)
+	*h = '/';
+    if (arena.overflow || len >= arena.size - arena.len) {
+	mkerror(req,500,0);
+	return;
+    }
+
+    if (-1 == pipe(p)) {
+	mkerror(req,500,0);
+	return;
+    }
+    close_on_exec(p[0]);
+    if (p[1] != 1)
+	/* dup2() to stdout clears the flag in the child */
+	close_on_exec(p[1]);
+    if (IN_NONE != req->inmode) {
+	/* request body -> stdin */
+	if (-1 == pipe(in)) {
+	    close(p[0]);
+	    close(p[1]);
+	    mkerror(req,500,0);
+	    return;
+	}
+	close_on_exec(in[1]);
+	if (in[0] != 0)
+	    close_on_exec(in[0]);
+    }
+
+    /* start cgi app, no page table copy (vfork semantics) */
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa,p[1],1); /* pipe -> stdout */
+    if (-1 != in[0])
+	posix_spawn_file_actions_adddup2(&fa,in[0],0); /* pipe -> stdin */
+    if (have_tty) {
+	if (-1 == in[0])
+	    posix_spawn_file_actions_addopen(&fa,0,"/dev/null",O_RDWR,0);
+	posix_spawn_file_actions_addopen(&fa,2,"/dev/null",O_RDWR,0);
+    } else {
+	/* nothing -- already attached to /dev/null */
+    }
+    rc = posix_spawn(&pid,argv[0],&fa,NULL,argv,arena.env);
+    posix_spawn_file_actions_destroy(&fa);
+    close(p[1]);
+    if (-1 != in[0])
+	close(in[0]);
+    if (0 != rc) {
+	errno = rc;
+	xperror(LOG_WARNING,argv[0],req->peerhost);
+	close(p[0]);
+	if (-1 != in[1])
+	    close(in[1]);
+	mkerror(req,500,0);
+	return;
+    }
+
+    stats->cgi_spawns++;
+    req->cgipid  = pid;
+    req->cgipipe = p[0];
+    req->state   = STATE_CGI_HEADER;
+    fcntl(req->cgipipe,F_SETFL,O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    /* fewer wakeups for scripts which write a lot, may fail (EPERM) */
+    fcntl(req->cgipipe,F_SETPIPE_SZ,CGI_PIPE_SIZE);
+#endif
+    if (-1 != in[1]) {
+	req->infd = in[1];
+	fcntl(req->infd,F_SETFL,O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+	fcntl(req->infd,F_SETPIPE_SZ,CGI_PIPE_SIZE);
+#endif
+    }
+#ifdef SPLICE_F_NONBLOCK
+    req->cgisplice = 1;
+# ifdef USE_SSL
+    if (with_ssl)
+	/* no splice() through openssl */
+	req->cgisplice = 0;
+# endif
+    if (req->mc)
+	/* micro cache fill, the body must pass through cgibuf */
+	req->cgisplice = 0;
+#endif
+}
+
+/* read cgi output, without the FastCGI framing */
+int
+cgi_read(struct REQUEST *req, char *buf, int len)
+{
+    if (req->fcgi)
+	return fcgi_read(req,buf,len);
+    return read(req->cgipipe,buf,len);
+}
+
+/* write request body data to the script, len 0 ends the body */
+int
+cgi_write(struct REQUEST *req, char *buf, int len)
+{
+    if (req->fcgi)
+	return fcgi_write(req,buf,len);
+    if (0 == len) {
+	close(req->infd);
+	return 0;
+    }
+    return write(req->infd,buf,len);
+}
+
+/* no more request body for the script, complete or not */
+void
+cgi_stdin_done(struct REQUEST *req)
+{
+    if (-1 != req->infd && !req->fcgi)
+	close(req->infd);
+    req->infd = -1;
+}
+
+/* response done or connection gone, drop the script */
+void
+cgi_done(struct REQUEST *req)
+{
+    if (req->fcgi) {
+	fcgi_release(req);
+    } else {
+	if (req->cgipipe != -1)
+	    close(req->cgipipe);
+	if (req->cgipid)
+	    kill(req->cgipid,SIGTERM);
+    }
+    cgi_stdin_done(req);
+    mc_done(req);
+    req->cgipipe   = -1;
+    req->cgipid    = 0;
+    req->cgisplice = 0;
 }
 
 /* ---------------------------------------------------------------------- */
 
+/* find the empty line ending the cgi header, searching from buf+from */
+static char*
+cgi_header_end(char *buf, int from, int len)
+{
+    char *h = buf+from, *end = buf+len;
+
+    while (NULL != (h = memchr(h,'\n',end-h))) {
+	if (h+1 < end && h[1] == '\n')
+	    return h+2;
+	if (h+2 < end && h[1] == '\r' && h[2] == '\n')
+	    return h+3;
+	h++;
+    }
+    return NULL;
+}
+
 void
 cgi_read_header(struct REQUEST *req)
 {
     struct strlist  *list = NULL;
     char            *h,*next,*status = NULL;
-    int             rc;
+    int             rc,from;
 
  restart:
-    rc = read(req->cgipipe, req->cgibuf+req->cgilen, MAX_HEADER-req->cgilen);
+    rc = cgi_read(req, req->cgibuf+req->cgilen, MAX_HEADER-req->cgilen);
     switch (rc) {
     case -1:
 	if (errno == EAGAIN)
@@ -206,13 +382,14 @@ cgi_read_header(struct REQUEST *req)
 	mkerror(req,500,0);
 	return;
     default:
+	/* the terminating "\n\n" or "\n\r\n" may start in old data */
+	from = req->cgilen > 2 ? req->cgilen - 2 : 0;
 	req->cgilen += rc;
 	req->cgibuf[req->cgilen] = 0;
     }
 
     /* header complete ?? */
-    if (NULL != (h = strstr(req->cgibuf,"\r\n\r\n")) ||
-	NULL != (h = strstr(req->cgibuf,"\n\n"))) {
+    if (NULL != cgi_header_end(req->cgibuf, from, req->cgilen)) {
 
 	/* parse cgi header */
 	for (h = req->cgibuf;; h = next) {
@@ -240,6 +417,7 @@ cgi_read_header(struct REQUEST *req)
 		continue;
 	    list_add(&list,h,0);
 	}
+	mc_header(req, status ? status : "200 OK", list);
 	mkcgi(req, status ? status : "200 OK", list);
 	list_free(&list);
 	req->cgipos = next - req->cgibuf;
@@ -0,0 +1,533 @@
+/*
+ * FastCGI client
+ *
+ * With -w the requests for the cgi directory are not fork+exec'ed
+ * but sent to a FastCGI application listening on a unix socket.
+ * With -W webfsd starts the application itself (listening socket on
+ * fd 0, like spawn-fcgi does).
+ *
+ * Connections are kept open (FCGI_KEEP_CONN) and reused, each one
+ * carries one request at a time.  Idle connections are kept on per
+ * thread lists, so no locking is needed.  The backend socket takes
+ * the place of the cgi pipe, cgi_read() strips the record framing,
+ * everything else is the same as for cgi scripts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "httpd.h"
+
+#define FCGI_VERSION          1
+#define FCGI_BEGIN_REQUEST    1
+#define FCGI_END_REQUEST      3
+#define FCGI_PARAMS           4
+#define FCGI_STDIN            5
+#define FCGI_STDOUT           6
+#define FCGI_STDERR           7
+
+#define FCGI_RESPONDER        1
+#define FCGI_KEEP_CONN        1
+
+#define FCGI_ID               1      /* one request per connection */
+#define FCGI_RECORD_MAX       65535
+#define FCGI_KEEP             16     /* idle connections per thread */
+#define FCGI_MAX_WORKERS      64
+
+struct FCGI {
+    int            fd;
+    unsigned char  hdr[8];           /* record header being read */
+    int            hlen;
+    int            type;
+    int            left,pad;         /* content + padding to go */
+    unsigned char  ohdr[8];          /* stdin record header ... */
+    int            ohleft;           /* ... bytes of it still to write */
+    int            out;              /* stdin content to go */
+    int            done;             /* got FCGI_END_REQUEST */
+    int            broken;           /* don't reuse */
+    struct FCGI    *next;
+};
+
+static THREAD_LOCAL struct FCGI *fcgi_idle;
+static THREAD_LOCAL int         fcgi_nidle;
+
+static int   fcgi_listen = -1;
+static int   fcgi_pids[FCGI_MAX_WORKERS];
+
+/* ---------------------------------------------------------------------- */
+/* connection pool                                                        */
+
+static struct FCGI*
+fcgi_connect(int *status)
+{
+    struct sockaddr_un addr;
+    struct FCGI *f;
+    int fd;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,fcgi_socket,sizeof(addr.sun_path)-1);
+
+    *status = 502;
+    if (-1 == (fd = socket(PF_UNIX,SOCK_STREAM,0)))
+	return NULL;
+    close_on_exec(fd);
+    fcntl(fd,F_SETFL,O_NONBLOCK);
+    if (-1 == connect(fd,(struct sockaddr*)&addr,sizeof(addr)) &&
+	EINPROGRESS != errno) {
+	if (EAGAIN == errno)
+	    /* listen backlog is full, all workers busy */
+	    *status = 503;
+	xperror(LOG_WARNING,"fastcgi connect",NULL);
+	close(fd);
+	return NULL;
+    }
+    if (NULL == (f = malloc(sizeof(*f)))) {
+	close(fd);
+	return NULL;
+    }
+    memset(f,0,sizeof(*f));
+    f->fd = fd;
+    return f;
+}
+
+static struct FCGI*
+fcgi_get(int *status)
+{
+    struct FCGI *f;
+    int fd;
+    char c;
+
+    while (NULL != (f = fcgi_idle)) {
+	fcgi_idle = f->next;
+	fcgi_nidle--;
+	/* still open and nothing unexpected pending? */
+	if (-1 == recv(f->fd,&c,1,MSG_PEEK | MSG_DONTWAIT) && EAGAIN == errno) {
+	    fd = f->fd;
+	    memset(f,0,sizeof(*f));
+	    f->fd = fd;
+	    return f;
+	}
+	close(f->fd);
+	free(f);
+    }
+    return fcgi_connect(status);
+}
+
+static void
+fcgi_put(struct FCGI *f)
+{
+    if (f->done && !f->broken && fcgi_nidle < FCGI_KEEP) {
+	f->next   = fcgi_idle;
+	fcgi_idle = f;
+	fcgi_nidle++;
+	return;
+    }
+    close(f->fd);
+    free(f);
+}
+
+/* ---------------------------------------------------------------------- */
+/* request                                                                */
+
+struct FCGI_BUF {
+    char *buf;
+    int  len,size;
+};
+
+static void
+fcgi_len(struct FCGI_BUF *p, int len)
+{
+    if (len < 128) {
+	p->buf[p->len++] = len;
+    } else {
+	p->buf[p->len++] = (len >> 24) | 0x80;
+	p->buf[p->len++] = len >> 16;
+	p->buf[p->len++] = len >> 8;
+	p->buf[p->len++] = len;
+    }
+}
+
+static void
+fcgi_param(void *ctx, char *name, char *value)
+{
+    struct FCGI_BUF *p = ctx;
+    int nlen = strlen(name), vlen = strlen(value);
+
+    if (p->len + nlen + vlen + 8 > p->size) {
+	p->len = p->size + 1; /* overflow, checked by the caller */
+	return;
+    }
+    fcgi_len(p,nlen);
+    fcgi_len(p,vlen);
+    memcpy(p->buf + p->len, name, nlen);
+    p->len += nlen;
+    memcpy(p->buf + p->len, value, vlen);
+    p->len += vlen;
+}
+
+static void
+fcgi_head(unsigned char *h, int type, int len)
+{
+    h[0] = FCGI_VERSION;
+    h[1] = type;
+    h[2] = 0;
+    h[3] = FCGI_ID;
+    h[4] = len >> 8;
+    h[5] = len;
+    h[6] = 0;
+    h[7] = 0;
+}
+
+void
+fcgi_request(struct REQUEST *req)
+{
+    struct FCGI_BUF p;
+    struct FCGI   *f;
+    struct iovec  iov[16];
+    unsigned char begin[16], heads[4][8], end[16];
+    int           i, n, chunk, total, status;
+
+    p.size = 2*max_header + 4096;
+    if (p.size > POOL_MAX)
+	p.size = POOL_MAX;
+    p.len = 0;
+    if (NULL == (p.buf = pool_get(p.size))) {
+	mkerror(req,500,0);
+	return;
+    }
+    cgi_vars(req,fcgi_param,&p);
+    if (p.len > p.size) {
+	pool_put(p.buf,p.size);
+	mkerror(req,500,0);
+	return;
+    }
+    if (NULL == (f = fcgi_get(&status))) {
+	pool_put(p.buf,p.size);
+	mkerror(req,status,0);
+	return;
+    }
+
+    /* begin request, params, empty params, empty stdin (unless there is a body) */
+    fcgi_head(begin, FCGI_BEGIN_REQUEST, 8);
+    memset(begin+8,0,8);
+    begin[9]  = FCGI_RESPONDER;
+    begin[10] = FCGI_KEEP_CONN;
+    iov[0].iov_base = begin;
+    iov[0].iov_len  = 16;
+    n = 1;
+    total = 16;
+    for (i = 0; i < p.len; i += chunk) {
+	chunk = p.len - i;
+	if (chunk > FCGI_RECORD_MAX)
+	    chunk = FCGI_RECORD_MAX;
+	fcgi_head(heads[n/2], FCGI_PARAMS, chunk);
+	iov[n].iov_base   = heads[n/2];
+	iov[n++].iov_len  = 8;
+	iov[n].iov_base   = p.buf + i;
+	iov[n++].iov_len  = chunk;
+	total += 8 + chunk;
+    }
+    fcgi_head(end, FCGI_PARAMS, 0);
+    fcgi_head(end+8, FCGI_STDIN, 0);
+    iov[n].iov_base  = end;
+    iov[n++].iov_len = IN_NONE == req->inmode ? 16 : 8;
+    total += iov[n-1].iov_len;
+
+    /*
+     * The socket is new or idle, so the send buffer is empty and the
+     * request (at most POOL_MAX) fits in.  A short write is an error.
+     */
+    if (total != writev(f->fd,iov,n)) {
+	xperror(LOG_WARNING,"fastcgi write",req->peerhost);
+	pool_put(p.buf,p.size);
+	f->broken = 1;
+	fcgi_put(f);
+	mkerror(req,502,0);
+	return;
+    }
+    pool_put(p.buf,p.size);
+
+    if (debug)
+	fprintf(stderr,"%03d: fastcgi: request sent (fd %d, %d bytes)\n",
+		req->fd,f->fd,total);
+    req->fcgi    = f;
+    req->cgipipe = f->fd;
+    req->state   = STATE_CGI_HEADER;
+    if (IN_NONE != req->inmode)
+	req->infd = f->fd;
+}
+
+/*
+ * write(2) lookalike for the request body, wraps it into FCGI_STDIN
+ * records.  len 0 writes the empty record which ends the stream and
+ * returns 0 once that is out.
+ */
+int
+fcgi_write(struct REQUEST *req, char *buf, int len)
+{
+    struct FCGI  *f = req->fcgi;
+    struct iovec iov[2];
+    int          n, rc;
+
+    if (0 == f->ohleft && 0 == f->out) {
+	/* start a new record */
+	f->out = len > FCGI_RECORD_MAX ? FCGI_RECORD_MAX : len;
+	fcgi_head(f->ohdr, FCGI_STDIN, f->out);
+	f->ohleft = 8;
+    }
+    n = len > f->out ? f->out : len;
+    iov[0].iov_base = f->ohdr + 8 - f->ohleft;
+    iov[0].iov_len  = f->ohleft;
+    iov[1].iov_base = buf;
+    iov[1].iov_len  = n;
+    rc = writev(f->fd, iov, 2);
+    if (-1 == rc) {
+	if (EAGAIN != errno && EINTR != errno)
+	    f->broken = 1;
+	return -1;
+    }
+    if (rc < f->ohleft) {
+	f->ohleft -= rc;
+	errno = EAGAIN;
+	return -1;
+    }
+    rc -= f->ohleft;
+    f->ohleft = 0;
+    f->out   -= rc;
+    if (0 == len)
+	return 0;
+    if (0 == rc) {
+	errno = EAGAIN;
+	return -1;
+    }
+    return rc;
+}
+
+/* ---------------------------------------------------------------------- */
+/* response                                                               */
+
+/*
+ * Strip the record framing from the len bytes in buf, in place.
+ * Returns the number of stdout bytes left in buf, -1 on errors.
+ */
+static int
+fcgi_decode(struct REQUEST *req, struct FCGI *f, char *buf, int len)
+{
+    char *in = buf, *out = buf, *end = buf+len;
+    int n;
+
+    while (in < end) {
+	if (f->done) {
+	    /* nothing may follow the end of the request */
+	    f->broken = 1;
+	    return -1;
+	}
+	if (f->hlen < 8) {
+	    f->hdr[f->hlen++] = *in++;
+	    if (f->hlen < 8)
+		continue;
+	    if (FCGI_VERSION != f->hdr[0])
+		return -1;
+	    f->type = f->hdr[1];
+	    f->left = f->hdr[4] << 8 | f->hdr[5];
+	    f->pad  = f->hdr[6];
+	} else if (f->left) {
+	    n = end - in;
+	    if (n > f->left)
+		n = f->left;
+	    if (FCGI_STDOUT == f->type) {
+		memmove(out,in,n);
+		out += n;
+	    } else if (FCGI_STDERR == f->type && debug) {
+		fprintf(stderr,"%03d: fastcgi: stderr: %.*s\n",req->fd,n,in);
+	    }
+	    in += n;
+	    f->left -= n;
+	} else if (f->pad) {
+	    n = end - in;
+	    if (n > f->pad)
+		n = f->pad;
+	    in += n;
+	    f->pad -= n;
+	}
+	if (8 == f->hlen && 0 == f->left && 0 == f->pad) {
+	    /* record complete */
+	    if (FCGI_END_REQUEST == f->type)
+		f->done = 1;
+	    f->hlen = 0;
+	}
+    }
+    return out - buf;
+}
+
+/* read(2) lookalike for the cgi code, returns 0 once the request is done */
+int
+fcgi_read(struct REQUEST *req, char *buf, int len)
+{
+    struct FCGI *f = req->fcgi;
+    int rc;
+
+    for (;;) {
+	if (f->done)
+	    return 0;
+	rc = read(f->fd,buf,len);
+	if (rc <= 0) {
+	    if (0 == rc || EAGAIN != errno)
+		f->broken = 1;
+	    return rc;
+	}
+	rc = fcgi_decode(req,f,buf,rc);
+	if (rc < 0) {
+	    f->broken = 1;
+	    errno = EIO;
+	    return -1;
+	}
+	if (rc > 0)
+	    return rc;
+    }
+}
+
+/* request is finished (or aborted), hand back the connection */
+void
+fcgi_release(struct REQUEST *req)
+{
+    struct FCGI *f = req->fcgi;
+    char buf[256];
+
+    /*
+     * Responses with Content-Length are complete before we have seen
+     * FCGI_END_REQUEST.  Usually it is in the socket buffer already,
+     * anything else (stdout data, EAGAIN) means we can't reuse.
+     */
+    if (!f->done && !f->broken && 0 != fcgi_read(req,buf,sizeof(buf)))
+	f->broken = 1;
+    if (-1 != req->infd)
+	/* stdin stream not finished */
+	f->broken = 1;
+    fcgi_put(f);
+    req->fcgi = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+/* workers                                                                */
+
+static int
+fcgi_fork(void)
+{
+    struct sigaction act;
+    int pid;
+
+    switch (pid = fork()) {
+    case -1:
+	xperror(LOG_ERR,"fork",NULL);
+	return 0;
+    case 0:
+	/* FastCGI convention: listening socket is fd 0 */
+	dup2(fcgi_listen,0);
+	close(fcgi_listen);
+	memset(&act,0,sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_DFL;
+	sigaction(SIGPIPE,&act,NULL);
+	sigaction(SIGCHLD,&act,NULL);
+	execl(fcgi_program,fcgi_program,NULL);
+	xperror(LOG_ERR,"fastcgi exec",NULL);
+	exit(1);
+    }
+    return pid;
+}
+
+void
+fcgi_spawn(void)
+{
+    struct sockaddr_un addr;
+    struct sigaction act;
+    int i;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,fcgi_socket,sizeof(addr.sun_path)-1);
+
+    unlink(fcgi_socket);
+    if (-1 == (fcgi_listen = socket(PF_UNIX,SOCK_STREAM,0)) ||
+	-1 == bind(fcgi_listen,(struct sockaddr*)&addr,sizeof(addr)) ||
+	-1 == listen(fcgi_listen,SOMAXCONN)) {
+	xperror(LOG_ERR,"fastcgi socket",NULL);
+	exit(1);
+    }
+    close_on_exec(fcgi_listen);
+
+    /*
+     * With SIGCHLD ignored dead workers are reaped at once and their
+     * pids may be reused by anyone.  Reap them ourself (CGI children
+     * too) in fcgi_check(), so a pid in fcgi_pids[] is always ours.
+     */
+    memset(&act,0,sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD,&act,NULL);
+
+    if (fcgi_workers > FCGI_MAX_WORKERS)
+	fcgi_workers = FCGI_MAX_WORKERS;
+    for (i = 0; i < fcgi_workers; i++)
+	fcgi_pids[i] = fcgi_fork();
+    if (debug)
+	fprintf(stderr,"fastcgi: %d workers \"%s\" on %s\n",
+		fcgi_workers,fcgi_program,fcgi_socket);
+}
+
+/* collect exited children, clear the slots of dead workers */
+static void
+fcgi_reap(void)
+{
+    int pid, status, i;
+
+    while ((pid = waitpid(-1,&status,WNOHANG)) > 0)
+	for (i = 0; i < fcgi_workers; i++)
+	    if (fcgi_pids[i] == pid)
+		fcgi_pids[i] = 0;
+}
+
+/* restart workers which died, from the main thread */
+void
+fcgi_check(void)
+{
+    static time_t last;
+    int i;
+
+    if (last == now)
+	return;
+    last = now;
+    fcgi_reap();
+    for (i = 0; i < fcgi_workers; i++) {
+	if (fcgi_pids[i])
+	    continue;
+	if (debug)
+	    fprintf(stderr,"fastcgi: restarting worker %d\n",i);
+	fcgi_pids[i] = fcgi_fork();
+    }
+}
+
+void
+fcgi_stop(void)
+{
+    int i;
+
+    /* not reaped yet, so the pids can't have been reused */
+    fcgi_reap();
+    for (i = 0; i < fcgi_workers; i++)
+	if (fcgi_pids[i])
+	    kill(fcgi_pids[i],SIGTERM);
+    unlink(fcgi_socket);
+}
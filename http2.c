@@ -0,0 +1,1608 @@
+/*
+ * HTTP/2 (RFC 9113) with HPACK header compression (RFC 7541)
+ *
+ * Clients get here either with prior knowledge (h2c, the connection
+ * preface is the first thing on the wire) or by negotiating "h2" via
+ * ALPN on https connections.
+ *
+ * The connection keeps its REQUEST, each stream gets a REQUEST of
+ * its own.  The header block of a stream is turned back into a
+ * HTTP/1.x style request and handed to scan_request() + parse_request(),
+ * so the usual file, range, listing and cgi code builds the response.
+ * The HTTP/1.1 response header is converted into a HEADERS frame and
+ * the body goes out in DATA frames, file data with sendfile() between
+ * the frame headers.
+ *
+ * There is no prioritization (streams are served round-robin) and no
+ * server push.  Request bodies are not used (GET and HEAD only), DATA
+ * frames from the client are just acknowledged.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "httpd.h"
+
+#define H2_PREFACE       "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN   24
+
+/* frame types */
+#define H2_DATA           0x0
+#define H2_HEADERS        0x1
+#define H2_PRIORITY       0x2
+#define H2_RST_STREAM     0x3
+#define H2_SETTINGS       0x4
+#define H2_PUSH_PROMISE   0x5
+#define H2_PING           0x6
+#define H2_GOAWAY         0x7
+#define H2_WINDOW_UPDATE  0x8
+#define H2_CONTINUATION   0x9
+
+/* frame flags */
+#define H2_END_STREAM     0x01
+#define H2_ACK            0x01
+#define H2_END_HEADERS    0x04
+#define H2_PADDED         0x08
+#define H2_PRIO           0x20
+
+/* settings */
+#define H2_SET_HEADER_TABLE_SIZE      0x1
+#define H2_SET_ENABLE_PUSH            0x2
+#define H2_SET_MAX_CONCURRENT_STREAMS 0x3
+#define H2_SET_INITIAL_WINDOW_SIZE    0x4
+#define H2_SET_MAX_FRAME_SIZE         0x5
+#define H2_SET_MAX_HEADER_LIST_SIZE   0x6
+
+/* error codes */
+#define H2_NO_ERROR            0x0
+#define H2_PROTOCOL_ERROR      0x1
+#define H2_INTERNAL_ERROR      0x2
+#define H2_FLOW_CONTROL_ERROR  0x3
+#define H2_FRAME_SIZE_ERROR    0x6
+#define H2_REFUSED_STREAM      0x7
+#define H2_COMPRESSION_ERROR   0x9
+#define H2_ENHANCE_YOUR_CALM   0xb
+
+#define H2_FRAME_MAX      16384   /* we never raise SETTINGS_MAX_FRAME_SIZE */
+#define H2_WINDOW         65535   /* initial flow control window */
+#define H2_WINDOW_MAX     0x7fffffff
+#define H2_MAX_STREAMS    64
+#define H2_TABLE_SIZE     4096    /* hpack dynamic table, both directions */
+#define H2_TABLE_ENTRIES  (H2_TABLE_SIZE/32)
+#define H2_INBUF          (2*H2_FRAME_MAX)
+#define H2_OUTBUF         (4*H2_FRAME_MAX)
+#define H2_CTLBUF         1024
+
+/* what h2_piece() found */
+#define PIECE_NONE        0       /* body complete */
+#define PIECE_MEM         1
+#define PIECE_FILE        2
+#define PIECE_WAIT        3       /* cgi has nothing for us right now */
+
+#ifdef USE_SSL
+# define H2_TLS           with_ssl
+#else
+# define H2_TLS           0
+#endif
+
+struct HPACK_ENTRY {
+    int  nlen,vlen;
+    char data[];                  /* name, then value */
+};
+
+struct HPACK {
+    struct HPACK_ENTRY *ent[H2_TABLE_ENTRIES];
+    int  first,count;             /* ring, ent[first] is the newest */
+    int  size,max;
+};
+
+struct H2STREAM {
+    struct REQUEST   req;
+    unsigned int     id;
+    int64_t          window;      /* send window */
+    off_t            left;        /* body bytes to go, -1 if unknown */
+    int              hsent;       /* HEADERS is out */
+    int              eof;         /* cgi script is done */
+    int              cgiwait;     /* waiting for cgi output */
+    struct H2STREAM  *next;
+};
+
+struct H2CONN {
+    struct H2STREAM  *streams;    /* by id */
+    int              nstreams;
+    unsigned int     last_id;     /* highest stream id seen */
+    int64_t          window;      /* connection send window */
+    int64_t          init_window; /* peer's SETTINGS_INITIAL_WINDOW_SIZE */
+    int              max_frame;   /* peer's SETTINGS_MAX_FRAME_SIZE */
+    int              unacked;     /* DATA received, no WINDOW_UPDATE yet */
+    int              shutdown;    /* peer sent GOAWAY */
+    int              failed;      /* we sent GOAWAY */
+    int              stalled;     /* input waits for ctl space */
+
+    /* hpack */
+    struct HPACK     dec,enc;
+    int              enc_update;  /* must send a table size update */
+
+    /* header block in the making */
+    unsigned char    *hblock;
+    int              lhblock;
+    unsigned int     hb_id;       /* HEADERS stream id */
+    unsigned int     cont_id;     /* want CONTINUATION for this one */
+    char             *hdrs;       /* decoded, as HTTP/1.1 header lines */
+    int              lhdrs;
+
+    /* input */
+    unsigned char    *in;
+    int              lin;
+
+    /* output: ctl frames, then out, then the file segment */
+    unsigned char    ctl[H2_CTLBUF];
+    int              lctl;
+    unsigned char    *out;
+    int              lout,wout;
+    int              sfd,sfclose;
+    off_t            soff,slen;
+};
+
+/* header block decoding results */
+struct H2REQ {
+    char method[MAX_MISC+1];
+    char path[MAX_PATH+1];
+    char authority[MAX_HOST+1];
+    int  regular;                 /* seen a regular field */
+    int  bad;                     /* malformed */
+};
+
+/* ---------------------------------------------------------------------- */
+/* hpack static table + huffman code                                      */
+
+static struct {
+    char *name;
+    char *value;
+} hpack_static[] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+#define HPACK_STATIC  61
+
+/* code lengths, the (canonical) code is built by init_http2() */
+static const unsigned char huff_len[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+static unsigned int   huff_code[257];
+static unsigned short huff_count[31];     /* codes per length */
+static unsigned short huff_sym[257];      /* symbols, by code */
+
+void
+init_http2(void)
+{
+    unsigned int code = 0;
+    int len, sym, i = 0;
+
+    for (len = 1; len <= 30; len++) {
+	for (sym = 0; sym < 257; sym++) {
+	    if (huff_len[sym] != len)
+		continue;
+	    huff_sym[i++]  = sym;
+	    huff_code[sym] = code++;
+	    huff_count[len]++;
+	}
+	code <<= 1;
+    }
+}
+
+/* returns the length, -1 on errors, -2 if dst is too small */
+static int
+huff_decode(unsigned char *src, int len, char *dst, int size)
+{
+    int code = 0, first = 0, index = 0, bits = 0, ones = 1;
+    int i, b, bit, n = 0;
+
+    for (i = 0; i < len; i++) {
+	for (b = 7; b >= 0; b--) {
+	    bit   = (src[i] >> b) & 1;
+	    code |= bit;
+	    ones &= bit;
+	    bits++;
+	    if (code - first < huff_count[bits]) {
+		if (256 == huff_sym[index + code - first])
+		    return -1;
+		if (n == size)
+		    return -2;
+		dst[n++] = huff_sym[index + code - first];
+		code = first = index = bits = 0;
+		ones = 1;
+		continue;
+	    }
+	    if (30 == bits)
+		return -1;
+	    index += huff_count[bits];
+	    first += huff_count[bits];
+	    first <<= 1;
+	    code  <<= 1;
+	}
+    }
+    /* padding: up to 7 bits of EOS, i.e. ones */
+    if (bits > 7 || !ones)
+	return -1;
+    return n;
+}
+
+static int
+huff_size(char *src, int len)
+{
+    int i, bits = 0;
+
+    for (i = 0; i < len; i++)
+	bits += huff_len[(unsigned char)src[i]];
+    return (bits + 7) / 8;
+}
+
+static int
+huff_encode(char *src, int len, unsigned char *dst)
+{
+    uint64_t acc = 0;
+    int i, c, bits = 0, n = 0;
+
+    for (i = 0; i < len; i++) {
+	c = (unsigned char)src[i];
+	acc   = (acc << huff_len[c]) | huff_code[c];
+	bits += huff_len[c];
+	while (bits >= 8) {
+	    bits -= 8;
+	    dst[n++] = acc >> bits;
+	}
+    }
+    if (bits)
+	dst[n++] = (acc << (8 - bits)) | (0xff >> bits);
+    return n;
+}
+
+/* ---------------------------------------------------------------------- */
+/* hpack dynamic table                                                    */
+
+static void
+hpack_evict(struct HPACK *t, int max)
+{
+    struct HPACK_ENTRY *e;
+
+    while (t->count && t->size > max) {
+	e = t->ent[(t->first + t->count - 1) % H2_TABLE_ENTRIES];
+	t->size -= e->nlen + e->vlen + 32;
+	t->count--;
+	free(e);
+    }
+}
+
+static int
+hpack_insert(struct HPACK *t, char *name, int nlen, char *value, int vlen)
+{
+    struct HPACK_ENTRY *e;
+    int size = nlen + vlen + 32;
+
+    hpack_evict(t, t->max - size);
+    if (size > t->max)
+	return 0; /* too big, leaves the table empty */
+    if (NULL == (e = malloc(sizeof(*e) + nlen + vlen)))
+	return -1;
+    e->nlen = nlen;
+    e->vlen = vlen;
+    memcpy(e->data, name, nlen);
+    memcpy(e->data + nlen, value, vlen);
+    t->first = (t->first + H2_TABLE_ENTRIES - 1) % H2_TABLE_ENTRIES;
+    t->ent[t->first] = e;
+    t->count++;
+    t->size += size;
+    return 0;
+}
+
+static int
+hpack_get(struct HPACK *t, int index, char **name, int *nlen,
+	  char **value, int *vlen)
+{
+    struct HPACK_ENTRY *e;
+
+    if (index < 1)
+	return -1;
+    if (index <= HPACK_STATIC) {
+	*name  = hpack_static[index].name;
+	*nlen  = strlen(*name);
+	*value = hpack_static[index].value;
+	*vlen  = strlen(*value);
+	return 0;
+    }
+    index -= HPACK_STATIC + 1;
+    if (index >= t->count)
+	return -1;
+    e = t->ent[(t->first + index) % H2_TABLE_ENTRIES];
+    *name  = e->data;
+    *nlen  = e->nlen;
+    *value = e->data + e->nlen;
+    *vlen  = e->vlen;
+    return 0;
+}
+
+/* full match => index, name only => *nindex */
+static int
+hpack_find(struct HPACK *t, char *name, int nlen, char *value, int vlen,
+	   int *nindex)
+{
+    struct HPACK_ENTRY *e;
+    int i;
+
+    *nindex = 0;
+    for (i = 1; i <= HPACK_STATIC; i++) {
+	if (0 != strncmp(hpack_static[i].name, name, nlen) ||
+	    0 != hpack_static[i].name[nlen])
+	    continue;
+	if (0 == strncmp(hpack_static[i].value, value, vlen) &&
+	    0 == hpack_static[i].value[vlen])
+	    return i;
+	if (!*nindex)
+	    *nindex = i;
+    }
+    for (i = 0; i < t->count; i++) {
+	e = t->ent[(t->first + i) % H2_TABLE_ENTRIES];
+	if (e->nlen != nlen || 0 != memcmp(e->data, name, nlen))
+	    continue;
+	if (e->vlen == vlen && 0 == memcmp(e->data + nlen, value, vlen))
+	    return HPACK_STATIC + 1 + i;
+	if (!*nindex)
+	    *nindex = HPACK_STATIC + 1 + i;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* hpack coding                                                           */
+
+static int
+hpack_int(unsigned char **p, unsigned char *end, int prefix, int *value)
+{
+    int max = (1 << prefix) - 1, shift = 0, v;
+    unsigned char c;
+
+    if (*p >= end)
+	return -1;
+    v = *(*p)++ & max;
+    if (v == max) {
+	do {
+	    if (*p >= end || shift > 21)
+		return -1;
+	    c = *(*p)++;
+	    v += (c & 0x7f) << shift;
+	    shift += 7;
+	} while (c & 0x80);
+    }
+    *value = v;
+    return 0;
+}
+
+/* returns the length, -1 on errors, -2 if dst is too small */
+static int
+hpack_string(unsigned char **p, unsigned char *end, char *dst, int size)
+{
+    int huff, len, n;
+
+    if (*p >= end)
+	return -1;
+    huff = **p & 0x80;
+    if (0 != hpack_int(p, end, 7, &len) || len > end - *p)
+	return -1;
+    if (huff) {
+	n = huff_decode(*p, len, dst, size);
+    } else if (len > size) {
+	n = -2;
+    } else {
+	memcpy(dst, *p, len);
+	n = len;
+    }
+    *p += len;
+    return n;
+}
+
+static int
+hpack_put_int(unsigned char *dst, int prefix, int flags, int value)
+{
+    int max = (1 << prefix) - 1, n = 0;
+
+    if (value < max) {
+	dst[n++] = flags | value;
+	return n;
+    }
+    dst[n++] = flags | max;
+    for (value -= max; value >= 128; value >>= 7)
+	dst[n++] = (value & 0x7f) | 0x80;
+    dst[n++] = value;
+    return n;
+}
+
+static int
+hpack_put_string(unsigned char *dst, char *str, int len)
+{
+    int n, hlen = huff_size(str, len);
+
+    if (hlen < len) {
+	n = hpack_put_int(dst, 7, 0x80, hlen);
+	return n + huff_encode(str, len, dst + n);
+    }
+    n = hpack_put_int(dst, 7, 0x00, len);
+    memcpy(dst + n, str, len);
+    return n + len;
+}
+
+/* encode one field, the name must be lowercase */
+static int
+hpack_put_field(struct H2CONN *c, unsigned char *dst, char *name, int nlen,
+		char *value, int vlen, int indexing)
+{
+    int index, nindex, n;
+
+    if (0 != (index = hpack_find(&c->enc, name, nlen, value, vlen, &nindex)))
+	return hpack_put_int(dst, 7, 0x80, index);
+    if (indexing)
+	n = hpack_put_int(dst, 6, 0x40, nindex);
+    else
+	n = hpack_put_int(dst, 4, 0x00, nindex);
+    if (!nindex)
+	n += hpack_put_string(dst + n, name, nlen);
+    n += hpack_put_string(dst + n, value, vlen);
+    if (indexing && 0 != hpack_insert(&c->enc, name, nlen, value, vlen)) {
+	/* oom: send it without indexing, keeps the peer in sync */
+	dst[0] = 0x00;
+	return hpack_put_field(c, dst, name, nlen, value, vlen, 0);
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------- */
+/* header block => HTTP/1.1 request                                       */
+
+static int
+h2_name_is(char *name, int nlen, char *str)
+{
+    return nlen == strlen(str) && 0 == memcmp(name, str, nlen);
+}
+
+/* names must be lowercase tokens, values must not contain CR, LF, NUL */
+static int
+h2_field_ok(char *name, int nlen, char *value, int vlen)
+{
+    int i;
+
+    if (0 == nlen)
+	return 0;
+    for (i = 0; i < nlen; i++)
+	if (name[i] <= ' ' || name[i] >= 0x7f || name[i] == ':' ||
+	    (name[i] >= 'A' && name[i] <= 'Z'))
+	    return 0;
+    for (i = 0; i < vlen; i++)
+	if (value[i] == '\r' || value[i] == '\n' || value[i] == 0)
+	    return 0;
+    return 1;
+}
+
+static int
+h2_field(struct H2CONN *c, struct H2REQ *r, char *name, int nlen,
+	 char *value, int vlen)
+{
+    char *dst = NULL;
+    int size = 0;
+
+    if (nlen > 0 && ':' == name[0]) {
+	/* pseudo header */
+	if (r->regular)
+	    r->bad = 1;
+	if (h2_name_is(name, nlen, ":method")) {
+	    dst  = r->method;
+	    size = sizeof(r->method);
+	} else if (h2_name_is(name, nlen, ":path")) {
+	    dst  = r->path;
+	    size = sizeof(r->path);
+	} else if (h2_name_is(name, nlen, ":authority")) {
+	    dst  = r->authority;
+	    size = sizeof(r->authority);
+	} else if (!h2_name_is(name, nlen, ":scheme")) {
+	    r->bad = 1;
+	}
+	if (NULL == dst)
+	    return 0;
+	if (vlen >= size || !h2_field_ok("x", 1, value, vlen)) {
+	    r->bad = 1;
+	    return 0;
+	}
+	memcpy(dst, value, vlen);
+	dst[vlen] = 0;
+	return 0;
+    }
+
+    if (!h2_field_ok(name, nlen, value, vlen)) {
+	r->bad = 1;
+	return 0;
+    }
+    r->regular = 1;
+    if (h2_name_is(name, nlen, "connection")        ||
+	h2_name_is(name, nlen, "keep-alive")        ||
+	h2_name_is(name, nlen, "proxy-connection")  ||
+	h2_name_is(name, nlen, "transfer-encoding") ||
+	h2_name_is(name, nlen, "upgrade")           ||
+	h2_name_is(name, nlen, "te"))
+	/* hop-by-hop, no meaning here */
+	return 0;
+    if (c->lhdrs + nlen + vlen + 4 > max_header)
+	return -2;
+    memmove(c->hdrs + c->lhdrs, name, nlen);
+    c->lhdrs += nlen;
+    c->hdrs[c->lhdrs++] = ':';
+    c->hdrs[c->lhdrs++] = ' ';
+    memmove(c->hdrs + c->lhdrs, value, vlen);
+    c->lhdrs += vlen;
+    c->hdrs[c->lhdrs++] = '\r';
+    c->hdrs[c->lhdrs++] = '\n';
+    return 0;
+}
+
+/*
+ * Literal strings are decoded straight into c->hdrs, where the
+ * header line is going to be, so h2_field() doesn't move them.
+ * Returns -1 on compression errors, -2 if the list is too big.
+ */
+static int
+h2_decode(struct H2CONN *c, struct H2REQ *r)
+{
+    unsigned char *p = c->hblock, *end = c->hblock + c->lhblock;
+    char *name, *value, *dst;
+    int index, nlen, vlen, indexing, rc;
+
+    c->lhdrs = 0;
+    while (p < end) {
+	if (*p & 0x80) {
+	    /* indexed field */
+	    if (0 != hpack_int(&p, end, 7, &index) ||
+		0 != hpack_get(&c->dec, index, &name, &nlen, &value, &vlen))
+		return -1;
+	} else if (0x20 == (*p & 0xe0)) {
+	    /* dynamic table size update */
+	    if (0 != hpack_int(&p, end, 5, &index) || index > H2_TABLE_SIZE)
+		return -1;
+	    c->dec.max = index;
+	    hpack_evict(&c->dec, index);
+	    continue;
+	} else {
+	    /* literal, with (01) or without (0000) or never (0001) indexing */
+	    indexing = *p & 0x40;
+	    if (0 != hpack_int(&p, end, indexing ? 6 : 4, &index))
+		return -1;
+	    dst = c->hdrs + c->lhdrs;
+	    if (index) {
+		if (0 != hpack_get(&c->dec, index, &name, &nlen, &value, &vlen))
+		    return -1;
+		if (c->lhdrs + nlen + 2 > max_header)
+		    return -2;
+		memmove(dst, name, nlen);
+	    } else {
+		nlen = hpack_string(&p, end, dst, max_header - c->lhdrs - 2);
+		if (nlen < 0)
+		    return nlen;
+	    }
+	    name  = dst;
+	    value = dst + nlen + 2;
+	    vlen  = hpack_string(&p, end, value,
+				 max_header - c->lhdrs - nlen - 4);
+	    if (vlen < 0)
+		return vlen;
+	    if (indexing && 0 != hpack_insert(&c->dec, name, nlen, value, vlen))
+		return -1;
+	}
+	if (0 != (rc = h2_field(c, r, name, nlen, value, vlen)))
+	    return rc;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+/* frames                                                                 */
+
+static uint32_t
+h2_get32(unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void
+h2_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void
+h2_put_head(unsigned char *p, int len, int type, int flags, unsigned int id)
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p+5, id);
+}
+
+/* queue a control frame */
+static void
+h2_ctl(struct H2CONN *c, int type, int flags, unsigned int id,
+       unsigned char *payload, int len)
+{
+    if (c->lctl + 9 + len > H2_CTLBUF) {
+	/* h2_input() stalls long before, shouldn't happen */
+	if (debug)
+	    fprintf(stderr,"h2: ctl buffer full, frame %d dropped\n",type);
+	return;
+    }
+    h2_put_head(c->ctl + c->lctl, len, type, flags, id);
+    memcpy(c->ctl + c->lctl + 9, payload, len);
+    c->lctl += 9 + len;
+}
+
+static void
+h2_rst(struct H2CONN *c, unsigned int id, int error)
+{
+    unsigned char p[4];
+
+    h2_put32(p, error);
+    h2_ctl(c, H2_RST_STREAM, 0, id, p, 4);
+}
+
+static void
+h2_goaway(struct REQUEST *req, int error)
+{
+    struct H2CONN *c = req->h2;
+    unsigned char p[8];
+
+    if (debug)
+	fprintf(stderr,"%03d: h2: goaway, error %d\n",req->fd,error);
+    h2_put32(p, c->last_id);
+    h2_put32(p+4, error);
+    h2_ctl(c, H2_GOAWAY, 0, 0, p, 8);
+    c->failed = 1;
+}
+
+/* ---------------------------------------------------------------------- */
+/* streams                                                                */
+
+static struct H2STREAM*
+h2_stream(struct H2CONN *c, unsigned int id)
+{
+    struct H2STREAM *s;
+
+    for (s = c->streams; NULL != s; s = s->next)
+	if (s->id == id)
+	    return s;
+    return NULL;
+}
+
+static void
+h2_stream_free(struct H2CONN *c, struct H2STREAM *s, int log)
+{
+    struct REQUEST  *req = &s->req;
+    struct H2STREAM **p;
+
+    for (p = &c->streams; *p != s; p = &(*p)->next)
+	;
+    *p = s->next;
+    c->nstreams--;
+
+    if (log)
+	access_log(req,now);
+    stats_request(req);
+    if (req->bfd != -1) {
+	if (c->slen && c->sfd == req->bfd)
+	    c->sfclose = 1; /* sendfile() isn't done with it yet */
+	else
+	    close(req->bfd);
+    }
+    cgi_done(req);
+    status_done(req);
+    if (req->dir)
+	free_dir(req->dir);
+    if (req->r_start) free(req->r_start);
+    if (req->r_end)   free(req->r_end);
+    if (req->r_head)  free(req->r_head);
+    if (req->r_hlen)  free(req->r_hlen);
+    if (req->hdr && req->hdr != req->hinline)
+	free(req->hdr);
+    release_hreq(req);
+    free(s);
+}
+
+/* a new stream, run the request through the HTTP/1.1 code */
+static void
+h2_stream_new(struct REQUEST *req, struct H2REQ *r, unsigned int id)
+{
+    struct H2CONN   *c = req->h2;
+    struct H2STREAM *s, **p;
+    struct REQUEST  *sreq;
+    int             need, size, n;
+
+    if (NULL == (s = malloc(sizeof(*s)))) {
+	h2_rst(c, id, H2_REFUSED_STREAM);
+	return;
+    }
+    memset(s,0,sizeof(*s));
+    s->id     = id;
+    s->window = c->init_window;
+    s->left   = -1;
+    sreq = &s->req;
+    sreq->fd      = req->fd;
+    sreq->bfd     = -1;
+    sreq->cgipipe = -1;
+    sreq->infd    = -1;
+    sreq->cors    = req->cors;
+    sreq->ping    = now;
+    sreq->tstart  = stats_us();
+    sreq->served  = req->served++;
+    memcpy(&sreq->peer, &req->peer, sizeof(sreq->peer));
+    strcpy(sreq->peerhost, req->peerhost);
+    strcpy(sreq->peerserv, req->peerserv);
+
+    need = strlen(r->method) + strlen(r->path) + strlen(r->authority) +
+	c->lhdrs + 32;
+    for (size = POOL_MIN; size < need && size < POOL_MAX; size *= 2)
+	;
+    if (size >= need && NULL != (sreq->hreq = pool_get(size))) {
+	sreq->ahreq = size;
+	n = sprintf(sreq->hreq, "%s %s HTTP/2.0\r\n", r->method, r->path);
+	if (r->authority[0])
+	    n += sprintf(sreq->hreq + n, "Host: %s\r\n", r->authority);
+	memcpy(sreq->hreq + n, c->hdrs, c->lhdrs);
+	n += c->lhdrs;
+	memcpy(sreq->hreq + n, "\r\n", 3);
+	sreq->hdata = n + 2;
+    }
+    if (debug)
+	fprintf(stderr,"%03d: h2: stream %u: %s %s\n",
+		req->fd, id, r->method, r->path);
+    if (sreq->hreq && 1 == scan_request(sreq))
+	parse_request(sreq);
+    else
+	mkerror(sreq,400,0);
+
+    for (p = &c->streams; NULL != *p; p = &(*p)->next)
+	;
+    *p = s;
+    c->nstreams++;
+}
+
+/* complete header block */
+static int
+h2_request(struct REQUEST *req)
+{
+    struct H2CONN *c = req->h2;
+    struct H2REQ  r;
+    unsigned int  id = c->hb_id;
+    int           rc;
+
+    /* always decode, keeps the hpack state in sync */
+    memset(&r,0,sizeof(r));
+    rc = h2_decode(c, &r);
+    c->lhblock = 0;
+    if (-1 == rc)
+	return H2_COMPRESSION_ERROR;
+    if (-2 == rc)
+	return H2_ENHANCE_YOUR_CALM;
+    if (0 == (id & 1))
+	return H2_PROTOCOL_ERROR;
+    if (id <= c->last_id)
+	return 0; /* trailers, or the stream is gone already */
+    c->last_id = id;
+    if (c->shutdown)
+	return 0;
+    if (r.bad || !r.method[0] || !r.path[0]) {
+	h2_rst(c, id, H2_PROTOCOL_ERROR);
+	return 0;
+    }
+    if (c->nstreams >= H2_MAX_STREAMS) {
+	h2_rst(c, id, H2_REFUSED_STREAM);
+	return 0;
+    }
+    h2_stream_new(req, &r, id);
+    return 0;
+}
+
+/* returns 0 or a connection error */
+static int
+h2_frame(struct REQUEST *req, int type, int flags, unsigned int id,
+	 unsigned char *p, int len)
+{
+    struct H2CONN   *c = req->h2;
+    struct H2STREAM *s;
+    unsigned char   wu[4];
+    uint32_t        v;
+    int             i, pad = 0;
+
+    if (debug > 1)
+	fprintf(stderr,"%03d: h2: frame %d, flags 0x%x, stream %u, len %d\n",
+		req->fd, type, flags, id, len);
+    if (c->cont_id && (H2_CONTINUATION != type || id != c->cont_id))
+	return H2_PROTOCOL_ERROR;
+
+    switch (type) {
+    case H2_DATA:
+	if (0 == id)
+	    return H2_PROTOCOL_ERROR;
+	/* body is not used, just keep the window open */
+	c->unacked += len;
+	if (c->unacked >= H2_WINDOW/2) {
+	    h2_put32(wu, c->unacked);
+	    h2_ctl(c, H2_WINDOW_UPDATE, 0, 0, wu, 4);
+	    c->unacked = 0;
+	}
+	return 0;
+    case H2_HEADERS:
+	if (0 == id)
+	    return H2_PROTOCOL_ERROR;
+	if (flags & H2_PADDED) {
+	    if (len < 1)
+		return H2_PROTOCOL_ERROR;
+	    pad = p[0];
+	    p++;
+	    len--;
+	}
+	if (flags & H2_PRIO) {
+	    if (len < 5)
+		return H2_PROTOCOL_ERROR;
+	    p   += 5;
+	    len -= 5;
+	}
+	if (pad > len)
+	    return H2_PROTOCOL_ERROR;
+	len -= pad;
+	c->hb_id   = id;
+	c->lhblock = 0;
+	/* fall through */
+    case H2_CONTINUATION:
+	if (H2_CONTINUATION == type && 0 == c->cont_id)
+	    return H2_PROTOCOL_ERROR;
+	if (c->lhblock + len > max_header)
+	    return H2_ENHANCE_YOUR_CALM;
+	memcpy(c->hblock + c->lhblock, p, len);
+	c->lhblock += len;
+	if (!(flags & H2_END_HEADERS)) {
+	    c->cont_id = id;
+	    return 0;
+	}
+	c->cont_id = 0;
+	return h2_request(req);
+    case H2_PRIORITY:
+	return 0;
+    case H2_RST_STREAM:
+	if (4 != len)
+	    return H2_FRAME_SIZE_ERROR;
+	if (0 == id)
+	    return H2_PROTOCOL_ERROR;
+	if (NULL != (s = h2_stream(c,id)))
+	    h2_stream_free(c,s,0);
+	return 0;
+    case H2_SETTINGS:
+	if (0 != id)
+	    return H2_PROTOCOL_ERROR;
+	if (flags & H2_ACK)
+	    return len ? H2_FRAME_SIZE_ERROR : 0;
+	if (len % 6)
+	    return H2_FRAME_SIZE_ERROR;
+	for (i = 0; i < len; i += 6) {
+	    v = h2_get32(p+i+2);
+	    switch (p[i] << 8 | p[i+1]) {
+	    case H2_SET_HEADER_TABLE_SIZE:
+		if (v > H2_TABLE_SIZE)
+		    v = H2_TABLE_SIZE;
+		if (v != c->enc.max) {
+		    c->enc.max = v;
+		    hpack_evict(&c->enc, v);
+		    c->enc_update = 1;
+		}
+		break;
+	    case H2_SET_ENABLE_PUSH:
+		if (v > 1)
+		    return H2_PROTOCOL_ERROR;
+		break;
+	    case H2_SET_INITIAL_WINDOW_SIZE:
+		if (v > H2_WINDOW_MAX)
+		    return H2_FLOW_CONTROL_ERROR;
+		for (s = c->streams; NULL != s; s = s->next)
+		    s->window += (int64_t)v - c->init_window;
+		c->init_window = v;
+		break;
+	    case H2_SET_MAX_FRAME_SIZE:
+		if (v < H2_FRAME_MAX || v > 0xffffff)
+		    return H2_PROTOCOL_ERROR;
+		c->max_frame = v;
+		break;
+	    }
+	}
+	h2_ctl(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+	return 0;
+    case H2_PUSH_PROMISE:
+	return H2_PROTOCOL_ERROR;
+    case H2_PING:
+	if (8 != len)
+	    return H2_FRAME_SIZE_ERROR;
+	if (0 != id)
+	    return H2_PROTOCOL_ERROR;
+	if (!(flags & H2_ACK))
+	    h2_ctl(c, H2_PING, H2_ACK, 0, p, 8);
+	return 0;
+    case H2_GOAWAY:
+	if (debug)
+	    fprintf(stderr,"%03d: h2: peer goaway\n",req->fd);
+	c->shutdown = 1;
+	return 0;
+    case H2_WINDOW_UPDATE:
+	if (4 != len)
+	    return H2_FRAME_SIZE_ERROR;
+	v = h2_get32(p) & 0x7fffffff;
+	if (0 == id) {
+	    if (0 == v)
+		return H2_PROTOCOL_ERROR;
+	    c->window += v;
+	    if (c->window > H2_WINDOW_MAX)
+		return H2_FLOW_CONTROL_ERROR;
+	} else if (NULL != (s = h2_stream(c,id))) {
+	    if (0 == v || s->window + v > H2_WINDOW_MAX) {
+		h2_rst(c, id, v ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+		h2_stream_free(c,s,0);
+	    } else {
+		s->window += v;
+	    }
+	}
+	return 0;
+    }
+    return 0; /* unknown frame types are ignored */
+}
+
+/* handle the complete frames in the input buffer */
+static void
+h2_input(struct REQUEST *req)
+{
+    struct H2CONN *c = req->h2;
+    unsigned char *p = c->in;
+    int left = c->lin, len, error;
+
+    while (left >= 9 && !c->failed && STATE_H2 == req->state) {
+	if (c->lctl > H2_CTLBUF - 64) {
+	    /* wait until the ctl frames are out */
+	    c->stalled = 1;
+	    break;
+	}
+	len = p[0] << 16 | p[1] << 8 | p[2];
+	if (len > H2_FRAME_MAX) {
+	    h2_goaway(req, H2_FRAME_SIZE_ERROR);
+	    break;
+	}
+	if (left < 9 + len)
+	    break;
+	error = h2_frame(req, p[3], p[4], h2_get32(p+5) & 0x7fffffff,
+			 p+9, len);
+	if (error) {
+	    h2_goaway(req, error);
+	    break;
+	}
+	p    += 9 + len;
+	left -= 9 + len;
+    }
+    if (c->failed)
+	left = 0;
+    memmove(c->in, p, left);
+    c->lin = left;
+}
+
+static void
+h2_read(struct REQUEST *req)
+{
+    struct H2CONN *c = req->h2;
+    int rc;
+
+    while (STATE_H2 == req->state && !c->stalled && !c->failed) {
+#ifdef USE_SSL
+	if (with_ssl)
+	    rc = ssl_read(req, (char*)c->in + c->lin, H2_INBUF - c->lin);
+	else
+#endif
+	    rc = read(req->fd, c->in + c->lin, H2_INBUF - c->lin);
+	switch (rc) {
+	case -1:
+	    if (errno == EAGAIN)
+		return;
+	    if (errno == EINTR)
+		continue;
+	    xperror(LOG_INFO,"read",req->peerhost);
+	    /* fall through */
+	case 0:
+	    req->state = STATE_CLOSE;
+	    return;
+	}
+	c->lin += rc;
+	h2_input(req);
+    }
+}
+
+/* ---------------------------------------------------------------------- */
+/* responses                                                              */
+
+/* headers which repeat from response to response go into the table */
+static int
+h2_indexing(char *name, int nlen)
+{
+    return h2_name_is(name, nlen, "server")        ||
+	h2_name_is(name, nlen, "accept-ranges")    ||
+	h2_name_is(name, nlen, "content-type")     ||
+	h2_name_is(name, nlen, "cache-control")    ||
+	h2_name_is(name, nlen, "access-control-allow-origin");
+}
+
+/* convert the HTTP/1.1 response header in req->hres */
+static void
+h2_headers(struct REQUEST *req, struct H2STREAM *s)
+{
+    struct H2CONN  *c = req->h2;
+    struct REQUEST *sreq = &s->req;
+    unsigned char  *frame = c->out + c->lout, *dst = frame + 9;
+    char           *h, *eol, *value, *end, name[64];
+    int            i, nlen, flags = H2_END_HEADERS;
+
+    if (c->enc_update) {
+	dst += hpack_put_int(dst, 5, 0x20, c->enc.max);
+	c->enc_update = 0;
+    }
+    /* "HTTP/1.1 200 OK" */
+    dst += hpack_put_field(c, dst, ":status", 7, sreq->hres + 9, 3, 0);
+
+    end = sreq->hres + sreq->lres;
+    for (h = strstr(sreq->hres, "\r\n") + 2; h < end; h = eol + 2) {
+	if (NULL == (eol = strstr(h, "\r\n")) || eol == h)
+	    break;
+	if (NULL == (value = memchr(h, ':', eol - h)))
+	    continue;
+	if ((nlen = value - h) >= sizeof(name))
+	    continue;
+	for (i = 0; i < nlen; i++)
+	    name[i] = tolower(h[i]);
+	for (value++; value < eol && (*value == ' ' || *value == '\t'); value++)
+	    ;
+	if (h2_name_is(name, nlen, "connection") ||
+	    h2_name_is(name, nlen, "keep-alive") ||
+	    h2_name_is(name, nlen, "transfer-encoding"))
+	    continue;
+	if (h2_name_is(name, nlen, "content-length") && -1 == sreq->cgipipe)
+	    s->left = strtoll(value, NULL, 10);
+	dst += hpack_put_field(c, dst, name, nlen, value, eol - value,
+			       h2_indexing(name, nlen));
+    }
+
+    /* body setup, as write_request() does */
+    if (sreq->ranges == 1) {
+	sreq->rh = -1;
+	sreq->rb = 0;
+	sreq->written = sreq->r_start[0];
+    } else if (sreq->ranges > 1) {
+	sreq->rh = 0;
+	sreq->rb = -1;
+    }
+
+    if (sreq->head_only || 0 == s->left)
+	flags |= H2_END_STREAM;
+    h2_put_head(frame, dst - frame - 9, H2_HEADERS, flags, s->id);
+    c->lout = dst - c->out;
+    s->hsent = 1;
+    if (flags & H2_END_STREAM)
+	h2_stream_free(c, s, 1);
+}
+
+/* next piece of the response body */
+static int
+h2_piece(struct H2STREAM *s, char **buf, off_t *off, off_t *len)
+{
+    struct REQUEST *req = &s->req;
+    int rc;
+
+    if (req->body) {
+	*buf = req->body + req->written;
+	*len = req->lbody - req->written;
+	return *len ? PIECE_MEM : PIECE_NONE;
+    }
+    if (req->cgipipe != -1) {
+	if (req->cgipos == req->cgilen) {
+	    if (s->eof)
+		return PIECE_NONE;
+	    rc = cgi_read(req, req->cgibuf, MAX_HEADER);
+	    if (-1 == rc && (EAGAIN == errno || EINTR == errno)) {
+		s->cgiwait = 1;
+		return PIECE_WAIT;
+	    }
+	    if (rc <= 0) {
+		if (-1 == rc)
+		    xperror(LOG_INFO,"cgi read",req->peerhost);
+		s->eof = 1;
+		return PIECE_NONE;
+	    }
+	    req->cgipos = 0;
+	    req->cgilen = rc;
+	}
+	*buf = req->cgibuf + req->cgipos;
+	*len = req->cgilen - req->cgipos;
+	return PIECE_MEM;
+    }
+    if (req->ranges) {
+	for (;;) {
+	    if (-1 != req->rh) {
+		if (req->written < req->r_hlen[req->rh]) {
+		    *buf = req->r_head + req->rh*BR_HEADER + req->written;
+		    *len = req->r_hlen[req->rh] - req->written;
+		    return PIECE_MEM;
+		}
+		if (req->rh == req->ranges)
+		    return PIECE_NONE;
+		req->rb      = req->rh;
+		req->rh      = -1;
+		req->written = req->r_start[req->rb];
+	    }
+	    if (req->written < req->r_end[req->rb]) {
+		*off = req->written;
+		*len = req->r_end[req->rb] - req->written;
+		return PIECE_FILE;
+	    }
+	    if (req->ranges == 1)
+		return PIECE_NONE;
+	    req->rh      = req->rb+1;
+	    req->rb      = -1;
+	    req->written = 0;
+	}
+    }
+    *off = req->written;
+    *len = req->bst.st_size - req->written;
+    return *len ? PIECE_FILE : PIECE_NONE;
+}
+
+static void
+h2_advance(struct H2STREAM *s, int n)
+{
+    struct REQUEST *req = &s->req;
+
+    if (!req->body && req->cgipipe != -1)
+	req->cgipos += n;
+    else
+	req->written += n;
+    req->bc += n;
+    if (s->left > 0)
+	s->left -= n;
+}
+
+/* fill the output buffer, round-robin over the streams */
+static void
+h2_fill(struct REQUEST *req)
+{
+    struct H2CONN   *c = req->h2;
+    struct H2STREAM *s, *next;
+    char            *buf = NULL;
+    off_t           off = 0, len = 0, n;
+    int             piece, more;
+
+    memcpy(c->out, c->ctl, c->lctl);
+    c->lout = c->lctl;
+    c->lctl = 0;
+    if (c->failed)
+	return;
+
+    do {
+	more = 0;
+	for (s = c->streams; NULL != s; s = next) {
+	    next = s->next;
+	    if (H2_OUTBUF - c->lout < 1024)
+		return;
+	    if (!s->hsent) {
+		switch (s->req.state) {
+		case STATE_WRITE_HEADER:
+		    if (H2_OUTBUF - c->lout < 9 + 2*MAX_HEADER)
+			return;
+		    h2_headers(req, s);
+		    s->req.tfirst = stats_us();
+		    more = 1;
+		    break;
+		case STATE_CGI_HEADER:
+		case STATE_READ_DIR:
+		    break;
+		default:
+		    h2_rst(c, s->id, H2_INTERNAL_ERROR);
+		    h2_stream_free(c, s, 0);
+		    break;
+		}
+		continue;
+	    }
+
+	    piece = h2_piece(s, &buf, &off, &len);
+	    if (PIECE_WAIT == piece)
+		continue;
+	    if (PIECE_NONE == piece) {
+		h2_put_head(c->out + c->lout, 0, H2_DATA, H2_END_STREAM, s->id);
+		c->lout += 9;
+		h2_stream_free(c, s, 1);
+		more = 1;
+		continue;
+	    }
+
+	    /* flow control */
+	    n = len;
+	    if (n > c->max_frame)
+		n = c->max_frame;
+	    if (n > c->window)
+		n = c->window;
+	    if (n > s->window)
+		n = s->window;
+	    if ((PIECE_MEM == piece || H2_TLS) && n > H2_OUTBUF - c->lout - 9)
+		n = H2_OUTBUF - c->lout - 9;
+	    if (n <= 0)
+		continue;
+
+	    h2_put_head(c->out + c->lout, n, H2_DATA,
+			(n == s->left) ? H2_END_STREAM : 0, s->id);
+	    c->lout += 9;
+	    if (PIECE_MEM == piece) {
+		memcpy(c->out + c->lout, buf, n);
+		c->lout += n;
+	    } else if (H2_TLS) {
+		/* no sendfile() through openssl */
+		if (n != pread(s->req.bfd, c->out + c->lout, n, off)) {
+		    /* file got shorter under our feet */
+		    req->state = STATE_CLOSE;
+		    return;
+		}
+		c->lout += n;
+	    } else {
+		c->sfd  = s->req.bfd;
+		c->soff = off;
+		c->slen = n;
+#ifdef TCP_CORK
+		if (0 == req->tcp_cork) {
+		    req->tcp_cork = 1;
+		    setsockopt(req->fd,SOL_TCP,TCP_CORK,&req->tcp_cork,sizeof(int));
+		}
+#endif
+	    }
+	    c->window -= n;
+	    s->window -= n;
+	    h2_advance(s, n);
+	    if (0 == s->left)
+		h2_stream_free(c, s, 1);
+	    if (c->slen)
+		return; /* sendfile() first */
+	    more = 1;
+	}
+    } while (more);
+}
+
+static int
+h2_pending(struct H2CONN *c)
+{
+    return c->lctl || c->wout < c->lout || c->slen;
+}
+
+static void
+h2_write(struct REQUEST *req)
+{
+    struct H2CONN *c = req->h2;
+    int rc;
+
+    for (;;) {
+	if (c->wout < c->lout) {
+#ifdef USE_SSL
+	    if (with_ssl)
+		rc = ssl_write(req, (char*)c->out + c->wout, c->lout - c->wout);
+	    else
+#endif
+		rc = write(req->fd, c->out + c->wout, c->lout - c->wout);
+	} else if (c->slen) {
+	    rc = xsendfile(req->fd, c->sfd, c->soff, c->slen);
+	} else {
+	    c->lout = c->wout = 0;
+	    h2_fill(req);
+	    if (0 == c->lout || STATE_H2 != req->state)
+		break;
+	    continue;
+	}
+	switch (rc) {
+	case -1:
+	    if (errno == EAGAIN)
+		return;
+	    if (errno == EINTR)
+		continue;
+	    xperror(LOG_INFO,"write",req->peerhost);
+	    /* fall through */
+	case 0:
+	    req->state = STATE_CLOSE;
+	    return;
+	}
+	req->bc += rc;
+	if (c->wout < c->lout) {
+	    stats->b_write += rc;
+	    c->wout += rc;
+	} else {
+	    stats->b_sendfile += rc;
+	    c->soff += rc;
+	    c->slen -= rc;
+	    if (0 == c->slen && c->sfclose) {
+		close(c->sfd);
+		c->sfclose = 0;
+	    }
+	}
+    }
+
+#ifdef TCP_CORK
+    if (1 == req->tcp_cork) {
+	req->tcp_cork = 0;
+	setsockopt(req->fd,SOL_TCP,TCP_CORK,&req->tcp_cork,sizeof(int));
+    }
+#endif
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* 1: connection preface is there, 0: need more data, -1: not http/2 */
+int
+h2_preface(struct REQUEST *req)
+{
+    int len = req->hdata < H2_PREFACE_LEN ? req->hdata : H2_PREFACE_LEN;
+
+    if (0 != memcmp(req->hreq, H2_PREFACE, len))
+	return -1;
+    return (len == H2_PREFACE_LEN) ? 1 : 0;
+}
+
+void
+h2_start(struct REQUEST *req)
+{
+    struct H2CONN *c;
+    unsigned char settings[12];
+    int one = 1;
+
+    if (debug)
+	fprintf(stderr,"%03d: h2: start\n",req->fd);
+    if (NULL == (c = malloc(sizeof(*c)))) {
+	req->state = STATE_CLOSE;
+	return;
+    }
+    memset(c,0,sizeof(*c));
+    req->h2 = c;
+    c->in     = (unsigned char*)pool_get(H2_INBUF);
+    c->out    = (unsigned char*)pool_get(H2_OUTBUF);
+    c->hblock = malloc(max_header);
+    c->hdrs   = malloc(max_header);
+    if (!c->in || !c->out || !c->hblock || !c->hdrs) {
+	req->state = STATE_CLOSE;
+	return;
+    }
+    c->window      = H2_WINDOW;
+    c->init_window = H2_WINDOW;
+    c->max_frame   = H2_FRAME_MAX;
+    c->dec.max     = H2_TABLE_SIZE;
+    c->enc.max     = H2_TABLE_SIZE;
+    c->sfd         = -1;
+
+    /* frames are batched in c->out, nagle would only delay the last
+     * segment before the flow control window runs out */
+    setsockopt(req->fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(int));
+
+    /* whatever followed the preface */
+    c->lin = req->hdata - H2_PREFACE_LEN;
+    memcpy(c->in, req->hreq + H2_PREFACE_LEN, c->lin);
+    release_hreq(req);
+    req->hdata = 0;
+    req->state = STATE_H2;
+
+    /* server preface */
+    settings[0] = 0;
+    settings[1] = H2_SET_MAX_CONCURRENT_STREAMS;
+    h2_put32(settings+2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = H2_SET_MAX_HEADER_LIST_SIZE;
+    h2_put32(settings+8, max_header);
+    h2_ctl(c, H2_SETTINGS, 0, 0, settings, 12);
+
+    h2_input(req);
+}
+
+void
+h2_fdset(struct REQUEST *req, fd_set *rd, fd_set *wr, int *max)
+{
+    struct H2CONN   *c = req->h2;
+    struct H2STREAM *s;
+    int             fd;
+
+    if (!c->stalled && !c->failed)
+	FD_SET(req->fd,rd);
+    if (h2_pending(c)) {
+	FD_SET(req->fd,wr);
+#ifdef USE_SSL
+	if (with_ssl)
+	    FD_SET(req->fd,rd);
+#endif
+    }
+    if (req->fd > *max)
+	*max = req->fd;
+
+    for (s = c->streams; NULL != s; s = s->next) {
+	fd = -1;
+	if (STATE_CGI_HEADER == s->req.state || s->cgiwait)
+	    fd = s->req.cgipipe;
+#ifdef USE_THREADS
+	if (STATE_READ_DIR == s->req.state)
+	    fd = s->req.dir->wakeup;
+#endif
+	if (-1 == fd)
+	    continue;
+	FD_SET(fd,rd);
+	if (fd > *max)
+	    *max = fd;
+    }
+}
+
+/* returns 1 if there was something to do */
+int
+h2_io(struct REQUEST *req, fd_set *rd, fd_set *wr)
+{
+    struct H2CONN   *c = req->h2;
+    struct H2STREAM *s;
+    int             active = 0;
+
+    /* streams first, h2_read() can add new ones (not in the fd_sets) */
+    for (s = c->streams; NULL != s; s = s->next) {
+	if (STATE_CGI_HEADER == s->req.state &&
+	    FD_ISSET(s->req.cgipipe,rd)) {
+	    cgi_read_header(&s->req);
+	    active = 1;
+	} else if (s->cgiwait && FD_ISSET(s->req.cgipipe,rd)) {
+	    s->cgiwait = 0;
+	    active = 1;
+	}
+#ifdef USE_THREADS
+	else if (STATE_READ_DIR == s->req.state &&
+		 FD_ISSET(s->req.dir->wakeup,rd)) {
+	    dir_request(&s->req);
+	    active = 1;
+	}
+#endif
+    }
+    if (FD_ISSET(req->fd,rd) || FD_ISSET(req->fd,wr)) {
+	h2_read(req);
+	active = 1;
+    }
+    if (!active)
+	return 0;
+
+    while (STATE_H2 == req->state) {
+	h2_write(req);
+	if (!c->stalled || c->lctl)
+	    break;
+	/* ctl frames are out, go on with the input */
+	c->stalled = 0;
+	h2_input(req);
+    }
+
+    if (STATE_H2 == req->state && !h2_pending(c) &&
+	(c->failed || (c->shutdown && 0 == c->nstreams)))
+	req->state = STATE_CLOSE;
+    return 1;
+}
+
+/* nothing going on, idle like a keep-alive connection */
+int
+h2_idle(struct REQUEST *req)
+{
+    return 0 == req->h2->nstreams && !h2_pending(req->h2);
+}
+
+void
+h2_free(struct REQUEST *req)
+{
+    struct H2CONN *c = req->h2;
+
+    while (c->streams)
+	h2_stream_free(c, c->streams, 0);
+    if (c->sfclose)
+	close(c->sfd);
+    hpack_evict(&c->dec, -1);
+    hpack_evict(&c->enc, -1);
+    if (c->in)
+	pool_put((char*)c->in, H2_INBUF);
+    if (c->out)
+	pool_put((char*)c->out, H2_OUTBUF);
+    free(c->hblock);
+    free(c->hdrs);
+    free(c);
+    req->h2 = NULL;
+}
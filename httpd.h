@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <sys/stat.h>
 #ifdef USE_THREADS
 # include <pthread.h>
@@ -18,14 +19,37 @@
 #define STATE_CGI_BODY_IN  11
 #define STATE_CGI_BODY_OUT 12
 
+#define STATE_READ_DIR     13
+
+#define STATE_H2           14   /* connection speaks http/2 */
+#define STATE_CGI_SPLICE   15   /* cgi pipe -> socket, via splice() */
+#define STATE_READ_BODY    16   /* upload, read_body() does the i/o */
+#define STATE_CGI_WAIT     17   /* for the micro cache fill by another request */
+#define STATE_MAX          17
+
+#define CGI_CLOSE           0   /* cgi body: delimited by connection close */
+#define CGI_LENGTH          1   /* ... by the script's Content-Length */
+#define CGI_CHUNKED         2   /* ... by chunked transfer encoding */
+
+#define IN_NONE             0   /* request body: none (or done) */
+#define IN_LENGTH           1   /* ... Content-Length */
+#define IN_CHUNKED          2   /* ... chunked transfer encoding */
+#define IN_EOF              3   /* ... complete, end of stream to send */
+
+#define IN_WAIT_SOCK        0   /* request body: waiting for the client */
+#define IN_WAIT_SINK        1   /* ... for the script to take more */
+
 #ifdef USE_SSL
 # include <openssl/ssl.h>
 #endif
 
 #define MAX_HEADER 4096
+#define POOL_MIN   1024     /* buffer pool: smallest ... */
+#define POOL_MAX   (128*1024) /* ... and largest buffer */
 #define MAX_PATH   2048
 #define MAX_HOST     64
 #define MAX_MISC     16
+#define HDR_INLINE   16     /* header lines stored in REQUEST */
 #define BR_HEADER   512
 
 #define S1(str) #str
@@ -44,6 +68,7 @@ struct DIRCACHE {
     pthread_mutex_t  lock_refcount;
     pthread_mutex_t  lock_reading;
     pthread_cond_t   wait_reading;
+    int              wakeup;         /* readable once reading is done */
 #endif
     int              refcount;
     int              reading;
@@ -51,6 +76,45 @@ struct DIRCACHE {
     struct DIRCACHE  *next;
 };
 
+struct MCACHE {
+    char             *key;
+    unsigned int     hash;
+    int              state;
+    time_t           expires;
+    int              ttl;
+    int              refcount;      /* lock_mcache */
+    int              linked;        /* in the table */
+    long             bytes;         /* accounted size */
+
+    /* fill */
+    struct REQUEST   *filler;
+    int              wakeup;        /* readable once the fill is done */
+    int              signal;        /* ... its write end */
+
+    /* response */
+    char             status[64];
+    char             *header;       /* cgi header lines, without length */
+    char             *body;
+    int              len,size;
+    off_t            clen;          /* script's Content-Length, -1: none */
+
+    struct MCACHE    *next;
+};
+
+struct SLICE {
+    int         off;                 /* offset into hreq */
+    int         len;
+};
+
+struct HEADER {
+    struct SLICE name;
+    struct SLICE value;
+};
+
+struct H2CONN;
+struct FCGI;
+struct PUT;
+
 struct REQUEST {
     int	        fd;		     /* socket handle */
     int	        state;	             /* what to to ??? */
@@ -63,9 +127,16 @@ struct REQUEST {
     char        peerserv[MAX_MISC+1];
     
     /* request */
-    char	hreq[MAX_HEADER+1];   /* request header */
+    char	*hreq;                /* request header (buffer pool) */
+    int         ahreq;                /* size of hreq */
     int 	lreq;		      /* request length */
     int         hdata;                /* data in hreq */
+    int         hscan;                /* parser: scanned so far */
+    int         hstate;               /* parser: state */
+    struct SLICE method,target,version;
+    struct HEADER *hdr;               /* parsed header lines */
+    int         nhdr,ahdr;
+    struct HEADER hinline[HDR_INLINE];/* hdr points here until it overflows */
     char        type[MAX_MISC+1];     /* req type */
     char        hostname[MAX_HOST+1]; /* hostname */
     char	uri[MAX_PATH+1];      /* req uri */
@@ -73,7 +144,6 @@ struct REQUEST {
     char	query[MAX_PATH+1];    /* query string */
     int         major,minor;          /* http version */
     char        auth[64];
-    struct strlist *header;
     char        *if_modified;
     char        *if_unmodified;
     char        *if_range;
@@ -84,10 +154,22 @@ struct REQUEST {
     char        *r_head;
     int         *r_hlen;
     char        *cors;
+    char        *ctype;               /* Content-Type (cgi) */
+
+    /* request body */
+    int         inmode;               /* IN_NONE, IN_LENGTH, ... */
+    off_t       inleft;               /* bytes to go (of this chunk) */
+    int         inchunk;              /* chunked: decoder state */
+    int         inpos;                /* unread body data in hreq */
+    int         inwait;               /* IN_WAIT_SOCK or IN_WAIT_SINK */
+    int         infd;                 /* sink: cgi stdin, upload file */
+    struct PUT  *put;                 /* upload in progress */
     
     /* response */
     int         status;              /* status code (log) */
     int         bc;                  /* byte counter (log) */
+    uint64_t    tstart,tfirst;       /* request start, first byte out (us) */
+    int         served;              /* requests done on this connection */
     char	hres[MAX_HEADER+1];  /* response header */
     int	        lres;		     /* header length */
     char        *mime;               /* mime type */
@@ -101,11 +183,23 @@ struct REQUEST {
     int         rh,rb;
     struct DIRCACHE *dir;
 
+    /* HTTP/2 connection */
+    struct H2CONN *h2;
+
     /* CGI */
     int         cgipid;
     int         cgipipe;
     char        cgibuf[MAX_HEADER+1];
     int         cgilen,cgipos;
+    int         cgimode;             /* CGI_CLOSE, CGI_LENGTH, CGI_CHUNKED */
+    off_t       cgiclen;             /* CGI_LENGTH: body bytes left */
+    char        cgichunk[16];        /* CGI_CHUNKED: chunk size line */
+    int         lchunk,wchunk;       /* its length, framed bytes written */
+    struct FCGI *fcgi;               /* FastCGI backend connection */
+    int         cgisplice;           /* move the bodies with splice() */
+    int         cgispl;              /* bytes to go from pipe to socket */
+    struct MCACHE *mc;               /* micro cache entry (hit or fill) */
+    char        *pbody;              /* body from the buffer pool */
 
 #ifdef USE_SSL
     /* SSL */
@@ -116,6 +210,33 @@ struct REQUEST {
     struct REQUEST *next;
 };
 
+/* --- per thread counters, for the status page ------------------ */
+
+#define LAT_SUB     16               /* histogram steps per power of two */
+#define LAT_BUCKETS (24*LAT_SUB)     /* microseconds, up to ~2 minutes */
+
+struct STATS {
+    /* connections */
+    unsigned long    accepted,closed;
+    unsigned long    timeouts,idle;      /* network / keep-alive timeouts */
+    unsigned long    tls_ok,tls_failed;  /* handshakes */
+    int              conns[STATE_MAX+1]; /* by state, last mainloop round */
+
+    /* requests */
+    unsigned long    requests,reused;    /* reused: keep-alive / h2 */
+    unsigned long    status[600];
+    unsigned long    ttfb[LAT_BUCKETS];  /* time to first byte */
+    unsigned long    total[LAT_BUCKETS]; /* ... to the last one */
+    uint64_t         ttfb_sum,total_sum; /* us */
+    unsigned long    cgi_spawns;
+
+    /* bytes sent */
+    unsigned long    b_sendfile,b_splice,b_write;
+
+    /* directory cache */
+    unsigned long    dir_hits,dir_misses;
+} __attribute__((aligned(64)));         /* no false sharing between threads */
+
 /* --- string lists --------------------------------------------- */
 
 struct strlist {
@@ -156,20 +277,35 @@ list_free(struct strlist **list)
 extern int    debug;
 extern int    tcp_port;
 extern int    max_dircache;
+extern int    max_header;
 extern int    virtualhosts;
 extern int    canonicalhost;
 extern int    do_chroot;
 extern char   *server_name;
 extern char   *indexhtml;
 extern char   *cgipath;
+extern char   *putpath;
+extern char   *statuspath;
+extern char   *statusnet;
+extern char   *metricspath;
+extern char   *fcgi_socket;
+extern char   *fcgi_program;
+extern int    fcgi_workers;
+extern int    cgi_cache;
 extern char   *doc_root;
 extern char   server_host[];
 extern char   *userpass;
 extern char   *userdir;
 extern int    lifespan;
 extern int    no_listing;
+extern int    no_owner;
+extern int    no_http2;
+extern int    preload_names;
 extern time_t now;
 extern int     have_tty;
+#ifdef USE_THREADS
+extern int    ls_threads;
+#endif
 
 #ifdef USE_SSL
 extern int      with_ssl;
@@ -181,6 +317,7 @@ extern char     *password;
 
 void xperror(int loglevel, char *txt, char *peerhost);
 void xerror(int loglevel, char *txt, char *peerhost);
+void access_log(struct REQUEST *req, time_t now);
 
 static void inline close_on_exec(int fd)
 {
@@ -198,10 +335,39 @@ extern void init_ssl(void);
 extern void open_ssl_session(struct REQUEST *req);
 #endif
 
+/* --- scan.c --------------------------------------------------- */
+
+struct SCANNER {
+    char *name;
+    int  (*ctl)(const char *buf, int len);
+    int  (*target)(const char *buf, int len);
+    int  (*delim)(const char *buf, int len);
+};
+
+extern struct SCANNER scanners[];
+extern struct SCANNER *scanner;
+
+int  scan_supported(struct SCANNER *s);
+void init_scan(void);
+
+/* --- pool.c --------------------------------------------------- */
+
+char *pool_get(int size);
+void pool_put(char *buf, int size);
+
 /* --- request.c ------------------------------------------------ */
 
+void init_docroot(void);
+int  docroot_fd(char *host, int *skip);
+int  open_beneath(int dirfd, char *name, int flags);
+void pc_forget(struct REQUEST *req);
+int  scan_request(struct REQUEST *req);
 void read_request(struct REQUEST *req, int pipelined);
+void read_body(struct REQUEST *req);
+void release_hreq(struct REQUEST *req);
+time_t parse_date(char *line);
 void parse_request(struct REQUEST *req);
+void dir_request(struct REQUEST *req);
 
 /* --- response.c ----------------------------------------------- */
 
@@ -216,25 +382,85 @@ void mkerror(struct REQUEST *req, int status, int ka);
 void mkredirect(struct REQUEST *req);
 void mkheader(struct REQUEST *req, int status);
 void mkcgi(struct REQUEST *req, char *status, struct strlist *header);
+void mkcached(struct REQUEST *req);
 void write_request(struct REQUEST *req);
+ssize_t xsendfile(int out, int in, off_t offset, off_t bytes);
 
 /* --- ls.c ----------------------------------------------------- */
 
 void init_quote(void);
-char*  quote(unsigned char *path, int maxlength);
-struct DIRCACHE *get_dir(struct REQUEST *req, char *filename);
+char*  quote(unsigned char *path, int maxlength, char *buf, int size);
+struct DIRCACHE *get_dir(struct REQUEST *req, char *filename, int fd);
 void free_dir(struct DIRCACHE *dir);
+void forget_dir(char *filename);
+void load_names(void);
+void reload_names(void);
+#ifdef USE_THREADS
+void init_dirpool(void);
+#endif
 
 /* --- mime.c --------------------------------------------------- */
 
 char* get_mime(char *file);
 void  init_mime(char *file, char *def);
+int   compile_mime(char *src, char *dst);
+
+/* --- http2.c ------------------------------------------------- */
+
+void init_http2(void);
+int  h2_preface(struct REQUEST *req);
+void h2_start(struct REQUEST *req);
+void h2_fdset(struct REQUEST *req, fd_set *rd, fd_set *wr, int *max);
+int  h2_io(struct REQUEST *req, fd_set *rd, fd_set *wr);
+int  h2_idle(struct REQUEST *req);
+void h2_free(struct REQUEST *req);
 
 /* --- cgi.c ---------------------------------------------------- */
 
+void cgi_vars(struct REQUEST *req,
+	      void (*add)(void *ctx, char *name, char *value), void *ctx);
 void cgi_request(struct REQUEST *req);
+int  cgi_write(struct REQUEST *req, char *buf, int len);
+void cgi_stdin_done(struct REQUEST *req);
+int  cgi_read(struct REQUEST *req, char *buf, int len);
+void cgi_done(struct REQUEST *req);
 void cgi_read_header(struct REQUEST *req);
 
+/* --- put.c ---------------------------------------------------- */
+
+void put_request(struct REQUEST *req);
+int  put_write(struct REQUEST *req, char *buf, int len);
+int  put_splice(struct REQUEST *req, int len);
+void put_abort(struct REQUEST *req);
+
+/* --- mcache.c ------------------------------------------------ */
+
+int  mc_lookup(struct REQUEST *req);
+void mc_wakeup(struct REQUEST *req);
+void mc_header(struct REQUEST *req, char *status, struct strlist *header);
+void mc_data(struct REQUEST *req, char *buf, int len);
+void mc_done(struct REQUEST *req);
+
+/* --- status.c ------------------------------------------------- */
+
+void     init_status(int threads);
+void     status_thread(int n);
+uint64_t stats_us(void);
+void     stats_request(struct REQUEST *req);
+void     status_request(struct REQUEST *req);
+void     metrics_request(struct REQUEST *req);
+void     status_done(struct REQUEST *req);
+
+/* --- fcgi.c --------------------------------------------------- */
+
+void fcgi_request(struct REQUEST *req);
+int  fcgi_read(struct REQUEST *req, char *buf, int len);
+int  fcgi_write(struct REQUEST *req, char *buf, int len);
+void fcgi_release(struct REQUEST *req);
+void fcgi_spawn(void);
+void fcgi_check(void);
+void fcgi_stop(void);
+
 /* -------------------------------------------------------------- */
 
 #ifdef USE_THREADS
@@ -246,6 +472,7 @@ void cgi_read_header(struct REQUEST *req);
 # define FREE_COND(cond)	pthread_cond_destroy(&cond)
 # define BCAST_COND(cond)	pthread_cond_broadcast(&cond);
 # define WAIT_COND(cond,mutex)	pthread_cond_wait(&cond,&mutex);
+# define THREAD_LOCAL		__thread
 #else
 # define INIT_LOCK(mutex)	/* nothing */
 # define FREE_LOCK(mutex)	/* nothing */
@@ -255,4 +482,8 @@ void cgi_read_header(struct REQUEST *req);
 # define FREE_COND(cond)	/* nothing */
 # define BCAST_COND(cond)	/* nothing */
 # define WAIT_COND(cond,mutex)	/* nothing */
+# define THREAD_LOCAL		/* nothing */
 #endif
+
+/* the counters of the running thread, see status.c */
+extern THREAD_LOCAL struct STATS *stats;
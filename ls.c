@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <syslog.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
@@ -26,82 +27,279 @@ static pthread_mutex_t lock_dircache = PTHREAD_MUTEX_INITIALIZER;
 
 /* --------------------------------------------------------- */
 
-#define CACHE_SIZE 32
+/*
+ * uid/gid -> name caches.  They are per thread, so no locking is
+ * needed; small open addressing hash tables, a full probe sequence
+ * evicts the home slot.  Unknown ids are cached too.
+ */
+#define CACHE_SIZE 64   /* must be a power of two */
+#define CACHE_PROBE 4
+
+struct idname {
+    unsigned int  id;
+    int           valid;      /* 0: free, 1: name, -1: unknown id */
+    char          name[33];
+};
+
+static THREAD_LOCAL struct idname uid_cache[CACHE_SIZE];
+static THREAD_LOCAL struct idname gid_cache[CACHE_SIZE];
+
+static inline unsigned int
+idhash(unsigned int id)
+{
+    return (id * 2654435761u) >> 16;
+}
+
+static struct idname*
+idname_slot(struct idname *cache, unsigned int id)
+{
+    unsigned int h,i;
+
+    h = idhash(id);
+    for (i = 0; i < CACHE_PROBE; i++) {
+	struct idname *e = cache + ((h+i) & (CACHE_SIZE-1));
+	if (!e->valid || e->id == id)
+	    return e;
+    }
+    return cache + (h & (CACHE_SIZE-1));
+}
+
+/*
+ * preloaded name maps (-U): the passwd and group databases are read
+ * once at startup (before chroot) and on SIGHUP, then looked up
+ * without ever calling NSS from the request path.  One allocation per
+ * map: open addressing table (ids + string offsets), then the names.
+ */
+struct NAMEMAP {
+    unsigned int  mask;
+    unsigned int  *ids;
+    unsigned int  *names;     /* offset into strings, 0: free slot */
+    char          *strings;
+};
+
+static struct NAMEMAP *pw_map, *gr_map;
+static struct NAMEMAP *pw_old, *gr_old;
+
+#ifdef USE_THREADS
+static pthread_mutex_t lock_names = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 static char*
-xgetpwuid(uid_t uid)
+map_lookup(struct NAMEMAP *map, unsigned int id)
 {
-    static char           *cache[CACHE_SIZE];
-    static uid_t          uids[CACHE_SIZE];
-    static unsigned int   used,next;
+    unsigned int h;
 
-    struct passwd *pw;
-    int i;
+    for (h = idhash(id) & map->mask;; h = (h+1) & map->mask) {
+	if (0 == map->names[h])
+	    return NULL;
+	if (map->ids[h] == id)
+	    return map->strings + map->names[h];
+    }
+}
+
+static struct NAMEMAP*
+map_load(int groups)
+{
+    struct NAMEMAP  *map = NULL;
+    struct passwd   *pw;
+    struct group    *gr;
+    unsigned int    *ids = NULL, *offs = NULL, *re1;
+    char            *pool = NULL, *re2, *name;
+    unsigned int    id,count,size,plen,psize,i,h,len;
+
+    /* collect entries, offset 0 of the pool is reserved */
+    count = 0;
+    plen  = 1;
+    psize = 0;
+    if (groups)
+	setgrent();
+    else
+	setpwent();
+    for (;;) {
+	if (groups) {
+	    if (NULL == (gr = getgrent()))
+		break;
+	    id   = gr->gr_gid;
+	    name = gr->gr_name;
+	} else {
+	    if (NULL == (pw = getpwent()))
+		break;
+	    id   = pw->pw_uid;
+	    name = pw->pw_name;
+	}
+	if (0 == (count % 256)) {
+	    if (NULL == (re1 = realloc(ids,(count+256)*sizeof(unsigned int))))
+		goto done;
+	    ids = re1;
+	    if (NULL == (re1 = realloc(offs,(count+256)*sizeof(unsigned int))))
+		goto done;
+	    offs = re1;
+	}
+	len = strlen(name)+1;
+	if (plen + len > psize) {
+	    psize += 4096 + len;
+	    if (NULL == (re2 = realloc(pool,psize)))
+		goto done;
+	    pool = re2;
+	}
+	memcpy(pool+plen,name,len);
+	ids[count]  = id;
+	offs[count] = plen;
+	plen += len;
+	count++;
+    }
+    if (0 == count)
+	goto done;
+
+    /* build hash table, keep the first entry for duplicate ids */
+    for (size = 16; size < count*2; size *= 2)
+	;
+    map = malloc(sizeof(struct NAMEMAP) + 2*size*sizeof(unsigned int) + plen);
+    if (NULL == map)
+	goto done;
+    map->mask    = size-1;
+    map->ids     = (unsigned int*)(map+1);
+    map->names   = map->ids + size;
+    map->strings = (char*)(map->names + size);
+    memset(map->names,0,size*sizeof(unsigned int));
+    memcpy(map->strings,pool,plen);
+    map->strings[0] = 0;
+    for (i = 0; i < count; i++) {
+	for (h = idhash(ids[i]) & map->mask;; h = (h+1) & map->mask) {
+	    if (0 == map->names[h]) {
+		map->ids[h]   = ids[i];
+		map->names[h] = offs[i];
+		break;
+	    }
+	    if (map->ids[h] == ids[i])
+		break;
+	}
+    }
+    if (debug)
+	fprintf(stderr,"names: %u %s loaded\n",count,groups ? "groups" : "users");
+
+ done:
+    if (groups)
+	endgrent();
+    else
+	endpwent();
+    free(ids);
+    free(offs);
+    free(pool);
+    return map;
+}
+
+/*
+ * (re-)load the name maps.  Lookups run without locks, so a replaced
+ * map is kept around until the next reload before it is freed.
+ */
+void
+load_names(void)
+{
+    struct NAMEMAP *pw,*gr;
+
+    DO_LOCK(lock_names);
+    pw = map_load(0);
+    gr = map_load(1);
+    if (NULL != pw) {
+	free(pw_old);
+	pw_old = pw_map;
+	__atomic_store_n(&pw_map,pw,__ATOMIC_RELEASE);
+    }
+    if (NULL != gr) {
+	free(gr_old);
+	gr_old = gr_map;
+	__atomic_store_n(&gr_map,gr,__ATOMIC_RELEASE);
+    }
+    if (NULL == pw || NULL == gr)
+	xerror(LOG_WARNING,"loading user/group names failed",NULL);
+    DO_UNLOCK(lock_names);
+}
+
+#ifdef USE_THREADS
+static void*
+reload_names_thread(void *arg)
+{
+    load_names();
+    return NULL;
+}
+#endif
+
+/* SIGHUP: refresh the maps without blocking the mainloop (if we can) */
+void
+reload_names(void)
+{
+#ifdef USE_THREADS
+    pthread_t t;
+
+    if (0 == pthread_create(&t,NULL,reload_names_thread,NULL)) {
+	pthread_detach(t);
+	return;
+    }
+#endif
+    load_names();
+}
+
+static char*
+xgetpwuid(uid_t uid)
+{
+    struct idname  *e;
+    struct passwd  pwbuf,*pw;
+    char           buf[1024];
 
+    if (preload_names) {
+	struct NAMEMAP *map = __atomic_load_n(&pw_map,__ATOMIC_ACQUIRE);
+	return map ? map_lookup(map,uid) : NULL;
+    }
     if (do_chroot)
 	return NULL; /* would'nt work anyway .. */
 
-    for (i = 0; i < used; i++) {
-	if (uids[i] == uid)
-	    return cache[i];
-    }
+    e = idname_slot(uid_cache,uid);
+    if (e->valid && e->id == uid)
+	return (e->valid > 0) ? e->name : NULL;
 
     /* 404 */
-    pw = getpwuid(uid);
-    if (NULL != cache[next]) {
-	free(cache[next]);
-	cache[next] = NULL;
-    }
-    if (NULL != pw)
-	cache[next] = strdup(pw->pw_name);
-    uids[next] = uid;
+    if (0 != getpwuid_r(uid,&pwbuf,buf,sizeof(buf),&pw))
+	pw = NULL;
+    e->id    = uid;
+    e->valid = pw ? 1 : -1;
+    if (pw)
+	snprintf(e->name,sizeof(e->name),"%s",pw->pw_name);
     if (debug)
 	fprintf(stderr,"uid: %3d  n=%2d, name=%s\n",
-		(int)uid, next, cache[next] ? cache[next] : "?");
-
-    next++;
-    if (CACHE_SIZE == next) next = 0;
-    if (used < CACHE_SIZE) used++;
-
-    return pw ? pw->pw_name : NULL;
+		(int)uid, (int)(e - uid_cache), pw ? e->name : "?");
+    return pw ? e->name : NULL;
 }
 
 static char*
 xgetgrgid(gid_t gid)
 {
-    static char           *cache[CACHE_SIZE];
-    static gid_t          gids[CACHE_SIZE];
-    static unsigned int   used,next;
-
-    struct group *gr;
-    int i;
+    struct idname  *e;
+    struct group   grbuf,*gr;
+    char           buf[4096];
 
+    if (preload_names) {
+	struct NAMEMAP *map = __atomic_load_n(&gr_map,__ATOMIC_ACQUIRE);
+	return map ? map_lookup(map,gid) : NULL;
+    }
     if (do_chroot)
 	return NULL; /* would'nt work anyway .. */
 
-    for (i = 0; i < used; i++) {
-	if (gids[i] == gid)
-	    return cache[i];
-    }
+    e = idname_slot(gid_cache,gid);
+    if (e->valid && e->id == gid)
+	return (e->valid > 0) ? e->name : NULL;
 
     /* 404 */
-    gr = getgrgid(gid);
-    if (NULL != cache[next]) {
-	free(cache[next]);
-	cache[next] = NULL;
-    }
-    if (NULL != gr)
-	cache[next] = strdup(gr->gr_name);
-    gids[next] = gid;
+    if (0 != getgrgid_r(gid,&grbuf,buf,sizeof(buf),&gr))
+	gr = NULL;
+    e->id    = gid;
+    e->valid = gr ? 1 : -1;
+    if (gr)
+	snprintf(e->name,sizeof(e->name),"%s",gr->gr_name);
     if (debug)
 	fprintf(stderr,"gid: %3d  n=%2d, name=%s\n",
-		(int)gid,next,cache[next] ? cache[next] : "?");
-
-    next++;
-    if (CACHE_SIZE == next) next = 0;
-    if (used < CACHE_SIZE) used++;
-
-    return gr ? gr->gr_name : NULL;
+		(int)gid, (int)(e - gid_cache), gr ? e->name : "?");
+    return gr ? e->name : NULL;
 }
 
 /* --------------------------------------------------------- */
@@ -112,6 +310,121 @@ struct myfile {
     char          n[1];
 };
 
+/* stat directory entries [start,end), failures are flagged with r = -1 */
+static void
+ls_stat(int dfd, struct myfile **files, int start, int end)
+{
+    int i;
+
+    for (i = start; i < end; i++)
+	files[i]->r = (-1 == fstatat(dfd,files[i]->n,&files[i]->s,0)) ? -1 : 0;
+}
+
+#ifdef USE_THREADS
+
+/*
+ * listing worker pool
+ *
+ * A job (one directory) is picked up by one worker, which reads the
+ * directory and publishes the entries as a stat batch.  Idle workers
+ * grab chunks of that batch, so the stat() calls for a large directory
+ * run in parallel.  When the listing is done the worker closes the
+ * write end of the wakeup pipe, which makes the read end (dir->wakeup)
+ * readable for every connection waiting in STATE_READ_DIR.
+ */
+
+#define LS_CHUNK 16
+
+struct LSBATCH {
+    int              dfd;
+    struct myfile    **files;
+    int              count;
+    int              next;    /* next entry to hand out */
+    int              done;    /* entries stat'ed */
+    struct LSBATCH   *link;
+};
+
+struct LSJOB {
+    struct DIRCACHE  *dir;
+    int              wakeup;  /* write end of the wakeup pipe */
+    int              fd;      /* the directory */
+    time_t           now;
+    char             hostname[MAX_HOST+1];
+    char             path[MAX_PATH+1];
+    struct LSJOB     *next;
+};
+
+static pthread_mutex_t lock_dirpool = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wait_dirpool = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  wait_batch   = PTHREAD_COND_INITIALIZER;
+static struct LSJOB    *jobs, *jobs_tail;
+static struct LSBATCH  *batches;
+
+/* hand out the next chunk of a batch (lock_dirpool held) */
+static int
+ls_take_chunk(struct LSBATCH *batch, int *start, int *end)
+{
+    struct LSBATCH **b;
+
+    if (batch->next == batch->count)
+	return 0;
+    *start = batch->next;
+    *end   = batch->next + LS_CHUNK;
+    if (*end > batch->count)
+	*end = batch->count;
+    batch->next = *end;
+    if (batch->next == batch->count) {
+	/* all handed out -- unlink */
+	for (b = &batches; *b != NULL; b = &(*b)->link)
+	    if (*b == batch) {
+		*b = batch->link;
+		break;
+	    }
+    }
+    return 1;
+}
+
+/* stat a chunk (lock_dirpool held, dropped while working) */
+static void
+ls_run_chunk(struct LSBATCH *batch, int start, int end)
+{
+    DO_UNLOCK(lock_dirpool);
+    ls_stat(batch->dfd,batch->files,start,end);
+    DO_LOCK(lock_dirpool);
+    batch->done += end - start;
+    if (batch->done == batch->count)
+	BCAST_COND(wait_batch);
+}
+
+static void
+ls_stat_parallel(int dfd, struct myfile **files, int count)
+{
+    struct LSBATCH batch;
+    int start,end;
+
+    if (count <= LS_CHUNK) {
+	ls_stat(dfd,files,0,count);
+	return;
+    }
+
+    memset(&batch,0,sizeof(batch));
+    batch.dfd   = dfd;
+    batch.files = files;
+    batch.count = count;
+
+    DO_LOCK(lock_dirpool);
+    batch.link = batches;
+    batches = &batch;
+    BCAST_COND(wait_dirpool);
+    while (ls_take_chunk(&batch,&start,&end))
+	ls_run_chunk(&batch,start,end);
+    while (batch.done != batch.count)
+	WAIT_COND(wait_batch,lock_dirpool);
+    DO_UNLOCK(lock_dirpool);
+}
+
+#endif /* USE_THREADS */
+
 static int
 compare_files(const void *a, const void *b)
 {
@@ -139,25 +452,37 @@ init_quote(void)
     do_quote['?'] = 1;
 }
 
+/*
+ * %xx-quote path (up to maxlength bytes) into buf.  Runs of bytes which
+ * need no quoting are copied in one go.  Output is truncated to fit.
+ */
 char*
-quote(unsigned char *path, int maxlength)
+quote(unsigned char *path, int maxlength, char *buf, int size)
 {
-    static unsigned char buf[2048]; /* FIXME: threads break this... */
-    int i,j,n=strlen((const char *)path);
+    static const char hex[] = "0123456789abcdef";
+    int i,j,run,n=strlen((const char *)path);
 
     if (n > maxlength)
 	n = maxlength;
 
-    for (i=0, j=0; i<n && j<sizeof(buf)-4; i++, j++) {
-	if (!do_quote[path[i]]) {
-	    buf[j] = path[i];
+    for (i=0, j=0; i<n && j<size-4;) {
+	for (run = i; run < n && !do_quote[path[run]]; run++)
+	    ;
+	if (run > i) {
+	    if (run - i > size-4 - j)
+		run = i + size-4 - j;
+	    memcpy(buf+j,path+i,run-i);
+	    j += run-i;
+	    i  = run;
 	    continue;
 	}
-	sprintf((char *)(buf+j),"%%%02x",path[i]);
-	j += 2;
+	buf[j++] = '%';
+	buf[j++] = hex[path[i] >> 4];
+	buf[j++] = hex[path[i] & 0x0f];
+	i++;
     }
     buf[j] = 0;
-    return (char *)buf;
+    return buf;
 }
 
 #if !defined(__FreeBSD__) && !defined(__OpenBSD__) && !defined(__APPLE__)
@@ -186,26 +511,30 @@ static void strmode(mode_t mode, char *dest)
 }
 #endif
 
+/* fd is the directory, opened beneath the docroot, ls() closes it */
 static char*
-ls(time_t now, char *hostname, char *filename, char *path, int *length)
+ls(time_t now, char *hostname, int fd, char *filename, char *path,
+   int *length)
 {
     DIR            *dir;
     struct dirent  *file;
     struct myfile  **files = NULL;
     struct myfile  **re1;
     char           *h1,*h2,*re2,*buf = NULL;
-    int            count,len,size,i,uid,gid;
+    int            count,len,size,i,j,uid,gid;
     char           line[1024];
+    char           qbuf[2048];
+    struct tm      tm;
     char           *pw = NULL, *gr = NULL;
 
     if (debug)
 	fprintf(stderr,"dir: reading %s\n",filename);
-    if (NULL == (dir = opendir(filename)))
+    if (NULL == (dir = fdopendir(fd))) {
+	close(fd);
 	return NULL;
+    }
 
     /* read dir */
-    uid = getuid();
-    gid = getgid();
     for (count = 0;; count++) {
 	if (NULL == (file = readdir(dir)))
 	    break;
@@ -231,27 +560,40 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 	if (NULL == files[count])
 	    goto oom;
 	strcpy(files[count]->n,file->d_name);
-	sprintf(line,"%s/%s",filename,file->d_name);
-	if (-1 == stat(line,&files[count]->s)) {
-	    free(files[count]);
-	    count--;
+    }
+
+    /* stat entries */
+#ifdef USE_THREADS
+    if (ls_threads)
+	ls_stat_parallel(dirfd(dir),files,count);
+    else
+#endif
+	ls_stat(dirfd(dir),files,0,count);
+    closedir(dir);
+
+    /* drop entries we can't stat, check access rights */
+    uid = getuid();
+    gid = getgid();
+    for (i = 0, j = 0; i < count; i++) {
+	if (-1 == files[i]->r) {
+	    free(files[i]);
 	    continue;
 	}
-
-	files[count]->r = 0;
-	if (S_ISDIR(files[count]->s.st_mode) ||
-	    S_ISREG(files[count]->s.st_mode)) {
-	    if (files[count]->s.st_uid == uid &&
-		files[count]->s.st_mode & 0400)
-		files[count]->r = 1;
-	    else if (files[count]->s.st_uid == gid &&
-		     files[count]->s.st_mode & 0040)
-		files[count]->r = 1; /* FIXME: check additional groups */
-	    else if (files[count]->s.st_mode & 0004)
-		files[count]->r = 1;
+	files[j] = files[i];
+	if (S_ISDIR(files[j]->s.st_mode) ||
+	    S_ISREG(files[j]->s.st_mode)) {
+	    if (files[j]->s.st_uid == uid &&
+		files[j]->s.st_mode & 0400)
+		files[j]->r = 1;
+	    else if (files[j]->s.st_uid == gid &&
+		     files[j]->s.st_mode & 0040)
+		files[j]->r = 1; /* FIXME: check additional groups */
+	    else if (files[j]->s.st_mode & 0004)
+		files[j]->r = 1;
 	}
+	j++;
     }
-    closedir(dir);
+    count = j;
 
     /* sort */
     if (count)
@@ -282,7 +624,7 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 	    buf = re2;
 	}
 	len += sprintf(buf+len,"<a href=\"%s\">%*.*s</a>",
-		       quote((unsigned char *)path,h2-path),
+		       quote((unsigned char *)path,h2-path,qbuf,sizeof(qbuf)),
 		       (int)(h2-h1),
 		       (int)(h2-h1),
 		       h1);
@@ -295,8 +637,9 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 
     len += sprintf(buf+len,
 		   "</h1><hr noshade size=1><pre>\n"
-		   "<b>access      user      group     date             "
-		   "size  name</b>\n\n");
+		   "<b>access      %sdate             "
+		   "size  name</b>\n\n",
+		   no_owner ? "" : "user      group     ");
 
     for (i = 0; i < count; i++) {
 	if (len > size)
@@ -315,27 +658,29 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 	buf[len++] = ' ';
 	buf[len++] = ' ';
 
-	/* user */
-	pw = xgetpwuid(files[i]->s.st_uid);
-	if (NULL != pw)
-	    len += sprintf(buf+len,"%-8.8s  ",pw);
-	else
-	    len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_uid);
+	if (!no_owner) {
+	    /* user */
+	    pw = xgetpwuid(files[i]->s.st_uid);
+	    if (NULL != pw)
+		len += sprintf(buf+len,"%-8.8s  ",pw);
+	    else
+		len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_uid);
 
-	/* group */
-	gr = xgetgrgid(files[i]->s.st_gid);
-	if (NULL != gr)
-	    len += sprintf(buf+len,"%-8.8s  ",gr);
-	else
-	    len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_gid);
+	    /* group */
+	    gr = xgetgrgid(files[i]->s.st_gid);
+	    if (NULL != gr)
+		len += sprintf(buf+len,"%-8.8s  ",gr);
+	    else
+		len += sprintf(buf+len,"%8d  ",(int)files[i]->s.st_gid);
+	}
 
 	/* mtime */
 	if (now - files[i]->s.st_mtime > 60*60*24*30*6)
 	    len += strftime(buf+len,255,"%b %d  %Y  ",
-			    gmtime(&files[i]->s.st_mtime));
+			    gmtime_r(&files[i]->s.st_mtime,&tm));
 	else
 	    len += strftime(buf+len,255,"%b %d %H:%M  ",
-			    gmtime(&files[i]->s.st_mtime));
+			    gmtime_r(&files[i]->s.st_mtime,&tm));
 
 	/* size */
 	if (S_ISDIR(files[i]->s.st_mode)) {
@@ -362,14 +707,15 @@ ls(time_t now, char *hostname, char *filename, char *path, int *length)
 	/* filename */
 	if (files[i]->r) {
 	    len += sprintf(buf+len,"<a href=\"%s%s\">%s</a>\n",
-			   quote((unsigned char *)files[i]->n,9999),
+			   quote((unsigned char *)files[i]->n,9999,
+				 qbuf,sizeof(qbuf)),
 			   S_ISDIR(files[i]->s.st_mode) ? "/" : "",
 			   files[i]->n);
 	} else {
 	    len += sprintf(buf+len,"%s\n",files[i]->n);
 	}
     }
-    strftime(line,32,"%d/%b/%Y %H:%M:%S GMT",gmtime(&now));
+    strftime(line,32,"%d/%b/%Y %H:%M:%S GMT",gmtime_r(&now,&tm));
     len += sprintf(buf+len,
 		   "</pre><hr noshade size=1>\n"
 		   "<small><a href=\"%s\">%s</a> &nbsp; %s</small>\n"
@@ -417,16 +763,125 @@ void free_dir(struct DIRCACHE *dir)
     FREE_LOCK(dir->lock_refcount);
     FREE_LOCK(dir->lock_reading);
     FREE_COND(dir->wait_reading);
+#ifdef USE_THREADS
+    if (-1 != dir->wakeup)
+	close(dir->wakeup);
+#endif
     if (NULL != dir->html)
 	free(dir->html);
     free(dir);
 }
 
+#ifdef USE_THREADS
+
+static void
+ls_job(struct LSJOB *job)
+{
+    struct DIRCACHE *dir = job->dir;
+
+    dir->html = ls(job->now,job->hostname,job->fd,dir->path,job->path,
+		   &(dir->length));
+
+    DO_LOCK(dir->lock_reading);
+    dir->reading = 0;
+    BCAST_COND(dir->wait_reading);
+    DO_UNLOCK(dir->lock_reading);
+    close(job->wakeup);
+
+    free_dir(dir);
+    free(job);
+}
+
+static void*
+ls_worker(void *arg)
+{
+    struct LSBATCH *batch;
+    struct LSJOB   *job;
+    int            start,end;
+
+    DO_LOCK(lock_dirpool);
+    for (;;) {
+	/* help out with pending stat batches first ... */
+	if (NULL != (batch = batches)) {
+	    if (ls_take_chunk(batch,&start,&end))
+		ls_run_chunk(batch,start,end);
+	    continue;
+	}
+	/* ... then pick up new listings */
+	if (NULL != (job = jobs)) {
+	    jobs = job->next;
+	    if (NULL == jobs)
+		jobs_tail = NULL;
+	    DO_UNLOCK(lock_dirpool);
+	    ls_job(job);
+	    DO_LOCK(lock_dirpool);
+	    continue;
+	}
+	WAIT_COND(wait_dirpool,lock_dirpool);
+    }
+    return NULL;
+}
+
+/* queue a listing for the workers, returns -1 on failure */
+static int
+ls_queue(struct DIRCACHE *dir, struct REQUEST *req, int wakeup, int fd)
+{
+    struct LSJOB *job;
+
+    if (NULL == (job = malloc(sizeof(struct LSJOB))))
+	return -1;
+    job->dir    = dir;
+    job->wakeup = wakeup;
+    job->fd     = fd;
+    job->now    = now;
+    job->next   = NULL;
+    strcpy(job->hostname, req->hostname);
+    strcpy(job->path,     req->path);
+
+    DO_LOCK(dir->lock_refcount);
+    dir->refcount++;
+    DO_UNLOCK(dir->lock_refcount);
+
+    DO_LOCK(lock_dirpool);
+    if (jobs_tail)
+	jobs_tail->next = job;
+    else
+	jobs = job;
+    jobs_tail = job;
+    BCAST_COND(wait_dirpool);
+    DO_UNLOCK(lock_dirpool);
+    return 0;
+}
+
+void
+init_dirpool(void)
+{
+    pthread_t t;
+    int i;
+
+    for (i = 0; i < ls_threads; i++) {
+	if (0 != pthread_create(&t,NULL,ls_worker,NULL)) {
+	    xerror(LOG_ERR,"can't start listing threads",NULL);
+	    exit(1);
+	}
+	pthread_detach(t);
+    }
+}
+
+#endif /* USE_THREADS */
+
+/*
+ * fd is filename, opened beneath the docroot.  get_dir() takes it
+ * over, on a cache miss it is the directory which gets listed.
+ */
 struct DIRCACHE*
-get_dir(struct REQUEST *req, char *filename)
+get_dir(struct REQUEST *req, char *filename, int fd)
 {
     struct DIRCACHE  *this,*prev;
     int              i;
+#ifdef USE_THREADS
+    int              p[2];
+#endif
 
     DO_LOCK(lock_dircache);
     for (prev = NULL, this = dirs, i=0; this != NULL;
@@ -466,20 +921,42 @@ get_dir(struct REQUEST *req, char *filename)
     }
     if (!this) {
 	/* add a new cache entry to the list */
+	stats->dir_misses++;
 	this = malloc(sizeof(struct DIRCACHE));
 	this->refcount = 2;
 	this->reading = 1;
+	this->html = NULL;
 	INIT_LOCK(this->lock_refcount);
 	INIT_LOCK(this->lock_reading);
 	INIT_COND(this->wait_reading);
+	strcpy(this->path,  filename);
+	strcpy(this->mtime, req->mtime);
+	this->add   = now;
+#ifdef USE_THREADS
+	/* must be set up before other threads can find the entry */
+	this->wakeup = -1;
+	if (ls_threads && -1 != pipe(p)) {
+	    close_on_exec(p[0]);
+	    close_on_exec(p[1]);
+	    this->wakeup = p[0];
+	}
+#endif
 	this->next = dirs;
 	dirs = this;
 	DO_UNLOCK(lock_dircache);
 
-	strcpy(this->path,  filename);
-	strcpy(this->mtime, req->mtime);
-	this->add   = now;
-	this->html  = ls(now,req->hostname,filename,req->path,&(this->length));
+#ifdef USE_THREADS
+	if (-1 != this->wakeup) {
+	    if (0 == ls_queue(this,req,p[1],fd)) {
+		/* park the connection until the listing is done */
+		req->state = STATE_READ_DIR;
+		return this;
+	    }
+	    close(p[1]);
+	}
+#endif
+	this->html  = ls(now,req->hostname,fd,filename,req->path,
+			 &(this->length));
 
 	DO_LOCK(this->lock_reading);
 	this->reading = 0;
@@ -487,18 +964,49 @@ get_dir(struct REQUEST *req, char *filename)
 	DO_UNLOCK(this->lock_reading);
     } else {
 	/* add back to the list */
+	close(fd);
+	stats->dir_hits++;
 	this->next = dirs;
 	dirs = this;
+	DO_LOCK(this->lock_refcount);
 	this->refcount++;
+	DO_UNLOCK(this->lock_refcount);
 	DO_UNLOCK(lock_dircache);
 
 	DO_LOCK(this->lock_reading);
+#ifdef USE_THREADS
+	if (this->reading && -1 != this->wakeup) {
+	    /* generated in background -- don't block the mainloop */
+	    req->state = STATE_READ_DIR;
+	    DO_UNLOCK(this->lock_reading);
+	    return this;
+	}
+#endif
 	if (this->reading)
 	    WAIT_COND(this->wait_reading,this->lock_reading);
 	DO_UNLOCK(this->lock_reading);
     }
-
-    req->body  = this->html;
-    req->lbody = this->length;
     return this;
 }
+
+/* the directory has changed (upload), drop its cached listing */
+void
+forget_dir(char *filename)
+{
+    struct DIRCACHE  *this,*prev;
+
+    DO_LOCK(lock_dircache);
+    for (prev = NULL, this = dirs; this != NULL;
+	 prev = this, this = this->next) {
+	if (0 == strcmp(filename,this->path)) {
+	    if (NULL == prev)
+		dirs = this->next;
+	    else
+		prev->next = this->next;
+	    break;
+	}
+    }
+    DO_UNLOCK(lock_dircache);
+    if (this)
+	free_dir(this);
+}
@@ -0,0 +1,502 @@
+/*
+ * micro cache for cgi responses
+ *
+ * With -M the responses to GET requests for cgi scripts are kept for a
+ * few seconds, keyed by method, host, path, query string and the
+ * Accept* request headers.  The lifetime comes from the script's
+ * Cache-Control (s-maxage, max-age) or Expires header, the -M value is
+ * the default.  Responses which are private, carry cookies or vary on
+ * other headers are not cached; requests with cookies or credentials
+ * bypass the cache.
+ *
+ * Concurrent misses are collapsed: the first request runs the script
+ * and copies the body into the entry while it is sent out.  The others
+ * park in STATE_CGI_WAIT until the fill is done, which is signaled by
+ * closing the write end of the entry's wakeup pipe (same trick as the
+ * directory listings).  Then they are served from the entry, or run
+ * the script themselves if it turned out to be uncacheable.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "httpd.h"
+
+#define MC_HASH         256            /* must be a power of two */
+#define MC_MAX_BODY     (1024*1024)    /* larger responses are not cached */
+#define MC_MAX_TOTAL    (64*1024*1024) /* all entries */
+#define MC_MAX_HEADER   (MAX_HEADER-512) /* room for our own lines */
+
+/* debug output: the key without the header values */
+#define MC_KEYLEN(mc)   ((int)strcspn((mc)->key,"\n"))
+
+#define MC_FILL         0   /* script running */
+#define MC_READY        1   /* response cached */
+#define MC_PASS         2   /* uncacheable, run the script */
+#define MC_FAIL         3   /* fill failed, not in the table any more */
+
+/* request headers which are part of the key (and may be in Vary) */
+static char *mc_keyhdr[] = {
+    "accept", "accept-encoding", "accept-language",
+    NULL
+};
+
+static struct MCACHE *mcache[MC_HASH];
+static long mc_bytes;
+
+#ifdef USE_THREADS
+static pthread_mutex_t lock_mcache = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+static unsigned int
+mc_hash(char *key)
+{
+    unsigned int h = 2166136261u;
+
+    while (*key)
+	h = (h ^ (unsigned char)*(key++)) * 16777619u;
+    return h;
+}
+
+static char*
+mc_reqhdr(struct REQUEST *req, char *name)
+{
+    int i, len = strlen(name);
+
+    for (i = 0; i < req->nhdr; i++)
+	if (req->hdr[i].name.len == len &&
+	    0 == strncasecmp(req->hreq + req->hdr[i].name.off, name, len))
+	    /* parse_request() has NUL-terminated the value */
+	    return req->hreq + req->hdr[i].value.off;
+    return NULL;
+}
+
+static char*
+mc_key(struct REQUEST *req)
+{
+    char *key, *value;
+    int i, len, size;
+
+    size = strlen(req->hostname) + strlen(req->path) + strlen(req->query) + 16;
+    for (i = 0; NULL != mc_keyhdr[i]; i++)
+	if (NULL != (value = mc_reqhdr(req,mc_keyhdr[i])))
+	    size += strlen(value) + 1;
+    if (NULL == (key = malloc(size)))
+	return NULL;
+    /* HEAD is answered from the GET response */
+    len = sprintf(key,"GET %s%s?%s",req->hostname,req->path,req->query);
+    for (i = 0; NULL != mc_keyhdr[i]; i++) {
+	value = mc_reqhdr(req,mc_keyhdr[i]);
+	len += sprintf(key+len,"\n%s",value ? value : "");
+    }
+    return key;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static long
+mc_size(struct MCACHE *mc)
+{
+    return sizeof(*mc) + strlen(mc->key) + mc->size +
+	(mc->header ? strlen(mc->header) : 0);
+}
+
+/* account for the entry (lock_mcache held) */
+static void
+mc_count(struct MCACHE *mc)
+{
+    long size = mc_size(mc);
+
+    mc_bytes += size - mc->bytes;
+    mc->bytes = size;
+}
+
+/* drop a reference (lock_mcache held) */
+static void
+mc_unref(struct MCACHE *mc)
+{
+    mc->refcount--;
+    if (1 == mc->refcount && mc->linked &&
+	MC_FILL != mc->state && -1 != mc->wakeup) {
+	/* only the table left, nobody will wait any more */
+	close(mc->wakeup);
+	mc->wakeup = -1;
+    }
+    if (mc->refcount > 0)
+	return;
+    if (-1 != mc->wakeup)
+	close(mc->wakeup);
+    free(mc->key);
+    free(mc->header);
+    free(mc->body);
+    free(mc);
+}
+
+/* remove from the table (lock_mcache held) */
+static void
+mc_unlink(struct MCACHE *mc)
+{
+    struct MCACHE **p;
+
+    for (p = &mcache[mc->hash & (MC_HASH-1)]; NULL != *p; p = &(*p)->next) {
+	if (*p != mc)
+	    continue;
+	*p = mc->next;
+	mc->linked = 0;
+	mc_bytes  -= mc->bytes;
+	mc_unref(mc);
+	return;
+    }
+}
+
+/* drop expired entries (lock_mcache held) */
+static void
+mc_expire(struct MCACHE **p)
+{
+    struct MCACHE *mc;
+
+    while (NULL != (mc = *p)) {
+	if (MC_FILL != mc->state && now >= mc->expires) {
+	    if (debug)
+		fprintf(stderr,"mcache: expire %.*s\n",MC_KEYLEN(mc),mc->key);
+	    *p = mc->next;
+	    mc->linked = 0;
+	    mc_bytes  -= mc->bytes;
+	    mc_unref(mc);
+	} else {
+	    p = &mc->next;
+	}
+    }
+}
+
+/* over the limit, drop all expired entries (lock_mcache held) */
+static void
+mc_purge(void)
+{
+    int i;
+
+    for (i = 0; i < MC_HASH; i++)
+	mc_expire(&mcache[i]);
+}
+
+/* fill is done (or failed), let the waiters go */
+static void
+mc_end(struct MCACHE *mc, int state, int ttl)
+{
+    DO_LOCK(lock_mcache);
+    if (MC_READY == state &&
+	mc_bytes + mc_size(mc) - mc->bytes > MC_MAX_TOTAL) {
+	mc_purge();
+	if (mc_bytes + mc_size(mc) - mc->bytes > MC_MAX_TOTAL)
+	    state = MC_FAIL;
+    }
+    mc->filler  = NULL;
+    mc->state   = state;
+    mc->expires = now + ttl;
+    if (MC_FAIL == state)
+	mc_unlink(mc);
+    else
+	mc_count(mc);
+    DO_UNLOCK(lock_mcache);
+    close(mc->signal);
+    mc->signal = -1;
+    if (debug)
+	fprintf(stderr,"mcache: %s %.*s (%d bytes, ttl %d)\n",
+		MC_READY == state ? "store" : MC_PASS == state ? "pass" : "fail",
+		MC_KEYLEN(mc),mc->key,mc->len,ttl);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * cgi request: returns 1 if it is answered from the cache (or waits
+ * for it), 0 if the script must run.  req->mc is set in the latter
+ * case if the output should be stored.
+ */
+int
+mc_lookup(struct REQUEST *req)
+{
+    struct MCACHE *mc, **head;
+    unsigned int hash;
+    char *key;
+    int p[2], fill;
+
+    if (0 == cgi_cache)
+	return 0;
+    if (0 != strcmp(req->type,"GET") && 0 != strcmp(req->type,"HEAD"))
+	return 0;
+    if (mc_reqhdr(req,"cookie") ||
+	(mc_reqhdr(req,"authorization") && NULL == userpass))
+	/* personalized */
+	return 0;
+    if (NULL == (key = mc_key(req)))
+	return 0;
+    hash = mc_hash(key);
+    head = &mcache[hash & (MC_HASH-1)];
+    /* http/2 streams and HEAD don't feed the cache, see mc_data() */
+    fill = (req->major < 2 && !req->head_only);
+
+    DO_LOCK(lock_mcache);
+    mc_expire(head);
+    for (mc = *head; NULL != mc; mc = mc->next)
+	if (mc->hash == hash && 0 == strcmp(mc->key,key))
+	    break;
+    if (NULL != mc) {
+	free(key);
+	if (MC_PASS == mc->state || (MC_FILL == mc->state && !fill)) {
+	    DO_UNLOCK(lock_mcache);
+	    return 0;
+	}
+	mc->refcount++;
+	req->mc = mc;
+	if (MC_READY == mc->state) {
+	    DO_UNLOCK(lock_mcache);
+	    if (debug)
+		fprintf(stderr,"%03d: mcache: hit %.*s\n",req->fd,
+			MC_KEYLEN(mc),mc->key);
+	    mkcached(req);
+	    return 1;
+	}
+	/* park the connection until the script is done */
+	if (debug)
+	    fprintf(stderr,"%03d: mcache: wait %.*s\n",req->fd,
+		    MC_KEYLEN(mc),mc->key);
+	req->state = STATE_CGI_WAIT;
+	DO_UNLOCK(lock_mcache);
+	return 1;
+    }
+
+    /* miss */
+    if (fill && mc_bytes > MC_MAX_TOTAL)
+	mc_purge();
+    if (!fill || mc_bytes > MC_MAX_TOTAL ||
+	NULL == (mc = malloc(sizeof(*mc)))) {
+	DO_UNLOCK(lock_mcache);
+	free(key);
+	return 0;
+    }
+    memset(mc,0,sizeof(*mc));
+    if (-1 == pipe(p)) {
+	DO_UNLOCK(lock_mcache);
+	free(mc);
+	free(key);
+	return 0;
+    }
+    close_on_exec(p[0]);
+    close_on_exec(p[1]);
+    mc->key      = key;
+    mc->hash     = hash;
+    mc->state    = MC_FILL;
+    mc->wakeup   = p[0];
+    mc->signal   = p[1];
+    mc->filler   = req;
+    mc->clen     = -1;
+    mc->refcount = 2; /* table + filler */
+    mc->linked   = 1;
+    mc->next     = *head;
+    *head        = mc;
+    mc_count(mc);
+    DO_UNLOCK(lock_mcache);
+
+    if (debug)
+	fprintf(stderr,"%03d: mcache: miss %.*s\n",req->fd,
+		MC_KEYLEN(mc),mc->key);
+    req->mc = mc;
+    return 0;
+}
+
+/* fill done, answer a parked request */
+void
+mc_wakeup(struct REQUEST *req)
+{
+    int state;
+
+    DO_LOCK(lock_mcache);
+    state = req->mc->state;
+    DO_UNLOCK(lock_mcache);
+    if (MC_READY == state) {
+	mkcached(req);
+	return;
+    }
+    /* no luck, run the script */
+    mc_done(req);
+    cgi_request(req);
+}
+
+/* Cache-Control, returns -1 if the response must not be stored */
+static int
+mc_control(char *line, int *maxage, int *smaxage)
+{
+    char *h;
+
+    for (h = line+14; *h; h++) {
+	if (!isalpha(*h))
+	    continue;
+	if (0 == strncasecmp(h,"no-store",8) ||
+	    0 == strncasecmp(h,"no-cache",8) ||
+	    0 == strncasecmp(h,"private",7))
+	    return -1;
+	if (0 == strncasecmp(h,"s-maxage=",9))
+	    *smaxage = atoi(h+9);
+	if (0 == strncasecmp(h,"max-age=",8))
+	    *maxage = atoi(h+8);
+	while (*h && ',' != *h)
+	    h++;
+	if (!*h)
+	    break;
+    }
+    return 0;
+}
+
+/* Vary on anything but the key headers? */
+static int
+mc_vary(char *line)
+{
+    char *h = line+5;
+    int i, len;
+
+    for (;;) {
+	while (' ' == *h || ',' == *h)
+	    h++;
+	if (!*h)
+	    return 0;
+	for (len = 0; h[len] && ' ' != h[len] && ',' != h[len]; len++)
+	    ;
+	for (i = 0; NULL != mc_keyhdr[i]; i++)
+	    if ((int)strlen(mc_keyhdr[i]) == len &&
+		0 == strncasecmp(h,mc_keyhdr[i],len))
+		break;
+	if (NULL == mc_keyhdr[i])
+	    return 1;
+	h += len;
+    }
+}
+
+/* the script's response header, decide whether to keep it */
+void
+mc_header(struct REQUEST *req, char *status, struct strlist *header)
+{
+    struct MCACHE *mc = req->mc;
+    struct strlist *h;
+    int maxage = -1, smaxage = -1, expires = -1, ttl;
+    int len = 0, pass = 0;
+    char *v;
+    time_t t;
+
+    if (NULL == mc || mc->filler != req)
+	return;
+    if (200 != atoi(status))
+	pass = 1;
+    for (h = header; NULL != h && !pass; h = h->next) {
+	if (0 == strncasecmp(h->line,"Cache-Control:",14) &&
+	    -1 == mc_control(h->line,&maxage,&smaxage))
+	    pass = 1;
+	if (0 == strncasecmp(h->line,"Expires:",8)) {
+	    for (v = h->line+8; ' ' == *v; v++)
+		;
+	    /* invalid dates mean "already expired" */
+	    t = parse_date(v);
+	    expires = (t > now) ? t - now : 0;
+	}
+	if (0 == strncasecmp(h->line,"Set-Cookie:",11) ||
+	    0 == strncasecmp(h->line,"Transfer-Encoding:",18) ||
+	    (0 == strncasecmp(h->line,"Vary:",5) && mc_vary(h->line)))
+	    pass = 1;
+	if (0 == strncasecmp(h->line,"Content-Length:",15))
+	    mc->clen = strtoll(h->line+15,NULL,10);
+	else
+	    len += strlen(h->line) + 2;
+    }
+    /* s-maxage beats max-age beats Expires beats -M */
+    ttl = cgi_cache;
+    if (expires >= 0)
+	ttl = expires;
+    if (maxage >= 0)
+	ttl = maxage;
+    if (smaxage >= 0)
+	ttl = smaxage;
+    if (ttl <= 0 || len > MC_MAX_HEADER || mc->clen > MC_MAX_BODY)
+	pass = 1;
+    if (pass) {
+	mc_end(mc,MC_PASS,cgi_cache);
+	return;
+    }
+
+    /* keep the lines in mkcgi() order, Content-Length is added later */
+    mc->ttl = ttl;
+    snprintf(mc->status,sizeof(mc->status),"%s",status);
+    mc->header = malloc(len+1);
+    if (NULL == mc->header) {
+	mc_end(mc,MC_FAIL,0);
+	return;
+    }
+    for (len = 0, h = header; NULL != h; h = h->next)
+	if (0 != strncasecmp(h->line,"Content-Length:",15))
+	    len += sprintf(mc->header+len,"%s\r\n",h->line);
+    mc->header[len] = 0;
+    if (0 == mc->clen)
+	mc_end(mc,MC_READY,mc->ttl);
+}
+
+/* body data from the script on its way to the client, len 0: eof */
+void
+mc_data(struct REQUEST *req, char *buf, int len)
+{
+    struct MCACHE *mc = req->mc;
+    char *body;
+    int size;
+
+    if (NULL == mc || mc->filler != req || NULL == mc->header)
+	return;
+    if (0 == len) {
+	mc_end(mc, (-1 == mc->clen) ? MC_READY : MC_FAIL, mc->ttl);
+	return;
+    }
+    if (mc->len + len > MC_MAX_BODY) {
+	mc_end(mc,MC_FAIL,0);
+	return;
+    }
+    if (mc->len + len > mc->size) {
+	size = mc->size ? mc->size : MAX_HEADER;
+	while (size < mc->len + len)
+	    size *= 2;
+	if (mc->clen >= mc->len + len && size > mc->clen)
+	    size = mc->clen;
+	if (NULL == (body = realloc(mc->body,size))) {
+	    mc_end(mc,MC_FAIL,0);
+	    return;
+	}
+	mc->body = body;
+	mc->size = size;
+    }
+    memcpy(mc->body + mc->len, buf, len);
+    mc->len += len;
+    if (mc->len == mc->clen)
+	mc_end(mc,MC_READY,mc->ttl);
+}
+
+/* response done or connection gone */
+void
+mc_done(struct REQUEST *req)
+{
+    struct MCACHE *mc = req->mc;
+
+    if (NULL == mc)
+	return;
+    if (mc->filler == req)
+	/* incomplete */
+	mc_end(mc,MC_FAIL,0);
+    DO_LOCK(lock_mcache);
+    mc_unref(mc);
+    DO_UNLOCK(lock_mcache);
+    req->mc = NULL;
+}
@@ -4,6 +4,11 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
+#include <syslog.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
@@ -11,91 +16,313 @@
 
 /* ----------------------------------------------------------------- */
 
+/* open addressing hash, keyed by the lowercased extension */
 struct MIME {
-    char  ext[8];
-    char  type[64];
+    unsigned int hash;
+    char         *ext;
+    char         *type;
 };
 
 static char         *mime_default;
-static struct MIME  *mime_types;
-static int           mime_count;
+static struct MIME  *mime_table;
+static unsigned int  mime_mask;
+static unsigned int  mime_count;
+
+/* fallback if there is no mime.types, already laid out as hash table */
+static struct MIME mime_builtin[64] = {
+    [ 0] = { 0xf3471e80, "css",   "text/css" },
+    [ 1] = { 0x662ad8c1, "gif",   "image/gif" },
+    [ 3] = { 0x36a1a243, "json",  "application/json" },
+    [ 4] = { 0x9d7939c4, "mp4",   "video/mp4" },
+    [10] = { 0x5e3f640a, "js",    "application/javascript" },
+    [16] = { 0xd775a7d0, "html",  "text/html" },
+    [19] = { 0x07a54453, "woff2", "font/woff2" },
+    [21] = { 0x694dc915, "pdf",   "application/pdf" },
+    [28] = { 0x078fda9c, "htm",   "text/html" },
+    [29] = { 0x6835c29c, "png",   "image/png" },
+    [33] = { 0xe7478ea1, "svg",   "image/svg+xml" },
+    [35] = { 0xbedf9323, "jpeg",  "image/jpeg" },
+    [47] = { 0xa535a9ef, "txt",   "text/plain" },
+    [48] = { 0xdac75f30, "jpg",   "image/jpeg" },
+    [49] = { 0x9c793831, "mp3",   "audio/mpeg" },
+    [51] = { 0x58ca6a73, "woff",  "font/woff" },
+    [52] = { 0xab8273b4, "zip",   "application/zip" },
+    [53] = { 0x55209534, "gz",    "application/gzip" },
+    [54] = { 0xda706eb6, "xml",   "text/xml" },
+    [55] = { 0xefc480b4, "webm",  "video/webm" },
+    [62] = { 0x7ce1083e, "ico",   "image/x-icon" },
+};
+
+/*
+ * compiled database (webfsd --compile-mime), mmap()ed as-is.
+ * Same hash and probing as mime_table, strings are referenced by
+ * file offset, 0 marks an empty slot.  Native byte order.
+ */
+#define MIMEDB_MAGIC "webfs-mimedb-1\n"
+
+struct MIMEDB_HEAD {
+    char     magic[16];
+    uint32_t mask;
+    uint32_t count;
+};
+
+struct MIMEDB_SLOT {
+    uint32_t hash;
+    uint32_t ext;
+    uint32_t type;
+};
+
+static char               *mime_db;
+static struct MIMEDB_SLOT *mime_dbslots;
+static unsigned int        mime_dbmask;
 
 /* ----------------------------------------------------------------- */
 
+static unsigned int
+mime_hash(char *ext)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *ext; ext++)
+	hash = (hash ^ tolower((unsigned char)*ext)) * 16777619u;
+    return hash;
+}
+
+static struct MIME*
+mime_slot(struct MIME *table, unsigned int mask, unsigned int hash, char *ext)
+{
+    unsigned int i;
+
+    for (i = hash & mask; NULL != table[i].ext; i = (i+1) & mask)
+	if (table[i].hash == hash && 0 == strcasecmp(table[i].ext,ext))
+	    break;
+    return table+i;
+}
+
+static void
+mime_resize(void)
+{
+    struct MIME *table, *slot;
+    unsigned int i, mask;
+
+    mask  = mime_mask ? 2*mime_mask+1 : 63;
+    table = calloc(mask+1,sizeof(struct MIME));
+    if (NULL == table) {
+	xperror(LOG_ERR,"calloc",NULL);
+	exit(1);
+    }
+    for (i = 0; mime_table && i <= mime_mask; i++) {
+	if (NULL == mime_table[i].ext)
+	    continue;
+	slot = mime_slot(table,mask,mime_table[i].hash,mime_table[i].ext);
+	*slot = mime_table[i];
+    }
+    free(mime_table);
+    mime_table = table;
+    mime_mask  = mask;
+}
+
 static void
 add_mime(char *ext, char *type)
 {
-    if (0 == (mime_count % 64))
-	mime_types = realloc(mime_types,(mime_count+64)*sizeof(struct MIME));
-    strcpy(mime_types[mime_count].ext, ext);
-    strcpy(mime_types[mime_count].type,type);
+    struct MIME *slot;
+    unsigned int hash;
+    char *h;
+
+    /* keep the load factor below 1/2 */
+    if (2*(mime_count+1) > mime_mask)
+	mime_resize();
+    hash = mime_hash(ext);
+    slot = mime_slot(mime_table,mime_mask,hash,ext);
+    if (NULL != slot->ext)
+	return; /* first match wins */
+    slot->hash = hash;
+    slot->ext  = strdup(ext);
+    slot->type = type;
+    for (h = slot->ext; *h; h++)
+	*h = tolower((unsigned char)*h);
     mime_count++;
 }
 
+static char*
+get_mime_db(char *ext)
+{
+    struct MIMEDB_SLOT *slot;
+    unsigned int hash, i;
+
+    hash = mime_hash(ext);
+    for (i = hash & mime_dbmask; 0 != mime_dbslots[i].ext; i = (i+1) & mime_dbmask) {
+	slot = mime_dbslots+i;
+	if (slot->hash == hash && 0 == strcasecmp(mime_db + slot->ext,ext))
+	    return mime_db + slot->type;
+    }
+    return mime_default;
+}
+
+/* map a compiled database, returns -1 if file isn't one */
+static int
+load_mime_db(char *file)
+{
+    struct MIMEDB_HEAD *head;
+    struct stat st;
+    char *db;
+    unsigned int i;
+    size_t size;
+    int fd;
+
+    if (-1 == (fd = open(file,O_RDONLY)))
+	return -1;
+    if (-1 == fstat(fd,&st) || st.st_size < sizeof(*head)) {
+	close(fd);
+	return -1;
+    }
+    size = st.st_size;
+    db = mmap(NULL,size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (MAP_FAILED == db)
+	return -1;
+    head = (struct MIMEDB_HEAD*)db;
+    if (0 != memcmp(head->magic,MIMEDB_MAGIC,sizeof(head->magic))) {
+	/* plain mime.types file */
+	munmap(db,size);
+	return -1;
+    }
+
+    /* sanity checks, so lookups can't run off the mapping */
+    if (head->mask > 0xffffff || 0 != (head->mask & (head->mask+1)) ||
+	head->count > head->mask ||
+	size < sizeof(*head) + (head->mask+1) * sizeof(struct MIMEDB_SLOT) ||
+	db[size-1] != 0)
+	goto bad;
+    mime_dbslots = (struct MIMEDB_SLOT*)(db + sizeof(*head));
+    for (i = 0; i <= head->mask; i++)
+	if (mime_dbslots[i].ext >= size || mime_dbslots[i].type >= size)
+	    goto bad;
+
+    mime_db     = db;
+    mime_dbmask = head->mask;
+    if (debug)
+	fprintf(stderr,"mime: %s: %d types (compiled)\n",file,head->count);
+    return 0;
+
+ bad:
+    fprintf(stderr,"%s: broken mime database\n",file);
+    munmap(db,size);
+    return -1;
+}
+
 char*
 get_mime(char *file)
 {
-    int i;
+    struct MIME *slot;
     char *ext;
 
     ext = strrchr(file,'.');
     if (NULL == ext)
 	return mime_default;
     ext++;
-    for (i = 0; i < mime_count; i++) {
-	if (0 == strcasecmp(ext,mime_types[i].ext))
-	    return mime_types[i].type;
-    }
-    return mime_default;
+    if (mime_db)
+	return get_mime_db(ext);
+    if (NULL == mime_table)
+	return mime_default;
+    slot = mime_slot(mime_table,mime_mask,mime_hash(ext),ext);
+    return slot->ext ? slot->type : mime_default;
 }
 
 void
 init_mime(char *file,char *def)
 {
     FILE *fp;
-    char line[128], type[64], ext[8];
-    int  len,off;
+    char line[1024], *type, *copy, *ext, *save;
 
     mime_default = strdup(def);
+    if (0 == load_mime_db(file))
+	return;
     if (NULL == (fp = fopen(file,"r"))) {
-	/* Add basic mime types as fallback when file doesn't exist */
-	add_mime("html", "text/html");
-	add_mime("htm",  "text/html");
-	add_mime("css",  "text/css");
-	add_mime("js",   "application/javascript");
-	add_mime("json", "application/json");
-	add_mime("txt",  "text/plain");
-	add_mime("xml",  "text/xml");
-	add_mime("jpg",  "image/jpeg");
-	add_mime("jpeg", "image/jpeg");
-	add_mime("png",  "image/png");
-	add_mime("gif",  "image/gif");
-	add_mime("ico",  "image/x-icon");
-	add_mime("pdf",  "application/pdf");
-	add_mime("zip",  "application/zip");
-	add_mime("gz",   "application/gzip");
-	add_mime("mp3",  "audio/mpeg");
-	add_mime("mp4",  "video/mp4");
-	add_mime("webm", "video/webm");
-	add_mime("svg",  "image/svg+xml");
-	add_mime("woff", "font/woff");
-	add_mime("woff2","font/woff2");
+	/* use basic mime types as fallback when file doesn't exist */
+	mime_table = mime_builtin;
+	mime_mask  = 63;
 	if (debug)
 	    fprintf(stderr,"warning: %s not found, using built-in mime types\n",file);
 	return;
     }
-    while (NULL != fgets(line,127,fp)) {
+    while (NULL != fgets(line,sizeof(line),fp)) {
 	if (line[0] == '#')
 	    continue;
-	if (1 != sscanf(line,"%63s%n",type,&len))
+	if (NULL == (type = strtok_r(line," \t\r\n",&save)))
 	    continue;
-	off = len;
-	for (;;) {
-	    if (1 != sscanf(line+off,"%7s%n",ext,&len))
-		break;
-	    off += len;
-	    add_mime(ext,type);
+	for (copy = NULL; NULL != (ext = strtok_r(NULL," \t\r\n",&save));) {
+	    if (NULL == copy)
+		copy = strdup(type);
+	    add_mime(ext,copy);
 	}
     }
     fclose(fp);
 }
+
+/* ----------------------------------------------------------------- */
+
+static uint32_t
+write_str(FILE *fp, char *str)
+{
+    long pos = ftell(fp);
+
+    fwrite(str,strlen(str)+1,1,fp);
+    return pos;
+}
+
+/* webfsd --compile-mime: turn a mime.types file into a database */
+int
+compile_mime(char *src, char *dst)
+{
+    struct MIMEDB_HEAD head;
+    struct MIMEDB_SLOT *slots;
+    uint32_t *types;
+    unsigned int i,j;
+    FILE *fp;
+
+    init_mime(src,"text/plain");
+    if (mime_db || mime_table == mime_builtin) {
+	fprintf(stderr,"%s: not a mime.types file\n",src);
+	return -1;
+    }
+    slots = calloc(mime_mask+1,sizeof(*slots));
+    types = calloc(mime_mask+1,sizeof(*types));
+    if (NULL == slots || NULL == types) {
+	perror("calloc");
+	return -1;
+    }
+    if (NULL == (fp = fopen(dst,"w"))) {
+	perror(dst);
+	return -1;
+    }
+
+    memset(&head,0,sizeof(head));
+    memcpy(head.magic,MIMEDB_MAGIC,sizeof(head.magic));
+    head.mask  = mime_mask;
+    head.count = mime_count;
+    fwrite(&head,sizeof(head),1,fp);
+    fwrite(slots,sizeof(*slots),mime_mask+1,fp);
+
+    /* string pool, type strings are shared by all extensions of a line */
+    for (i = 0; i <= mime_mask; i++) {
+	if (NULL == mime_table[i].ext)
+	    continue;
+	slots[i].hash = mime_table[i].hash;
+	slots[i].ext  = write_str(fp,mime_table[i].ext);
+	for (j = 0; j < i; j++)
+	    if (mime_table[j].type == mime_table[i].type && types[j])
+		break;
+	slots[i].type = (j < i) ? types[j] : write_str(fp,mime_table[i].type);
+	types[i] = slots[i].type;
+    }
+
+    fseek(fp,sizeof(head),SEEK_SET);
+    fwrite(slots,sizeof(*slots),mime_mask+1,fp);
+    if (0 != fclose(fp)) {
+	perror(dst);
+	return -1;
+    }
+    fprintf(stderr,"%s: %d types written\n",dst,mime_count);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * buffer pool
+ *
+ * Power of two size tiers from POOL_MIN to POOL_MAX.  Free buffers
+ * are kept on per thread lists, so neither getting nor returning a
+ * buffer needs locking.  A buffer must be returned by the thread
+ * which got it, with the same size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "httpd.h"
+
+#define POOL_TIERS   8     /* POOL_MIN << 7 == POOL_MAX */
+#define POOL_KEEP   32     /* free buffers kept per tier and thread */
+
+struct POOLBUF {
+    struct POOLBUF *next;
+};
+
+static THREAD_LOCAL struct POOLBUF *pool_free[POOL_TIERS];
+static THREAD_LOCAL int            pool_nfree[POOL_TIERS];
+
+/* ---------------------------------------------------------------------- */
+
+static int
+pool_tier(int size)
+{
+    int tier;
+
+    for (tier = 0; (POOL_MIN << tier) < size; tier++)
+	;
+    return tier;
+}
+
+char*
+pool_get(int size)
+{
+    struct POOLBUF *buf;
+    int tier = pool_tier(size);
+
+    if (tier >= POOL_TIERS)
+	return NULL;
+    if (NULL != (buf = pool_free[tier])) {
+	pool_free[tier] = buf->next;
+	pool_nfree[tier]--;
+	return (char*)buf;
+    }
+    return malloc(POOL_MIN << tier);
+}
+
+void
+pool_put(char *ptr, int size)
+{
+    struct POOLBUF *buf = (struct POOLBUF*)ptr;
+    int tier = pool_tier(size);
+
+    if (pool_nfree[tier] >= POOL_KEEP) {
+	free(ptr);
+	return;
+    }
+    buf->next = pool_free[tier];
+    pool_free[tier] = buf;
+    pool_nfree[tier]++;
+}
@@ -0,0 +1,269 @@
+/*
+ * PUT uploads
+ *
+ * With -A the files below the upload directory can be replaced with
+ * PUT.  The body goes into a temporary file next to the target and is
+ * renamed into place once it is complete, so readers get either the
+ * old or the new file, never a partial one.  The data is moved from
+ * the socket to the file with splice() through a pipe (tls: read() +
+ * write() via read_body()), the space is preallocated if the size is
+ * known.  Parent directories are not created.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "httpd.h"
+
+#define PUT_PIPE_SIZE   (1024*1024)
+
+struct PUT {
+    int   dfd;                      /* target directory */
+    int   fd;                       /* temporary file */
+    int   pipe[2];                  /* for splice(), socket -> file */
+    int   replace;                  /* target exists */
+    char  dir[MAX_PATH+2];          /* directory, for the listing cache */
+    char  name[MAX_PATH+1];
+    char  tmp[64];
+};
+
+/* ---------------------------------------------------------------------- */
+
+static void
+put_free(struct REQUEST *req)
+{
+    struct PUT *put = req->put;
+
+    if (-1 != put->fd)
+	close(put->fd);
+    if (-1 != put->pipe[0]) {
+	close(put->pipe[0]);
+	close(put->pipe[1]);
+    }
+    close(put->dfd);
+    free(put);
+    req->put  = NULL;
+    req->infd = -1;
+}
+
+/* upload failed or aborted, the target stays as it was */
+void
+put_abort(struct REQUEST *req)
+{
+    struct PUT *put = req->put;
+
+    if (NULL == put)
+	return;
+    if (debug)
+	fprintf(stderr,"%03d: put: %s aborted\n",req->fd,put->name);
+    unlinkat(put->dfd,put->tmp,0);
+    put_free(req);
+}
+
+/* i/o error on the file, answer the client */
+static int
+put_error(struct REQUEST *req, int err)
+{
+    errno = err;
+    xperror(LOG_WARNING,"put",req->peerhost);
+    put_abort(req);
+    mkerror(req, (ENOSPC == err || EDQUOT == err || EFBIG == err) ? 507 : 500, 0);
+    /* read_body() stops */
+    errno = EPIPE;
+    return -1;
+}
+
+void
+put_request(struct REQUEST *req)
+{
+    char filename[MAX_PATH+1], *dir, *name;
+    struct PUT *put;
+    struct stat st;
+    int dirfd, skip, len;
+
+    if (userdir && '~' == req->path[1]) {
+	mkerror(req,403,0);
+	return;
+    }
+    len = snprintf(filename, sizeof(filename),
+		   "%s%s%s%s",
+		   do_chroot ? "" : doc_root,
+		   virtualhosts ? "/" : "",
+		   virtualhosts ? req->hostname : "",
+		   req->path);
+    if (len >= sizeof(filename)) {
+	mkerror(req,400,0);
+	return;
+    }
+    dirfd = docroot_fd(req->hostname,&skip);
+
+    /* split into directory and name, relative to dirfd */
+    dir  = filename + skip;
+    name = strrchr(dir,'/');
+    if (name) {
+	*(name++) = 0;
+    } else {
+	name = dir;
+	dir  = "";
+    }
+    if ('.' == name[0] || 0 == name[0]) {
+	/* no dotfiles (temp files live there), no directories */
+	mkerror(req,403,0);
+	return;
+    }
+
+    if (NULL == (put = malloc(sizeof(*put)))) {
+	mkerror(req,500,0);
+	return;
+    }
+    memset(put,0,sizeof(*put));
+    put->fd      = -1;
+    put->pipe[0] = -1;
+    put->pipe[1] = -1;
+    snprintf(put->name, sizeof(put->name), "%s", name);
+    snprintf(put->dir, sizeof(put->dir), "%.*s%s%s/",
+	     skip-1, filename, dir[0] ? "/" : "", dir);
+    snprintf(put->tmp, sizeof(put->tmp), ".webfsd-put.%d.%d",
+	     (int)getpid(), req->fd);
+
+    put->dfd = open_beneath(dirfd,dir,O_RDONLY|O_DIRECTORY);
+    if (-1 == put->dfd) {
+	mkerror(req,(EACCES == errno || EXDEV == errno) ? 403 : 404,0);
+	free(put);
+	return;
+    }
+    close_on_exec(put->dfd);
+    req->put = put;
+    if (0 == fstatat(put->dfd,put->name,&st,AT_SYMLINK_NOFOLLOW)) {
+	if (!S_ISREG(st.st_mode)) {
+	    put_free(req);
+	    mkerror(req,403,0);
+	    return;
+	}
+	put->replace = 1;
+    }
+
+    /* the name is unique as long as the connection exists,
+       anything with it is a leftover */
+    unlinkat(put->dfd,put->tmp,0);
+    put->fd = openat(put->dfd,put->tmp,O_WRONLY|O_CREAT|O_EXCL,0644);
+    if (-1 == put->fd) {
+	put_free(req);
+	mkerror(req,EACCES == errno ? 403 : 500,0);
+	return;
+    }
+    close_on_exec(put->fd);
+    if (IN_LENGTH == req->inmode && req->inleft > 0 &&
+	-1 == fallocate(put->fd,0,0,req->inleft) &&
+	EOPNOTSUPP != errno && ENOSYS != errno) {
+	put_error(req,errno);
+	return;
+    }
+
+#ifdef SPLICE_F_NONBLOCK
+    req->cgisplice = 1;
+# ifdef USE_SSL
+    if (with_ssl)
+	/* no splice() through openssl */
+	req->cgisplice = 0;
+# endif
+    if (req->cgisplice && -1 == pipe(put->pipe))
+	req->cgisplice = 0;
+    if (req->cgisplice) {
+	close_on_exec(put->pipe[0]);
+	close_on_exec(put->pipe[1]);
+# ifdef F_SETPIPE_SZ
+	fcntl(put->pipe[1],F_SETPIPE_SZ,PUT_PIPE_SIZE);
+# endif
+    }
+#endif
+
+    if (debug)
+	fprintf(stderr,"%03d: put: %s%s (%s)\n",req->fd,put->dir,put->name,
+		put->replace ? "replace" : "new");
+    if (IN_NONE == req->inmode)
+	/* no body, empty file */
+	req->inmode = IN_EOF;
+    req->infd  = put->fd;
+    req->state = STATE_READ_BODY;
+}
+
+/* file complete: move it into place */
+static int
+put_finish(struct REQUEST *req)
+{
+    struct PUT *put = req->put;
+    int replace = put->replace;
+
+    if (-1 == close(put->fd)) {
+	put->fd = -1;
+	return put_error(req,errno);
+    }
+    put->fd = -1;
+    if (-1 == renameat(put->dfd,put->tmp,put->dfd,put->name))
+	return put_error(req,errno);
+    if (debug)
+	fprintf(stderr,"%03d: put: %s%s done\n",req->fd,put->dir,put->name);
+    pc_forget(req);
+    forget_dir(put->dir);
+    put_free(req);
+    mkerror(req, replace ? 204 : 201, 1);
+    return 0;
+}
+
+/* write(2) lookalike for read_body(), len 0: body complete */
+int
+put_write(struct REQUEST *req, char *buf, int len)
+{
+    struct PUT *put = req->put;
+    int rc, done;
+
+    if (0 == len)
+	return put_finish(req);
+    for (done = 0; done < len; done += rc) {
+	rc = write(put->fd, buf + done, len - done);
+	if (-1 == rc) {
+	    if (EINTR == errno) {
+		rc = 0;
+		continue;
+	    }
+	    return put_error(req,errno);
+	}
+    }
+    return len;
+}
+
+#ifdef SPLICE_F_NONBLOCK
+/* socket -> pipe -> file, returns like splice() from the socket */
+int
+put_splice(struct REQUEST *req, int len)
+{
+    struct PUT *put = req->put;
+    int rc, n, done;
+
+    rc = splice(req->fd, NULL, put->pipe[1], NULL, len,
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rc <= 0)
+	return rc;
+    for (done = 0; done < rc; done += n) {
+	n = splice(put->pipe[0], NULL, put->fd, NULL, rc - done,
+		   SPLICE_F_MOVE);
+	if (n <= 0) {
+	    if (-1 == n && EINTR == errno) {
+		n = 0;
+		continue;
+	    }
+	    return put_error(req, n ? errno : EIO);
+	}
+    }
+    return rc;
+}
+#endif
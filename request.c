@@ -8,28 +8,280 @@
 #include <time.h>
 #include <ctype.h>
 #include <pwd.h>
+#include <dirent.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
 
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/openat2.h>)
+#  include <sys/syscall.h>
+#  include <linux/openat2.h>
+# endif
+#endif
+
 #include "httpd.h"
 
 /* ---------------------------------------------------------------------- */
 
+/*
+ * incremental request parser
+ *
+ * Scans hreq from where the previous call stopped (req->hscan) and
+ * records offset/length slices for the request line and the header
+ * lines.  Syntax is validated in the same pass.  Returns 1 once the
+ * header is complete, 0 if more data is needed and -1 for garbage.
+ */
+
+#define HS_METHOD     0
+#define HS_TARGET     1
+#define HS_VERSION    2
+#define HS_LINE       3     /* start of a header line */
+#define HS_NAME       4
+#define HS_VALUE_WS   5
+#define HS_VALUE      6
+#define HS_LF         7     /* got CR, want LF */
+#define HS_END_LF     8     /* got CR of the empty line, want LF */
+
+/* token characters (RFC 7230) */
+static const char http_tchar[256] = {
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+static int
+scan_method(char *m, int len)
+{
+    switch (len) {
+    case 3:
+	return 0 == memcmp(m,"GET",3) || 0 == memcmp(m,"PUT",3);
+    case 4:
+	return 0 == memcmp(m,"HEAD",4) || 0 == memcmp(m,"POST",4);
+    }
+    return 0;
+}
+
+static int
+scan_version(char *v, int len)
+{
+    return 8 == len && 0 == memcmp(v,"HTTP/",5) &&
+	isdigit(v[5]) && '.' == v[6] && isdigit(v[7]);
+}
+
+/*
+ * Header lines go to req->hinline.  Only requests with lots of
+ * headers get a larger array from the heap, which is then kept for
+ * the lifetime of the connection.
+ */
+static int
+grow_headers(struct REQUEST *req)
+{
+    struct HEADER *hdr;
+
+    if (NULL == req->hdr) {
+	req->hdr  = req->hinline;
+	req->ahdr = HDR_INLINE;
+	return 0;
+    }
+    if (req->hdr == req->hinline) {
+	hdr = malloc(2 * req->ahdr * sizeof(struct HEADER));
+	if (NULL == hdr)
+	    return -1;
+	memcpy(hdr,req->hinline,sizeof(req->hinline));
+    } else {
+	hdr = realloc(req->hdr,2 * req->ahdr * sizeof(struct HEADER));
+	if (NULL == hdr)
+	    return -1;
+    }
+    req->hdr   = hdr;
+    req->ahdr *= 2;
+    return 0;
+}
+
+int
+scan_request(struct REQUEST *req)
+{
+    unsigned char  *buf = (unsigned char *)req->hreq;
+    struct HEADER  *hdr = req->nhdr ? req->hdr + req->nhdr - 1 : NULL;
+    int            pos, c;
+
+    for (pos = req->hscan; pos < req->hdata; pos++) {
+	/* skip over runs of plain bytes */
+	switch (req->hstate) {
+	case HS_TARGET:
+	    pos += scanner->target(req->hreq+pos, req->hdata-pos);
+	    break;
+	case HS_VERSION:
+	case HS_VALUE:
+	    pos += scanner->ctl(req->hreq+pos, req->hdata-pos);
+	    break;
+	}
+	if (pos == req->hdata)
+	    break;
+
+	c = buf[pos];
+	switch (req->hstate) {
+	case HS_METHOD:
+	    if (c >= 'A' && c <= 'Z' && pos < MAX_MISC)
+		continue;
+	    if (c != ' ' || !scan_method(req->hreq,pos))
+		goto bad;
+	    req->method.off = 0;
+	    req->method.len = pos;
+	    req->target.off = pos+1;
+	    req->hstate = HS_TARGET;
+	    continue;
+	case HS_TARGET:
+	    if (c > ' ' && c != 0x7f)
+		continue;
+	    if (c != ' ' || pos == req->target.off)
+		goto bad;
+	    req->target.len  = pos - req->target.off;
+	    req->version.off = pos+1;
+	    req->hstate = HS_VERSION;
+	    continue;
+	case HS_VERSION:
+	    if (c != '\r' && c != '\n')
+		continue;
+	    req->version.len = pos - req->version.off;
+	    if (!scan_version(req->hreq + req->version.off, req->version.len))
+		goto bad;
+	    break;
+	case HS_LINE:
+	    if (c == '\r') {
+		req->hstate = HS_END_LF;
+		continue;
+	    }
+	    if (c == '\n')
+		goto done;
+	    if (!http_tchar[c])
+		goto bad; /* also catches obsolete line folding */
+	    if (req->nhdr == req->ahdr && -1 == grow_headers(req))
+		goto bad;
+	    hdr = req->hdr + req->nhdr++;
+	    hdr->name.off = pos;
+	    req->hstate = HS_NAME;
+	    continue;
+	case HS_NAME:
+	    if (http_tchar[c])
+		continue;
+	    if (c != ':')
+		goto bad;
+	    hdr->name.len = pos - hdr->name.off;
+	    req->hstate = HS_VALUE_WS;
+	    continue;
+	case HS_VALUE_WS:
+	    if (c == ' ' || c == '\t')
+		continue;
+	    hdr->value.off = pos;
+	    req->hstate = HS_VALUE;
+	    /* fall through */
+	case HS_VALUE:
+	    if (c != '\r' && c != '\n') {
+		if ((c < ' ' && c != '\t') || c == 0x7f)
+		    goto bad;
+		continue;
+	    }
+	    hdr->value.len = pos - hdr->value.off;
+	    while (hdr->value.len > 0 &&
+		   (buf[hdr->value.off + hdr->value.len - 1] == ' ' ||
+		    buf[hdr->value.off + hdr->value.len - 1] == '\t'))
+		hdr->value.len--;
+	    break;
+	case HS_LF:
+	    if (c != '\n')
+		goto bad;
+	    req->hstate = HS_LINE;
+	    continue;
+	case HS_END_LF:
+	    if (c != '\n')
+		goto bad;
+	    goto done;
+	}
+
+	/* end of request line or header line */
+	req->hstate = (c == '\r') ? HS_LF : HS_LINE;
+    }
+    req->hscan = pos;
+    return 0;
+
+ done:
+    req->hscan = pos+1;
+    req->lreq  = pos+1;
+    return 1;
+
+ bad:
+    req->hscan = pos;
+    return -1;
+}
+
+/*
+ * The header buffer comes from the buffer pool.  It starts small and
+ * is doubled when full, up to max_header bytes.
+ */
+static int
+resize_hreq(struct REQUEST *req, int size)
+{
+    char *buf;
+
+    if (NULL == (buf = pool_get(size)))
+	return -1;
+    if (req->hreq) {
+	memcpy(buf,req->hreq,req->hdata);
+	pool_put(req->hreq,req->ahreq);
+    }
+    req->hreq  = buf;
+    req->ahreq = size;
+    return 0;
+}
+
+static int
+grow_hreq(struct REQUEST *req)
+{
+    int size;
+
+    size = req->ahreq ? 2 * req->ahreq : POOL_MIN;
+    if (size > max_header && req->ahreq < max_header)
+	size = max_header; /* last step, -H needn't be a power of two */
+    if (size > max_header)
+	return -1;
+    return resize_hreq(req,size);
+}
+
+/* idle keep-alive connections don't hold on to a buffer */
+void
+release_hreq(struct REQUEST *req)
+{
+    if (NULL == req->hreq)
+	return;
+    pool_put(req->hreq,req->ahreq);
+    req->hreq  = NULL;
+    req->ahreq = 0;
+}
+
 void
 read_request(struct REQUEST *req, int pipelined)
 {
     int             rc;
-    char            *h;
+
+    if (NULL == req->hreq && -1 == grow_hreq(req)) {
+	/* out of memory */
+	req->state = STATE_CLOSE;
+	return;
+    }
 
  restart:
 #ifdef USE_SSL
     if (with_ssl)
-	rc = ssl_read(req, req->hreq + req->hdata, MAX_HEADER - req->hdata);
+	rc = ssl_read(req, req->hreq + req->hdata, req->ahreq - 1 - req->hdata);
     else
 #endif
-	rc = read(req->fd, req->hreq + req->hdata, MAX_HEADER - req->hdata);
+	rc = read(req->fd, req->hreq + req->hdata, req->ahreq - 1 - req->hdata);
     switch (rc) {
     case -1:
 	if (errno == EAGAIN) {
@@ -46,38 +298,35 @@ read_request(struct REQUEST *req, int pipelined)
 	req->state = STATE_CLOSE;
 	return;
     default:
+	if (!req->tstart)
+	    req->tstart = stats_us();
 	req->hdata += rc;
 	req->hreq[req->hdata] = 0;
     }
 
-    /* check if this looks like a http request after
-       the first few bytes... */
-    if (req->hdata < 5)
-	return;
-    if (strncmp(req->hreq,"GET ",4)  != 0  &&
-	strncmp(req->hreq,"PUT ",4)  != 0  &&
-	strncmp(req->hreq,"HEAD ",5) != 0  &&
-	strncmp(req->hreq,"POST ",5) != 0) {
-	mkerror(req,400,0);
-	return;
+    /* http/2 with prior knowledge, or negotiated via alpn */
+    if (!no_http2 && 'P' == req->hreq[0]) {
+	switch (h2_preface(req)) {
+	case 1:
+	    h2_start(req);
+	    return;
+	case 0:
+	    return;
+	}
     }
-    
+
     /* header complete ?? */
-    if (NULL != (h = strstr(req->hreq,"\r\n\r\n")) ||
-	NULL != (h = strstr(req->hreq,"\n\n"))) {
-	if (*h == '\r') {
-	    h += 4;
-	    *(h-2) = 0;
-	} else {
-	    h += 2;
-	    *(h-1) = 0;
-	}
-	req->lreq  = h - req->hreq;
+    switch (scan_request(req)) {
+    case -1:
+	mkerror(req,400,0);
+	return;
+    case 1:
 	req->state = STATE_PARSE_HEADER;
 	return;
     }
 
-    if (req->hdata == MAX_HEADER) {
+    /* one byte is kept for the terminating '\0' */
+    if (req->hdata + 1 == req->ahreq && -1 == grow_hreq(req)) {
 	/* oops: buffer full, but found no complete request ... */
 	mkerror(req,400,0);
 	return;
@@ -87,8 +336,234 @@ read_request(struct REQUEST *req, int pipelined)
 
 /* ---------------------------------------------------------------------- */
 
-#if 0
-static time_t
+/*
+ * request body
+ *
+ * The body goes to the cgi script while the response is running, or
+ * into the upload file.  Nothing is read from the client before the
+ * sink has taken the previous data, so buffering is bounded by the
+ * size of hreq.  Body
+ * bytes which came in along with the header (or the chunk framing)
+ * are in hreq from inpos to hdata.  Once they are gone hreq is reused
+ * from lreq on, data goes from the socket into the pipe with splice()
+ * where possible.
+ */
+
+#define IN_BUFFER     (16*1024)    /* read(): one tls record */
+#define IN_SPLICE     (1024*1024)
+
+#define CH_SIZE0      0     /* chunk size, no digit yet */
+#define CH_SIZE       1
+#define CH_EXT        2     /* extension, ignored */
+#define CH_DATA       3
+#define CH_DATA_CR    4     /* CRLF after the data */
+#define CH_DATA_LF    5
+#define CH_TRAILER    6     /* start of a trailer line */
+#define CH_TRAILER_LN 7
+#define CH_END_LF     8     /* got CR of the empty line, want LF */
+
+/* chunk framing from hreq, up to the next data.  -1: garbage */
+static int
+read_chunk(struct REQUEST *req)
+{
+    int c;
+
+    while (req->inpos < req->hdata && IN_CHUNKED == req->inmode &&
+	   CH_DATA != req->inchunk) {
+	c = (unsigned char)req->hreq[req->inpos++];
+	switch (req->inchunk) {
+	case CH_SIZE0:
+	case CH_SIZE:
+	    if (isxdigit(c)) {
+		if (req->inleft >> 56)
+		    return -1;
+		req->inleft = req->inleft << 4 |
+		    (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+		req->inchunk = CH_SIZE;
+		continue;
+	    }
+	    if (CH_SIZE0 == req->inchunk)
+		return -1;
+	    if (c != '\n') {
+		if (c != ';' && c != '\r' && c != ' ' && c != '\t')
+		    return -1;
+		req->inchunk = CH_EXT;
+		continue;
+	    }
+	    break;
+	case CH_EXT:
+	    if (c != '\n')
+		continue;
+	    break;
+	case CH_DATA_CR:
+	    if (c == '\r') {
+		req->inchunk = CH_DATA_LF;
+		continue;
+	    }
+	    /* fall through */
+	case CH_DATA_LF:
+	    if (c != '\n')
+		return -1;
+	    req->inchunk = CH_SIZE0;
+	    continue;
+	case CH_TRAILER:
+	    if (c == '\n') {
+		req->inmode = IN_EOF;
+	    } else {
+		req->inchunk = (c == '\r') ? CH_END_LF : CH_TRAILER_LN;
+	    }
+	    continue;
+	case CH_TRAILER_LN:
+	    if (c == '\n')
+		req->inchunk = CH_TRAILER;
+	    continue;
+	case CH_END_LF:
+	    if (c != '\n')
+		return -1;
+	    req->inmode = IN_EOF;
+	    continue;
+	}
+
+	/* end of the chunk size line */
+	req->inchunk = req->inleft ? CH_DATA : CH_TRAILER;
+    }
+    return 0;
+}
+
+/* the sink: cgi script or upload file */
+static int
+body_write(struct REQUEST *req, char *buf, int len)
+{
+    if (req->put)
+	return put_write(req,buf,len);
+    return cgi_write(req,buf,len);
+}
+
+static void
+body_data(struct REQUEST *req, int n)
+{
+    req->inleft -= n;
+    if (req->inleft)
+	return;
+    if (IN_LENGTH == req->inmode)
+	req->inmode = IN_EOF;
+    else
+	req->inchunk = CH_DATA_CR;
+}
+
+void
+read_body(struct REQUEST *req)
+{
+    int rc, n;
+
+    for (;;) {
+	if (-1 == read_chunk(req))
+	    goto gone;
+
+	if (IN_EOF == req->inmode) {
+	    /* all there, tell the script */
+	    req->lreq = req->inpos; /* pipelined request follows */
+	    if (-1 == body_write(req,NULL,0)) {
+		if (EAGAIN == errno) {
+		    req->inwait = IN_WAIT_SINK;
+		    return;
+		}
+		goto drop;
+	    }
+	    req->infd  = -1;
+	    req->inmode = IN_NONE;
+	    return;
+	}
+
+	/* body data in hreq */
+	if (req->inpos < req->hdata) {
+	    n = req->hdata - req->inpos;
+	    if (n > req->inleft)
+		n = req->inleft;
+	    rc = body_write(req, req->hreq + req->inpos, n);
+	    if (-1 == rc) {
+		if (EAGAIN == errno) {
+		    req->inwait = IN_WAIT_SINK;
+		    return;
+		}
+		if (EINTR == errno)
+		    continue;
+		goto drop;
+	    }
+	    req->inpos += rc;
+	    body_data(req,rc);
+	    continue;
+	}
+
+	/* need more from the client */
+	req->hdata = req->inpos = req->lreq;
+#ifdef SPLICE_F_NONBLOCK
+	if (req->cgisplice && (IN_LENGTH == req->inmode || CH_DATA == req->inchunk)) {
+	    n = req->inleft > IN_SPLICE ? IN_SPLICE : req->inleft;
+	    if (req->put)
+		rc = put_splice(req,n);
+	    else
+		rc = splice(req->fd, NULL, req->infd, NULL, n,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	    if (rc > 0) {
+		body_data(req,rc);
+		continue;
+	    }
+	    if (0 == rc)
+		goto gone;
+	    if (EAGAIN == errno) {
+		/* socket empty or pipe full? */
+		if (-1 == ioctl(req->fd,FIONREAD,&n))
+		    n = 0;
+		req->inwait = n ? IN_WAIT_SINK : IN_WAIT_SOCK;
+		return;
+	    }
+	    if (EINTR == errno)
+		continue;
+	    if (EPIPE == errno)
+		goto drop;
+	    goto gone;
+	}
+#endif
+	if (req->ahreq < IN_BUFFER && -1 == resize_hreq(req,IN_BUFFER))
+	    goto gone;
+#ifdef USE_SSL
+	if (with_ssl)
+	    rc = ssl_read(req, req->hreq + req->hdata, req->ahreq - 1 - req->hdata);
+	else
+#endif
+	    rc = read(req->fd, req->hreq + req->hdata, req->ahreq - 1 - req->hdata);
+	if (rc > 0) {
+	    req->hdata += rc;
+	    continue;
+	}
+	if (0 == rc)
+	    goto gone;
+	if (EAGAIN == errno) {
+	    req->inwait = IN_WAIT_SOCK;
+	    return;
+	}
+	if (EINTR == errno)
+	    continue;
+	goto gone;
+    }
+
+ drop:
+    /* script doesn't want (the rest of) the body */
+    cgi_stdin_done(req);
+    req->keep_alive = 0;
+    return;
+
+ gone:
+    /* client went away or sent garbage */
+    if (debug)
+	fprintf(stderr,"%03d: request body incomplete\n",req->fd);
+    req->state = STATE_CLOSE;
+}
+
+/* ---------------------------------------------------------------------- */
+
+time_t
 parse_date(char *line)
 {
     static char *m[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
@@ -97,6 +572,7 @@ parse_date(char *line)
     struct tm tm;
     int i;
 
+    memset(&tm,0,sizeof(tm));
     line = strchr(line,' '); /* skip weekday */
     if (NULL == line)
 	return -1;
@@ -120,13 +596,14 @@ parse_date(char *line)
     for (i = 0; i <= 11; i++)
 	if (0 == strcmp(month,m[i]))
 	    break;
+    if (i > 11)
+	return -1;
     tm.tm_mon = i;
     if (tm.tm_year > 1900)
 	tm.tm_year -= 1900;
 
-    return mktime(&tm);
+    return timegm(&tm);
 }
-#endif
 
 static off_t
 parse_off_t(char *str, int *pos)
@@ -218,12 +695,21 @@ unhex(unsigned char c)
 static void
 unquote(unsigned char *path, unsigned char *qs, unsigned char *src)
 {
-    int q;
-    unsigned char *dst;
+    unsigned char *dst, *end;
+    int q,n;
 
     q=0;
     dst = path;
-    while (src[0] != 0) {
+    end = src + strlen((char*)src);
+    while (src < end) {
+	/* copy plain runs in one go */
+	n = scanner->delim((char*)src, end-src);
+	memcpy(dst,src,n);
+	dst += n;
+	src += n;
+	if (src == end)
+	    break;
+
 	if (!q && *src == '?') {
 	    q = 1;
 	    *dst = 0;
@@ -251,13 +737,25 @@ fixpath(char *path)
 {
     char *dst = path;
     char *src = path;
+    char *end = path + strlen(path);
+    char *slash;
+    int  n;
 
-    for (;*src;) {
-	if (0 == strncmp(src,"//",2)) {
+    while (src < end) {
+	/* everything up to the next slash is copied as-is */
+	slash = memchr(src,'/',end-src);
+	n = (slash ? slash : end) - src;
+	memmove(dst,src,n);
+	dst += n;
+	src += n;
+	if (src == end)
+	    break;
+
+	if (src[1] == '/') {
 	    src++;
 	    continue;
 	}
-	if (0 == strncmp(src,"/./",3)) {
+	if (src[1] == '.' && src[2] == '/') {
 	    src+=2;
 	    continue;
 	}
@@ -295,10 +793,8 @@ decode_base64(unsigned char *dest, unsigned char *src, int maxlen)
     dest[d] = 0;
 }
 
-static int sanity_checks(struct REQUEST *req)
+static int check_path(struct REQUEST *req)
 {
-    int i;
-		
     /* path: must start with a '/' */
     if (req->path[0] != '/') {
 	mkerror(req,400,0);
@@ -310,6 +806,12 @@ static int sanity_checks(struct REQUEST *req)
 	mkerror(req,403,1);
 	return -1;
     }
+    return 0;
+}
+
+static int check_hostname(struct REQUEST *req)
+{
+    int i;
 
     if (req->hostname[0] == '\0')
 	/* no hostname specified */
@@ -347,56 +849,476 @@ static int sanity_checks(struct REQUEST *req)
     return 0;
 }
 
+/* absolute URI in the request line: http://host[:port]/path */
+static int
+parse_absolute(struct REQUEST *req, char *target, int len)
+{
+    char *end = target + len;
+    int  n;
+
+    if (len < 7 || 0 != strncasecmp(target,"http://",7))
+	return -1;
+    target += 7;
+    for (n = 0; target+n < end && n <= MAX_HOST; n++)
+	if (!isalnum(target[n]) && target[n] != '.' && target[n] != '-')
+	    break;
+    if (0 == n || n > MAX_HOST)
+	return -1;
+    memcpy(req->hostname,target,n);
+    req->hostname[n] = 0;
+    target += n;
+    if (target < end && ':' == *target)
+	for (target++; target < end && isdigit(*target); target++)
+	    ;
+    if (target == end)
+	return -1;
+    memcpy(req->uri,target,end-target);
+    req->uri[end-target] = 0;
+    return 0;
+}
+
+/*
+ * Document root directory fds.  Files are opened relative to them,
+ * which keeps the kernel path walk short and (with openat2) refuses
+ * anything which resolves to a place outside the document root.
+ * With virtual hosts the host directories existing at startup get
+ * their own fd, others are opened as "host/path" below the root.
+ */
+struct VHOST {
+    char *name;
+    int  fd;
+};
+
+static int          root_fd = -1;
+static int          root_len;
+static struct VHOST *vhosts;
+static int          nvhosts;
+
+static int
+cmp_vhost(const void *a, const void *b)
+{
+    return strcmp(((struct VHOST*)a)->name, ((struct VHOST*)b)->name);
+}
+
+void
+init_docroot(void)
+{
+    struct dirent *ent;
+    DIR *dir;
+    int fd;
+
+    root_len = do_chroot ? 0 : strlen(doc_root);
+    root_fd  = open(do_chroot ? "/" : doc_root, O_RDONLY | O_DIRECTORY);
+    if (-1 == root_fd) {
+	xperror(LOG_ERR,"open document root",NULL);
+	exit(1);
+    }
+    close_on_exec(root_fd);
+    if (!virtualhosts)
+	return;
+
+    if (NULL == (dir = fdopendir(dup(root_fd))))
+	return;
+    while (NULL != (ent = readdir(dir))) {
+	if (ent->d_name[0] == '.' || strlen(ent->d_name) > MAX_HOST)
+	    continue;
+	fd = openat(root_fd, ent->d_name, O_RDONLY | O_DIRECTORY);
+	if (-1 == fd)
+	    continue;
+	close_on_exec(fd);
+	if (0 == (nvhosts % 16))
+	    vhosts = realloc(vhosts,(nvhosts+16)*sizeof(struct VHOST));
+	vhosts[nvhosts].name = strdup(ent->d_name);
+	vhosts[nvhosts].fd   = fd;
+	nvhosts++;
+    }
+    closedir(dir);
+    qsort(vhosts,nvhosts,sizeof(struct VHOST),cmp_vhost);
+    if (debug)
+	fprintf(stderr,"docroot: %d virtual host dirs\n",nvhosts);
+}
+
+/*
+ * dirfd for filename, *skip is set to the length of the filename
+ * prefix it stands for ("docroot/" or "docroot/host/").
+ */
+int
+docroot_fd(char *host, int *skip)
+{
+    struct VHOST key, *vh;
+
+    *skip = root_len + 1;
+    if (!virtualhosts)
+	return root_fd;
+    key.name = host;
+    vh = bsearch(&key,vhosts,nvhosts,sizeof(struct VHOST),cmp_vhost);
+    if (NULL == vh)
+	return root_fd;
+    *skip += strlen(host) + 1;
+    return vh->fd;
+}
+
+/*
+ * ~user expansion.  Per thread cache for user name => $HOME/userdir
+ * and a fd for it, so user pages need neither NSS lookups nor full
+ * path walks.  Unknown users are cached too, for a shorter time.
+ */
+#define USERDIR_SLOTS    64
+#define USERDIR_TTL     300     /* seconds */
+#define USERDIR_NEG_TTL  30
+
+struct USERDIR {
+    char   *name;    /* NULL: slot unused */
+    char   *path;    /* NULL: no such user */
+    int    fd;       /* -1: can't open path */
+    time_t add;
+};
+
+static THREAD_LOCAL struct USERDIR userdirs[USERDIR_SLOTS];
+
+static struct USERDIR*
+get_userdir(char *name)
+{
+    struct USERDIR *ud;
+    struct passwd pw, *res;
+    char buf[1024], path[MAX_PATH+1];
+    unsigned int hash = 2166136261u;
+    char *h;
+
+    for (h = name; *h; h++)
+	hash = (hash ^ (unsigned char)*h) * 16777619u;
+    ud = userdirs + hash % USERDIR_SLOTS;
+    if (ud->name && 0 == strcmp(ud->name,name) &&
+	now - ud->add < (ud->path ? USERDIR_TTL : USERDIR_NEG_TTL))
+	return ud;
+
+    /* (re-)fill slot */
+    if (ud->name) {
+	if (-1 != ud->fd)
+	    close(ud->fd);
+	free(ud->name);
+	free(ud->path);
+    }
+    ud->name = strdup(name);
+    ud->path = NULL;
+    ud->fd   = -1;
+    ud->add  = now;
+    if (0 == getpwnam_r(name,&pw,buf,sizeof(buf),&res) && NULL != res) {
+	snprintf(path,sizeof(path),"%s/%s",pw.pw_dir,userdir);
+	ud->path = strdup(path);
+	if (-1 != (ud->fd = open(path,O_RDONLY | O_DIRECTORY)))
+	    close_on_exec(ud->fd);
+    }
+    if (NULL == ud->name) {
+	/* out of memory, don't keep a half filled slot */
+	free(ud->path);
+	ud->path = NULL;
+	if (-1 != ud->fd)
+	    close(ud->fd);
+	ud->fd = -1;
+	return ud;
+    }
+    if (debug)
+	fprintf(stderr,"userdir: %s => %s\n",name,ud->path ? ud->path : "none");
+    return ud;
+}
+
+/* open name below dirfd, neither ".." nor symlinks may lead outside */
+int
+open_beneath(int dirfd, char *name, int flags)
+{
+#ifdef SYS_openat2
+    static int no_openat2;
+    struct open_how how;
+    int fd;
+#endif
+
+    if (dirfd == AT_FDCWD)
+	/* not below a document root (~user) */
+	return open(name, flags);
+    if (0 == name[0])
+	name = ".";
+#ifdef SYS_openat2
+    if (!no_openat2) {
+	memset(&how,0,sizeof(how));
+	how.flags   = flags;
+	how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+	fd = syscall(SYS_openat2, dirfd, name, &how, sizeof(how));
+	if (-1 != fd || errno != ENOSYS)
+	    return fd;
+	/* old kernel */
+	no_openat2 = 1;
+    }
+#endif
+    return openat(dirfd, name, flags);
+}
+
+/*
+ * path resolution cache: (virtual host, raw uri) => unquoted path,
+ * query string and what the filesystem lookup found.  Entries are
+ * revalidated using the mtime of the directory the answer depends
+ * on, unless the open() needed anyway does the job.
+ */
+#define PC_FILE       1     /* regular file, maybe the index file */
+#define PC_LISTING    2     /* directory without index file */
+#define PC_REDIRECT   3     /* directory, uri lacks the trailing slash */
+#define PC_NOTFOUND   4     /* 404, filename is the closest existing parent */
+
+#define PC_SLOTS    512
+#define PC_MAX_AGE  300     /* seconds */
+
+struct PATHCACHE {
+    unsigned int hash;
+    int          kind;
+    time_t       add;
+    time_t       mtime;
+    char         *host, *uri, *path, *query, *filename;
+};
+
+static struct PATHCACHE *pathcache[PC_SLOTS];
+#ifdef USE_THREADS
+static pthread_mutex_t lock_pathcache = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static unsigned int
+pc_hash(char *host, char *uri)
+{
+    unsigned int hash = 2166136261u;
+
+    for (; *host; host++)
+	hash = (hash ^ (unsigned char)*host) * 16777619u;
+    hash *= 16777619u;
+    for (; *uri; uri++)
+	hash = (hash ^ (unsigned char)*uri) * 16777619u;
+    return hash;
+}
+
+/* on a hit req->path, req->query and filename are filled in */
+static int
+pc_lookup(struct REQUEST *req, char *host, char *filename, time_t *mtime)
+{
+    struct PATHCACHE *pc;
+    unsigned int hash;
+    int kind = 0;
+
+    hash = pc_hash(host,req->uri);
+    DO_LOCK(lock_pathcache);
+    pc = pathcache[hash % PC_SLOTS];
+    if (pc && pc->hash == hash && now - pc->add <= PC_MAX_AGE &&
+	0 == strcmp(pc->uri,req->uri) && 0 == strcmp(pc->host,host)) {
+	strcpy(req->path,  pc->path);
+	strcpy(req->query, pc->query);
+	strcpy(filename,   pc->filename);
+	*mtime = pc->mtime;
+	kind   = pc->kind;
+    }
+    DO_UNLOCK(lock_pathcache);
+    return kind;
+}
+
+static void
+pc_add(struct REQUEST *req, char *host, int kind, char *filename, time_t mtime)
+{
+    struct PATHCACHE *pc,*old;
+    int lh,lu,lp,lq,lf;
+
+    if (kind != PC_FILE && mtime >= now)
+	/* directory changed just now, maybe again within this second */
+	return;
+
+    lh = strlen(host)+1;
+    lu = strlen(req->uri)+1;
+    lp = strlen(req->path)+1;
+    lq = strlen(req->query)+1;
+    lf = strlen(filename)+1;
+    if (NULL == (pc = malloc(sizeof(*pc) + lh+lu+lp+lq+lf)))
+	return;
+    pc->host     = memcpy((char*)(pc+1), host,       lh);
+    pc->uri      = memcpy(pc->host + lh, req->uri,   lu);
+    pc->path     = memcpy(pc->uri  + lu, req->path,  lp);
+    pc->query    = memcpy(pc->path + lp, req->query, lq);
+    pc->filename = memcpy(pc->query+ lq, filename,   lf);
+    pc->hash     = pc_hash(host,req->uri);
+    pc->kind     = kind;
+    pc->add      = now;
+    pc->mtime    = mtime;
+
+    DO_LOCK(lock_pathcache);
+    old = pathcache[pc->hash % PC_SLOTS];
+    pathcache[pc->hash % PC_SLOTS] = pc;
+    DO_UNLOCK(lock_pathcache);
+    free(old);
+    if (debug)
+	fprintf(stderr,"%03d: pathcache: %s => %d %s\n",
+		req->fd, req->uri, kind, filename);
+}
+
+/* drop the entry for req->uri, the file has been replaced */
+void
+pc_forget(struct REQUEST *req)
+{
+    struct PATHCACHE *pc,*old = NULL;
+    char *host = virtualhosts ? req->hostname : "";
+    unsigned int hash;
+
+    hash = pc_hash(host,req->uri);
+    DO_LOCK(lock_pathcache);
+    pc = pathcache[hash % PC_SLOTS];
+    if (pc && pc->hash == hash &&
+	0 == strcmp(pc->uri,req->uri) && 0 == strcmp(pc->host,host)) {
+	pathcache[hash % PC_SLOTS] = NULL;
+	old = pc;
+    }
+    DO_UNLOCK(lock_pathcache);
+    free(old);
+}
+
+/*
+ * revalidate a cached answer: open filename beneath the docroot (by
+ * path it might have been replaced by a symlink leading outside) and
+ * check the mtime.  Returns the fd or -1.
+ */
+static int
+pc_open(int dirfd, char *filename, int skip, int flags, time_t mtime,
+	struct stat *st)
+{
+    int fd;
+
+    if ((int)strlen(filename) < skip)
+	return -1;
+    if (-1 == (fd = open_beneath(dirfd,filename+skip,flags)))
+	return -1;
+    if (0 != fstat(fd,st) || st->st_mtime != mtime) {
+	close(fd);
+	return -1;
+    }
+    close_on_exec(fd);
+    return fd;
+}
+
+/* remember a 404, keyed to the closest existing parent directory */
+static void
+pc_notfound(struct REQUEST *req, char *host, char *filename)
+{
+    char parent[MAX_PATH+1], *h;
+    struct stat st;
+
+    strcpy(parent,filename);
+    for (;;) {
+	h = strrchr(parent,'/');
+	if (NULL == h || h == parent)
+	    return;
+	*h = 0;
+	if (0 == stat(parent,&st))
+	    break;
+	if (errno != ENOENT && errno != ENOTDIR)
+	    return;
+    }
+    pc_add(req,host,PC_NOTFOUND,parent,st.st_mtime);
+}
+
+/*
+ * Request headers we care about.  The switch key is the name length
+ * plus the low five bits of the first char (which ignores case for
+ * letters), the compiler rejects duplicate keys.  So recognizing a
+ * header is one switch and one strncasecmp.
+ */
+#define HDR_OTHER              0
+#define HDR_CONNECTION         1
+#define HDR_HOST               2
+#define HDR_IF_MODIFIED        3
+#define HDR_IF_UNMODIFIED      4
+#define HDR_IF_RANGE           5
+#define HDR_AUTHORIZATION      6
+#define HDR_RANGE              7
+#define HDR_CONTENT_LENGTH     8
+#define HDR_CONTENT_TYPE       9
+#define HDR_TRANSFER_ENCODING 10
+#define HDR_EXPECT            11
+
+#define HDR_KEY(len,c)  (((len) << 5) | ((c) & 0x1f))
+
+static int
+header_id(char *h, int len)
+{
+    char *name;
+    int  id;
+
+    switch (HDR_KEY(len,h[0])) {
+    case HDR_KEY(10,'c'): name = "connection";          id = HDR_CONNECTION;    break;
+    case HDR_KEY( 4,'h'): name = "host";                id = HDR_HOST;          break;
+    case HDR_KEY(17,'i'): name = "if-modified-since";   id = HDR_IF_MODIFIED;   break;
+    case HDR_KEY(19,'i'): name = "if-unmodified-since"; id = HDR_IF_UNMODIFIED; break;
+    case HDR_KEY( 8,'i'): name = "if-range";            id = HDR_IF_RANGE;      break;
+    case HDR_KEY(13,'a'): name = "authorization";       id = HDR_AUTHORIZATION; break;
+    case HDR_KEY( 5,'r'): name = "range";               id = HDR_RANGE;         break;
+    case HDR_KEY(14,'c'): name = "content-length";      id = HDR_CONTENT_LENGTH; break;
+    case HDR_KEY(12,'c'): name = "content-type";        id = HDR_CONTENT_TYPE;  break;
+    case HDR_KEY(17,'t'): name = "transfer-encoding";   id = HDR_TRANSFER_ENCODING; break;
+    case HDR_KEY( 6,'e'): name = "expect";              id = HDR_EXPECT;        break;
+    default:
+	return HDR_OTHER;
+    }
+    return (0 == strncasecmp(h,name,len)) ? id : HDR_OTHER;
+}
+
+#define CONTINUE "HTTP/1.1 100 Continue\r\n\r\n"
+
+/* the request body has a taker now */
+static void
+start_body(struct REQUEST *req, int expect)
+{
+    if (-1 == req->infd)
+	return;
+    if (expect && req->minor > 0 && req->inpos == req->hdata) {
+	/* client waits for the go-ahead before sending the body,
+	   the socket buffer is empty so this doesn't block */
+#ifdef USE_SSL
+	if (with_ssl)
+	    ssl_write(req, CONTINUE, sizeof(CONTINUE)-1);
+	else
+#endif
+	    write(req->fd, CONTINUE, sizeof(CONTINUE)-1);
+    }
+    read_body(req);
+}
+
 void
 parse_request(struct REQUEST *req)
 {
-    char filename[MAX_PATH+1], proto[MAX_MISC+1], *h;
-    int  port, rc, len;
-    struct passwd *pw=NULL;
+    char filename[MAX_PATH+1], *target, *value, *host, *h;
+    int  rc, len, hlen, i, cached, cache = 1, dirfd, skip, fd;
+    int  chunked = 0, bodyerr = 0, expect = 0;
+    off_t clen = -1, l;
+    struct USERDIR *ud;
+    struct stat st;
+    time_t mtime = 0;
     
     if (debug > 2)
-	fprintf(stderr,"%s\n",req->hreq);
+	fprintf(stderr,"%.*s",req->lreq,req->hreq);
 
-    /* parse request. Hehe, scanf is powerfull :-) */
-    if (4 != sscanf(req->hreq,
-		    "%" S(MAX_MISC) "[A-Z] "
-		    "%" S(MAX_PATH) "[^ \t\r\n] HTTP/%d.%d",
-		    req->type, filename, &(req->major),&(req->minor))) {
+    /* request line, syntax has been checked by scan_request() */
+    memcpy(req->type, req->hreq + req->method.off, req->method.len);
+    req->type[req->method.len] = 0;
+    req->major = req->hreq[req->version.off+5] - '0';
+    req->minor = req->hreq[req->version.off+7] - '0';
+    target = req->hreq + req->target.off;
+    if (req->target.len > MAX_PATH) {
 	mkerror(req,400,0);
 	return;
     }
-    if (filename[0] == '/') {
-	strncpy(req->uri,filename,sizeof(req->uri)-1);
-    } else {
-	port = 0;
-	*proto = 0;
-	if (4 != sscanf(filename,
-			"%" S(MAX_MISC) "[a-zA-Z]://"
-			"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d"
-			"%" S(MAX_PATH) "[^ \t\r\n]",
-			proto, req->hostname, &port, req->uri) &&
-	    3 != sscanf(filename,
-			"%" S(MAX_MISC) "[a-zA-Z]://"
-			"%" S(MAX_HOST) "[a-zA-Z0-9.-]"
-			"%" S(MAX_PATH) "[^ \t\r\n]",
-			proto, req->hostname, req->uri)) {
-	    mkerror(req,400,0);
-	    return;
-	}
-	if (*proto != 0 && 0 != strcasecmp(proto,"http")) {
-	    mkerror(req,400,0);
-	    return;
-	}
+    if (target[0] == '/') {
+	memcpy(req->uri, target, req->target.len);
+	req->uri[req->target.len] = 0;
+    } else if (0 != parse_absolute(req, target, req->target.len)) {
+	mkerror(req,400,0);
+	return;
     }
 
-    unquote((unsigned char *)req->path,(unsigned char *)req->query,(unsigned char *)req->uri);
-    fixpath(req->path);
-    if (debug)
-	fprintf(stderr,"%03d: %s \"%s\" HTTP/%d.%d\n",
-		req->fd, req->type, req->path, req->major, req->minor);
-
-    if (0 != strcmp(req->type,"GET") &&
+    if (req->major > 1 &&
+	0 != strcmp(req->type,"GET") &&
 	0 != strcmp(req->type,"HEAD")) {
+	/* http/2 request bodies (DATA frames) are not supported */
 	mkerror(req,501,0);
 	return;
     }
@@ -407,45 +1329,84 @@ parse_request(struct REQUEST *req)
 
     /* parse header lines */
     req->keep_alive = req->minor;
-    for (h = req->hreq; h - req->hreq < req->lreq;) {
-	h = strchr(h,'\n');
-	if (NULL == h)
-	    break;
-	h++;
-
-	h[-2] = 0;
-	h[-1] = 0;
-	list_add(&req->header,h,0);
-
-	if (0 == strncasecmp(h,"Connection: ",12)) {
-	    req->keep_alive = (0 == strncasecmp(h+12,"Keep-Alive",10));
-
-	} else if (0 == strncasecmp(h,"Host: ",6)) {
-	    if (2 != sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]:%d",
-			    req->hostname,&port))
-		sscanf(h+6,"%" S(MAX_HOST) "[a-zA-Z0-9.-]",
-		       req->hostname);
-
-	} else if (0 == strncasecmp(h,"If-Modified-Since: ",19)) {
-	    req->if_modified = h+19;
-
-	} else if (0 == strncasecmp(h,"If-Unmodified-Since: ",21)) {
-	    req->if_unmodified = h+21;
+    for (i = 0; i < req->nhdr; i++) {
+	h     = req->hreq + req->hdr[i].name.off;
+	hlen  = req->hdr[i].name.len;
+	value = req->hreq + req->hdr[i].value.off;
+	value[req->hdr[i].value.len] = 0;
 
-	} else if (0 == strncasecmp(h,"If-Range: ",10)) {
-	    req->if_range = h+10;
-
-	} else if (0 == strncasecmp(h,"Authorization: Basic ",21)) {
-	    decode_base64((unsigned char *)req->auth,(unsigned char *)(h+21),sizeof(req->auth)-1);
+	switch (header_id(h,hlen)) {
+	case HDR_CONNECTION:
+	    req->keep_alive = (0 == strncasecmp(value,"Keep-Alive",10));
+	    break;
+	case HDR_HOST:
+	    for (len = 0; len < MAX_HOST; len++)
+		if (!isalnum(value[len]) && value[len] != '.' && value[len] != '-')
+		    break;
+	    if (len > 0) {
+		memcpy(req->hostname,value,len);
+		req->hostname[len] = 0;
+	    }
+	    break;
+	case HDR_IF_MODIFIED:
+	    req->if_modified = value;
+	    break;
+	case HDR_IF_UNMODIFIED:
+	    req->if_unmodified = value;
+	    break;
+	case HDR_IF_RANGE:
+	    req->if_range = value;
+	    break;
+	case HDR_AUTHORIZATION:
+	    if (0 != strncasecmp(value,"Basic ",6))
+		break;
+	    decode_base64((unsigned char *)req->auth,(unsigned char *)(value+6),sizeof(req->auth)-1);
 	    if (debug)
 		fprintf(stderr,"%03d: auth: %s\n",req->fd,req->auth);
-	    
-	} else if (0 == strncasecmp(h,"Range: bytes=",13)) {
+	    break;
+	case HDR_RANGE:
+	    if (0 != strncasecmp(value,"bytes=",6))
+		break;
 	    /* parsing must be done after fstat, we need the file size
 	       for the boundary checks */
-	    req->range_hdr = h+13;
+	    req->range_hdr = value+6;
+	    break;
+	case HDR_CONTENT_LENGTH:
+	    len = 0;
+	    l = parse_off_t(value,&len);
+	    if (0 == len || len > 18 || value[len] || (clen >= 0 && clen != l))
+		bodyerr = 400;
+	    clen = l;
+	    break;
+	case HDR_CONTENT_TYPE:
+	    req->ctype = value;
+	    break;
+	case HDR_TRANSFER_ENCODING:
+	    if (0 != strcasecmp(value,"chunked"))
+		bodyerr = 501;
+	    chunked = 1;
+	    break;
+	case HDR_EXPECT:
+	    expect = (0 == strcasecmp(value,"100-continue"));
+	    break;
 	}
     }
+
+    /* request body (not for http/2 streams, see above) */
+    if (chunked && clen >= 0)
+	bodyerr = 400;
+    if (bodyerr) {
+	mkerror(req,bodyerr,0);
+	return;
+    }
+    if (req->major < 2 && (chunked || clen >= 0)) {
+	req->inmode  = chunked ? IN_CHUNKED : IN_LENGTH;
+	req->inleft  = chunked ? 0 : clen;
+	req->inchunk = 0;
+	req->inpos   = req->lreq;
+	if (0 == clen)
+	    req->inmode = IN_EOF;
+    }
     if (debug) {
 	if (req->if_modified)
 	    fprintf(stderr,"%03d: if-modified-since: \"%s\"\n",
@@ -461,7 +1422,7 @@ parse_request(struct REQUEST *req)
     /* take care about the hostname */
     if (virtualhosts) {
 	if (req->hostname[0] == 0) {
-	    if (req->minor > 0) {
+	    if (req->major > 1 || req->minor > 0) {
 		/* HTTP/1.1 clients MUST specify a hostname */
 		mkerror(req,400,0);
 		return;
@@ -473,23 +1434,98 @@ parse_request(struct REQUEST *req)
 	    strncpy(req->hostname,server_host,sizeof(req->hostname)-1);
     }
 
-    /* checks */
-    if (0 != sanity_checks(req))
+    if (0 != check_hostname(req))
 	return;
 
+    /* unquote + check path, unless the cache knows it already */
+    host = virtualhosts ? req->hostname : "";
+    cached = pc_lookup(req,host,filename,&mtime);
+    if (!cached) {
+	unquote((unsigned char *)req->path,(unsigned char *)req->query,(unsigned char *)req->uri);
+	fixpath(req->path);
+	if (0 != check_path(req))
+	    return;
+    }
+    if (debug)
+	fprintf(stderr,"%03d: %s \"%s\" HTTP/%d.%d%s\n",
+		req->fd, req->type, req->path, req->major, req->minor,
+		cached ? " (cached)" : "");
+
     /* check basic auth */
     if (NULL != userpass && 0 != strcmp(userpass,req->auth)) {
 	mkerror(req,401,1);
 	return;
     }
 
+    /* is status page or metrics ? */
+    if (NULL != statuspath && 0 == strcmp(req->path,statuspath)) {
+	status_request(req);
+	return;
+    }
+    if (NULL != metricspath && 0 == strcmp(req->path,metricspath)) {
+	metrics_request(req);
+	return;
+    }
+
     /* is CGI ? */
     if (NULL != cgipath &&
 	0 == strncmp(req->path,cgipath,strlen(cgipath))) {
+	if (mc_lookup(req))
+	    return;
 	cgi_request(req);
+	start_body(req,expect);
+	return;
+    }
+
+    /* is upload ? */
+    if (NULL != putpath && 0 == strcmp(req->type,"PUT") &&
+	0 == strncmp(req->path,putpath,strlen(putpath))) {
+	put_request(req);
+	start_body(req,expect);
+	return;
+    }
+
+    /* no request bodies for files */
+    if (0 != strcmp(req->type,"GET") &&
+	0 != strcmp(req->type,"HEAD")) {
+	mkerror(req,501,0);
 	return;
     }
 
+    /* cached filesystem lookup still valid? */
+    dirfd = docroot_fd(req->hostname,&skip);
+    switch (cached) {
+    case PC_FILE:
+	if (-1 != (req->bfd = open_beneath(dirfd,filename+skip,O_RDONLY))) {
+	    close_on_exec(req->bfd);
+	    goto regular_file;
+	}
+	break;
+    case PC_LISTING:
+	fd = pc_open(dirfd,filename,skip,O_RDONLY|O_DIRECTORY,mtime,&(req->bst));
+	if (-1 != fd)
+	    goto dir_listing;
+	break;
+    case PC_REDIRECT:
+	fd = pc_open(dirfd,filename,skip,O_RDONLY|O_DIRECTORY,mtime,&st);
+	if (-1 != fd) {
+	    close(fd);
+	    strcat(req->path,"/");
+	    mkredirect(req);
+	    return;
+	}
+	break;
+    case PC_NOTFOUND:
+	fd = pc_open(dirfd,filename,skip,O_RDONLY,mtime,&st);
+	if (-1 != fd) {
+	    close(fd);
+	    mkerror(req,404,1);
+	    return;
+	}
+	break;
+    }
+    cached = 0;
+
     /* build filename */
     if (userdir  &&  '~' == req->path[1]) {
 	/* expand user directories, i.e.
@@ -500,14 +1536,22 @@ parse_request(struct REQUEST *req)
 	    return;
 	}
 	*h = 0;
-	pw = getpwnam(req->path+2);
+	ud = get_userdir(req->path+2);
 	*h = '/';
-	if (NULL == pw) {
+	if (NULL == ud->path) {
 	    mkerror(req,404,1);
 	    return;
 	}
 	len = snprintf(filename, sizeof(filename)-1,
-		       "%s/%s/%s", pw->pw_dir, userdir, h+1);
+		       "%s/%s", ud->path, h+1);
+	cache = 0;
+	if (-1 != ud->fd) {
+	    dirfd = ud->fd;
+	    skip  = strlen(ud->path) + 1;
+	} else {
+	    dirfd = AT_FDCWD;
+	    skip  = 0;
+	}
     } else {
 	len = snprintf(filename, sizeof(filename)-1,
 		       "%s%s%s%s",
@@ -523,7 +1567,7 @@ parse_request(struct REQUEST *req)
 	if (indexhtml) {
 	    /* check for index file */
 	    strncpy(h+1, indexhtml, sizeof(filename) -len -1);
-	    if (-1 != (req->bfd = open(filename,O_RDONLY))) {
+	    if (-1 != (req->bfd = open_beneath(dirfd,filename+skip,O_RDONLY))) {
 		/* ok, we have one */
 	    	close_on_exec(req->bfd);
 		goto regular_file;
@@ -543,39 +1587,38 @@ parse_request(struct REQUEST *req)
 	    return;
 	};
 	
-	if (-1 == stat(filename,&(req->bst))) {
-	    if (errno == EACCES) {
+	if (-1 == (fd = open_beneath(dirfd,filename+skip,O_RDONLY|O_DIRECTORY))) {
+	    if (errno == EACCES || errno == EXDEV) {
 		mkerror(req,403,1);
 	    } else {
+		if (cache && (errno == ENOENT || errno == ENOTDIR))
+		    pc_notfound(req,host,filename);
 		mkerror(req,404,1);
 	    }
 	    return;
 	}
+	close_on_exec(fd);
+	fstat(fd,&(req->bst));
+	if (cache)
+	    pc_add(req,host,PC_LISTING,filename,req->bst.st_mtime);
+
+    dir_listing:
 	strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
 	req->mime = "text/html";
-	req->dir = get_dir(req,filename);
-	if (NULL == req->body) {
-	    /* We arrive here if opendir failed, probably due to -EPERM
-	     * It does exist (see the stat() call above) */
-	    mkerror(req,403,1);
-	    return;
-	} else if (NULL != req->if_modified &&
-		   0 == strcmp(req->if_modified, req->mtime)) {
-	    /* 304 not modified */
-	    mkheader(req,304);
-	    req->head_only = 1;
-	} else {
-	    /* 200 OK */
-	    mkheader(req,200);
-	}
+	/* list the directory just checked, not whatever filename is now */
+	req->dir = get_dir(req,filename,fd);
+	if (req->state != STATE_READ_DIR)
+	    dir_request(req);
 	return;
     }
 
     /* it is /probably/ a regular file */
-    if (-1 == (req->bfd = open(filename,O_RDONLY))) {
-	if (errno == EACCES) {
+    if (-1 == (req->bfd = open_beneath(dirfd,filename+skip,O_RDONLY))) {
+	if (errno == EACCES || errno == EXDEV) {
 	    mkerror(req,403,1);
 	} else {
+	    if (cache && (errno == ENOENT || errno == ENOTDIR))
+		pc_notfound(req,host,filename);
 	    mkerror(req,404,1);
 	}
 	return;
@@ -595,6 +1638,8 @@ parse_request(struct REQUEST *req)
 	req->bfd = -1;
 	if (S_ISDIR(req->bst.st_mode)) {
 	    /* oops: a directory without trailing slash */
+	    if (cache)
+		pc_add(req,host,PC_REDIRECT,filename,req->bst.st_mtime);
 	    strcat(req->path,"/");
 	    mkredirect(req);
 	} else {
@@ -605,6 +1650,8 @@ parse_request(struct REQUEST *req)
     }
 
     /* it is /really/ a regular file */
+    if (cache && cached != PC_FILE)
+	pc_add(req,host,PC_FILE,filename,0);
     req->mime = get_mime(filename);
     strftime(req->mtime, sizeof(req->mtime), RFC1123, gmtime(&req->bst.st_mtime));
     if (NULL != req->if_range  &&  0 != strcmp(req->if_range, req->mtime))
@@ -626,3 +1673,24 @@ parse_request(struct REQUEST *req)
     }
     return;
 }
+
+/* the listing for req->dir is ready, build the response */
+void
+dir_request(struct REQUEST *req)
+{
+    req->body  = req->dir->html;
+    req->lbody = req->dir->length;
+    if (NULL == req->body) {
+	/* We arrive here if opendir failed, probably due to -EPERM
+	 * It does exist (see the stat() call in parse_request) */
+	mkerror(req,403,1);
+    } else if (NULL != req->if_modified &&
+	       0 == strcmp(req->if_modified, req->mtime)) {
+	/* 304 not modified */
+	mkheader(req,304);
+	req->head_only = 1;
+    } else {
+	/* 200 OK */
+	mkheader(req,200);
+    }
+}
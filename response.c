@@ -12,6 +12,8 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
@@ -46,7 +48,7 @@ static inline size_t off_to_size(off_t off_bytes)
 #if defined(__linux__) && !defined(NO_SENDFILE)
 
 # include <sys/sendfile.h>
-static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
+ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 {
     size_t bytes = off_to_size(off_bytes);
     return sendfile(out, in, &offset, bytes);
@@ -54,7 +56,7 @@ static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 
 #elif defined(__FreeBSD__) && !defined(NO_SENDFILE)
 
-static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
+ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 {
     size_t bytes = off_to_size(off_bytes);
     off_t nbytes = 0;
@@ -76,7 +78,7 @@ static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 /* Poor man's sendfile() implementation. Performance sucks, but it works. */
 # define BUFSIZE 16384
 
-static ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
+ssize_t xsendfile(int out, int in, off_t offset, off_t off_bytes)
 {
     char buf[BUFSIZE];
     ssize_t nread;
@@ -139,9 +141,27 @@ static inline int wrap_write(struct REQUEST *req, void *buf, off_t bytes)
 	return write(req->fd, buf, off_to_size(bytes));
 }
 
+static inline int wrap_writev(struct REQUEST *req, struct iovec *iov, int n)
+{
+    if (with_ssl)
+	/* no gather write for ssl, hand out one piece at a time */
+	return ssl_write(req, iov[0].iov_base, iov[0].iov_len);
+    else
+	return writev(req->fd, iov, n);
+}
+
 #else
 # define wrap_xsendfile(req,off,bytes)  xsendfile(req->fd,req->bfd,off,bytes)
 # define wrap_write(req,buf,bytes)      write(req->fd,buf,bytes);
+# define wrap_writev(req,iov,n)         writev(req->fd,iov,n)
+#endif
+
+/* file data goes through ssl_write() for tls */
+#ifdef USE_SSL
+# define count_file(n) \
+    do { if (with_ssl) stats->b_write += n; else stats->b_sendfile += n; } while (0)
+#else
+# define count_file(n)  stats->b_sendfile += n
 #endif
 
 /* ---------------------------------------------------------------------- */
@@ -152,6 +172,8 @@ static struct HTTP_STATUS {
     char *body;
 } http[] = {
     { 200, "200 OK",                       NULL },
+    { 201, "201 Created",                  "Created\n" },
+    { 204, "204 No Content",               "" },
     { 206, "206 Partial Content",          NULL },
     { 304, "304 Not Modified",             NULL },
     { 400, "400 Bad Request",              "*PLONK*\n" },
@@ -162,6 +184,9 @@ static struct HTTP_STATUS {
     { 412, "412 Precondition failed.",     "Precondition failed\n" },
     { 500, "500 Internal Server Error",    "Sorry folks\n" },
     { 501, "501 Not Implemented",          "Sorry folks\n" },
+    { 502, "502 Bad Gateway",              "Sorry folks\n" },
+    { 503, "503 Service Unavailable",      "Sorry folks, try again later\n" },
+    { 507, "507 Insufficient Storage",     "Sorry folks, disk full\n" },
     {   0, NULL,                        NULL }
 };
 
@@ -200,12 +225,14 @@ mkerror(struct REQUEST *req, int status, int ka)
     if (!ka)
 	req->keep_alive = 0;
     req->lres = sprintf(req->hres,
-			RESPONSE_START
-			"Content-Type: text/plain\r\n"
-			"Content-Length: %" PRId64 "\r\n",
+			RESPONSE_START,
 			http[i].head,server_name,
-			req->keep_alive ? "Keep-Alive" : "Close",
-			(int64_t)req->lbody);
+			req->keep_alive ? "Keep-Alive" : "Close");
+    if (204 != status)
+	req->lres += sprintf(req->hres+req->lres,
+			     "Content-Type: text/plain\r\n"
+			     "Content-Length: %" PRId64 "\r\n",
+			     (int64_t)req->lbody);
     if (401 == status)
 	req->lres += sprintf(req->hres+req->lres,
 			     "WWW-Authenticate: Basic realm=\"webfs\"\r\n");
@@ -222,6 +249,8 @@ mkerror(struct REQUEST *req, int status, int ka)
 void
 mkredirect(struct REQUEST *req)
 {
+    char qpath[2048];
+
     req->status = 302;
     req->body   = req->path;
     req->lbody  = strlen(req->body);
@@ -232,7 +261,8 @@ mkredirect(struct REQUEST *req)
 			"Content-Length: %" PRId64 "\r\n",
 			"302 Redirect",server_name,
 			req->keep_alive ? "Keep-Alive" : "Close",
-			req->hostname,tcp_port,quote((unsigned char *)req->path,9999),
+			req->hostname,tcp_port,
+			quote((unsigned char *)req->path,9999,qpath,sizeof(qpath)),
 			(int64_t)req->lbody);
     mkcors(req);
     req->lres += strftime(req->hres+req->lres,80,
@@ -336,18 +366,151 @@ mkheader(struct REQUEST *req, int status)
 void
 mkcgi(struct REQUEST *req, char *status, struct strlist *header)
 {
-    req->status = atoi(status);
-    req->keep_alive = 0;
+    struct strlist *h;
+    int te = 0;
+
+    req->status  = atoi(status);
+    req->cgimode = CGI_CLOSE;
+    req->cgiclen = -1;
+    for (h = header; NULL != h; h = h->next) {
+	if (0 == strncasecmp(h->line,"Content-Length:",15))
+	    req->cgiclen = strtoll(h->line+15,NULL,10);
+	if (0 == strncasecmp(h->line,"Transfer-Encoding:",18))
+	    te = 1;
+    }
+
+    /* figure how the client will find the end of the body */
+    if (!req->keep_alive || te) {
+	/* nope, we have to close */
+    } else if (req->cgiclen >= 0) {
+	req->cgimode = CGI_LENGTH;
+    } else if (req->minor > 0 && req->status >= 200 &&
+	       req->status != 204 && req->status != 304) {
+	req->cgimode = CGI_CHUNKED;
+    }
+    if (CGI_CLOSE == req->cgimode && !req->head_only)
+	req->keep_alive = 0;
+
     req->lres = sprintf(req->hres,
 			RESPONSE_START,
-			status, server_name,"Close");
+			status, server_name,
+			req->keep_alive ? "Keep-Alive" : "Close");
     for (; NULL != header; header = header->next)
 	req->lres += sprintf(req->hres+req->lres,"%s\r\n",header->line);
+    if (CGI_CHUNKED == req->cgimode)
+	req->lres += sprintf(req->hres+req->lres,
+			     "Transfer-Encoding: chunked\r\n");
+    mkcors(req);
     req->lres += strftime(req->hres+req->lres,80,
 			  "Date: " RFC1123 "\r\n\r\n",
 			  gmtime(&now));
+    req->state = STATE_WRITE_HEADER;
+}
+
+/* response from the cgi micro cache */
+void
+mkcached(struct REQUEST *req)
+{
+    struct MCACHE *mc = req->mc;
+
+    req->status = atoi(mc->status);
+    req->body   = mc->body ? mc->body : "";
+    req->lbody  = mc->len;
+    req->lres = sprintf(req->hres,
+			RESPONSE_START,
+			mc->status, server_name,
+			req->keep_alive ? "Keep-Alive" : "Close");
+    req->lres += sprintf(req->hres+req->lres,
+			 "%s"
+			 "Content-Length: %d\r\n"
+			 "Age: %d\r\n",
+			 mc->header, mc->len,
+			 (int)(now + mc->ttl - mc->expires));
     mkcors(req);
+    req->lres += strftime(req->hres+req->lres,80,
+			  "Date: " RFC1123 "\r\n\r\n",
+			  gmtime(&now));
     req->state = STATE_WRITE_HEADER;
+    if (debug)
+	fprintf(stderr,"%03d: %d (micro cache), connection=%s\n",
+		req->fd, req->status, req->keep_alive ? "Keep-Alive" : "Close");
+}
+
+/* next cgi body write: cgibuf[cgipos..cgilen], framed as needed */
+static void
+cgi_body_out(struct REQUEST *req)
+{
+    switch (req->cgimode) {
+    case CGI_LENGTH:
+	if (req->cgilen - req->cgipos > req->cgiclen)
+	    req->cgilen = req->cgipos + req->cgiclen;
+	break;
+    case CGI_CHUNKED:
+	/* empty data makes the last-chunk */
+	req->lchunk = sprintf(req->cgichunk,"%x\r\n",
+			      req->cgilen - req->cgipos);
+	req->wchunk = 0;
+	break;
+    }
+    mc_data(req, req->cgibuf + req->cgipos, req->cgilen - req->cgipos);
+    req->state = STATE_CGI_BODY_OUT;
+}
+
+#ifdef SPLICE_F_NONBLOCK
+/* n bytes are waiting in the pipe, send them without copying */
+static void
+cgi_splice_out(struct REQUEST *req, int n)
+{
+    if (CGI_LENGTH == req->cgimode && n > req->cgiclen)
+	n = req->cgiclen;
+    req->cgispl = n;
+    req->lchunk = 0;
+    req->wchunk = 0;
+    if (CGI_CHUNKED == req->cgimode)
+	req->lchunk = sprintf(req->cgichunk,"%x\r\n",n);
+    req->state = STATE_CGI_SPLICE;
+}
+
+/* chunk size line, data, chunk trailer; wchunk counts the framing */
+static int
+cgi_splice(struct REQUEST *req)
+{
+    int flags = 0;
+
+    if (req->wchunk < req->lchunk) {
+#ifdef MSG_MORE
+	flags = MSG_MORE; /* data follows */
+#endif
+	return send(req->fd, req->cgichunk + req->wchunk,
+		    req->lchunk - req->wchunk, flags);
+    }
+    if (req->cgispl)
+	return splice(req->cgipipe, NULL, req->fd, NULL, req->cgispl,
+		      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    return write(req->fd, "\r\n" + req->wchunk - req->lchunk,
+		 2 - (req->wchunk - req->lchunk));
+}
+#endif
+
+static int
+cgi_write_chunk(struct REQUEST *req)
+{
+    struct iovec iov[3];
+    int i, skip = req->wchunk;
+
+    iov[0].iov_base = req->cgichunk;
+    iov[0].iov_len  = req->lchunk;
+    iov[1].iov_base = req->cgibuf + req->cgipos;
+    iov[1].iov_len  = req->cgilen - req->cgipos;
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len  = 2;
+
+    /* skip what a short write already got out */
+    for (i = 0; skip >= (int)iov[i].iov_len; i++)
+	skip -= iov[i].iov_len;
+    iov[i].iov_base  = (char*)iov[i].iov_base + skip;
+    iov[i].iov_len  -= skip;
+    return wrap_writev(req, iov+i, 3-i);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -355,6 +518,9 @@ mkcgi(struct REQUEST *req, char *status, struct strlist *header)
 void write_request(struct REQUEST *req)
 {
     int rc;
+#ifdef SPLICE_F_NONBLOCK
+    int data;
+#endif
 
     for (;;) {
 	switch (req->state) {
@@ -381,8 +547,11 @@ void write_request(struct REQUEST *req)
 		req->state = STATE_CLOSE;
 		return;
 	    default:
+		if (!req->tfirst)
+		    req->tfirst = stats_us();
 		req->written += rc;
 		req->bc += rc;
+		stats->b_write += rc;
 		if (req->written != req->lres)
 		    return;
 	    }
@@ -390,9 +559,15 @@ void write_request(struct REQUEST *req)
 	    if (req->head_only) {
 		req->state = STATE_FINISHED;
 		return;
-	    } else if (req->cgipid) {
-		req->state = (req->cgipos != req->cgilen) ?
-		    STATE_CGI_BODY_OUT : STATE_CGI_BODY_IN;
+	    } else if (req->cgipipe != -1) {
+		if (CGI_LENGTH == req->cgimode && 0 == req->cgiclen) {
+		    req->state = STATE_FINISHED;
+		    return;
+		}
+		if (req->cgipos != req->cgilen)
+		    cgi_body_out(req);
+		else
+		    req->state = STATE_CGI_BODY_IN;
 	    } else if (req->body) {
 		req->state = STATE_WRITE_BODY;
 	    } else if (req->ranges == 1) {
@@ -425,6 +600,7 @@ void write_request(struct REQUEST *req)
 	    default:
 		req->written += rc;
 		req->bc += rc;
+		stats->b_write += rc;
 		if (req->written != req->lbody)
 		    return;
 	    }
@@ -451,6 +627,7 @@ void write_request(struct REQUEST *req)
 			    (int)(req->written*100/req->bst.st_size));
 		req->written += rc;
 		req->bc += rc;
+		count_file(rc);
 		if (req->written != req->bst.st_size)
 		    return;
 	    }
@@ -476,6 +653,7 @@ void write_request(struct REQUEST *req)
 		default:
 		    req->written += rc;
 		    req->bc += rc;
+		    stats->b_write += rc;
 		    if (req->written != req->r_hlen[req->rh])
 			return;
 		}
@@ -507,6 +685,7 @@ void write_request(struct REQUEST *req)
 		default:
 		    req->written += rc;
 		    req->bc += rc;
+		    count_file(rc);
 		    if (req->written != req->r_end[req->rb])
 			return;
 		}
@@ -522,7 +701,15 @@ void write_request(struct REQUEST *req)
 	    }
 	    break;
 	case STATE_CGI_BODY_IN:
-	    rc = read(req->cgipipe, req->cgibuf, MAX_HEADER);
+#ifdef SPLICE_F_NONBLOCK
+	    /* empty pipe (or eof): take the read() path below */
+	    if (req->cgisplice && -1 != ioctl(req->cgipipe,FIONREAD,&rc) &&
+		rc > 0) {
+		cgi_splice_out(req,rc);
+		break;
+	    }
+#endif
+	    rc = cgi_read(req, req->cgibuf, MAX_HEADER);
 	    switch (rc) {
 	    case -1:
 		if (errno == EAGAIN)
@@ -530,8 +717,20 @@ void write_request(struct REQUEST *req)
 		if (errno == EINTR)
 		    continue;
 		xperror(LOG_INFO,"cgi read",req->peerhost);
-		/* fall through */
+		req->keep_alive = 0;
+		req->state = STATE_FINISHED;
+		return;
 	    case 0:
+		mc_data(req, NULL, 0);
+		if (CGI_CHUNKED == req->cgimode) {
+		    req->cgipos = 0;
+		    req->cgilen = 0;
+		    cgi_body_out(req);
+		    continue;
+		}
+		if (CGI_LENGTH == req->cgimode && req->cgiclen)
+		    /* script died early, client can't tell */
+		    req->keep_alive = 0;
 		req->state = STATE_FINISHED;
 		return;
 	    default:
@@ -541,11 +740,14 @@ void write_request(struct REQUEST *req)
 		req->cgilen = rc;
 		break;
 	    }
-	    req->state = STATE_CGI_BODY_OUT;
+	    cgi_body_out(req);
 	    break;
 	case STATE_CGI_BODY_OUT:
-    	    rc = wrap_write(req,req->cgibuf + req->cgipos,
-			    req->cgilen - req->cgipos);
+	    if (CGI_CHUNKED == req->cgimode)
+		rc = cgi_write_chunk(req);
+	    else
+		rc = wrap_write(req,req->cgibuf + req->cgipos,
+				req->cgilen - req->cgipos);
 	    switch (rc) {
 	    case -1:
 		if (errno == EAGAIN)
@@ -560,13 +762,70 @@ void write_request(struct REQUEST *req)
 	    default:
 		if (debug)
 		    fprintf(stderr,"%03d: cgi: out %d\n",req->fd,rc);
-		req->cgipos += rc;
 		req->bc += rc;
+		stats->b_write += rc;
+		if (CGI_CHUNKED == req->cgimode) {
+		    req->wchunk += rc;
+		    if (req->wchunk != req->lchunk + req->cgilen - req->cgipos + 2)
+			return;
+		    if (req->cgipos == req->cgilen) {
+			/* last-chunk is out */
+			req->state = STATE_FINISHED;
+			return;
+		    }
+		    break;
+		}
+		req->cgipos += rc;
+		if (CGI_LENGTH == req->cgimode) {
+		    req->cgiclen -= rc;
+		    if (0 == req->cgiclen) {
+			req->state = STATE_FINISHED;
+			return;
+		    }
+		}
 		if (req->cgipos != req->cgilen)
 		    return;
 	    }
 	    req->state = STATE_CGI_BODY_IN;
 	    break;
+#ifdef SPLICE_F_NONBLOCK
+	case STATE_CGI_SPLICE:
+	    data = req->wchunk >= req->lchunk && req->cgispl;
+	    rc = cgi_splice(req);
+	    switch (rc) {
+	    case -1:
+		if (errno == EAGAIN)
+		    return;
+		if (errno == EINTR)
+		    continue;
+		xperror(LOG_INFO,"splice",req->peerhost);
+		/* fall through */
+	    case 0:
+		req->state = STATE_CLOSE;
+		return;
+	    }
+	    if (debug)
+		fprintf(stderr,"%03d: cgi: splice %d\n",req->fd,rc);
+	    req->bc += rc;
+	    if (!data) {
+		stats->b_write += rc;
+		req->wchunk += rc;
+	    } else {
+		stats->b_splice += rc;
+		req->cgispl -= rc;
+		if (CGI_LENGTH == req->cgimode)
+		    req->cgiclen -= rc;
+	    }
+	    if (req->cgispl || req->wchunk < req->lchunk ||
+		(req->lchunk && req->wchunk < req->lchunk + 2))
+		break;
+	    if (CGI_LENGTH == req->cgimode && 0 == req->cgiclen) {
+		req->state = STATE_FINISHED;
+		return;
+	    }
+	    req->state = STATE_CGI_BODY_IN;
+	    break;
+#endif
 	} /* switch(state) */
     } /* for (;;) */
 }
@@ -0,0 +1,246 @@
+/*
+ * byte scanning kernels for the request parser & friends
+ *
+ * Each kernel returns the offset of the first matching byte, or len
+ * if there is none.  There are scalar versions for every platform and
+ * SSE2 / AVX2 versions for x86, init_scan() picks the best one the
+ * cpu supports.  The vector loops never read beyond buf+len, the tail
+ * is handled by the scalar code.
+ *
+ *   ctl    - control characters (< 0x20, 0x7f), i.e. CR, LF, TAB and
+ *            anything invalid in a header value.
+ *   target - same plus space, i.e. the end of the request target.
+ *   delim  - '%', '?' and '+', the bytes unquote() has to look at.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "httpd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define SCAN_X86 1
+# include <immintrin.h>
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+static int
+scan_ctl_scalar(const char *buf, int len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    int i;
+
+    for (i = 0; i < len; i++)
+	if (p[i] < 0x20 || p[i] == 0x7f)
+	    break;
+    return i;
+}
+
+static int
+scan_target_scalar(const char *buf, int len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    int i;
+
+    for (i = 0; i < len; i++)
+	if (p[i] <= 0x20 || p[i] == 0x7f)
+	    break;
+    return i;
+}
+
+static int
+scan_delim_scalar(const char *buf, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+	if (buf[i] == '%' || buf[i] == '?' || buf[i] == '+')
+	    break;
+    return i;
+}
+
+/* ---------------------------------------------------------------------- */
+
+#ifdef SCAN_X86
+
+/* unsigned "x <= max" is "min(x,max) == x" */
+
+__attribute__((target("sse2")))
+static int
+scan_ctl_sse2(const char *buf, int len)
+{
+    const __m128i max = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    __m128i x,m;
+    int i, mask;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(buf+i));
+	m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x,max),x),
+			 _mm_cmpeq_epi8(x,del));
+	if (0 != (mask = _mm_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_ctl_scalar(buf+i,len-i);
+}
+
+__attribute__((target("sse2")))
+static int
+scan_target_sse2(const char *buf, int len)
+{
+    const __m128i max = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    __m128i x,m;
+    int i, mask;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(buf+i));
+	m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x,max),x),
+			 _mm_cmpeq_epi8(x,del));
+	if (0 != (mask = _mm_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_target_scalar(buf+i,len-i);
+}
+
+__attribute__((target("sse2")))
+static int
+scan_delim_sse2(const char *buf, int len)
+{
+    const __m128i pct  = _mm_set1_epi8('%');
+    const __m128i qm   = _mm_set1_epi8('?');
+    const __m128i plus = _mm_set1_epi8('+');
+    __m128i x,m;
+    int i, mask;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+	x = _mm_loadu_si128((const __m128i *)(buf+i));
+	m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x,pct),
+				      _mm_cmpeq_epi8(x,qm)),
+			 _mm_cmpeq_epi8(x,plus));
+	if (0 != (mask = _mm_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_delim_scalar(buf+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static int
+scan_ctl_avx2(const char *buf, int len)
+{
+    const __m256i max = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    __m256i x,m;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(buf+i));
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x,max),x),
+			    _mm256_cmpeq_epi8(x,del));
+	if (0 != (mask = _mm256_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_ctl_sse2(buf+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static int
+scan_target_avx2(const char *buf, int len)
+{
+    const __m256i max = _mm256_set1_epi8(0x20);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    __m256i x,m;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(buf+i));
+	m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(x,max),x),
+			    _mm256_cmpeq_epi8(x,del));
+	if (0 != (mask = _mm256_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_target_sse2(buf+i,len-i);
+}
+
+__attribute__((target("avx2")))
+static int
+scan_delim_avx2(const char *buf, int len)
+{
+    const __m256i pct  = _mm256_set1_epi8('%');
+    const __m256i qm   = _mm256_set1_epi8('?');
+    const __m256i plus = _mm256_set1_epi8('+');
+    __m256i x,m;
+    unsigned int mask;
+    int i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+	x = _mm256_loadu_si256((const __m256i *)(buf+i));
+	m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x,pct),
+					    _mm256_cmpeq_epi8(x,qm)),
+			    _mm256_cmpeq_epi8(x,plus));
+	if (0 != (mask = _mm256_movemask_epi8(m)))
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_delim_sse2(buf+i,len-i);
+}
+
+#endif /* SCAN_X86 */
+
+/* ---------------------------------------------------------------------- */
+
+struct SCANNER scanners[] = {
+    {
+	.name   = "scalar",
+	.ctl    = scan_ctl_scalar,
+	.target = scan_target_scalar,
+	.delim  = scan_delim_scalar,
+    },
+#ifdef SCAN_X86
+    {
+	.name   = "sse2",
+	.ctl    = scan_ctl_sse2,
+	.target = scan_target_sse2,
+	.delim  = scan_delim_sse2,
+    },{
+	.name   = "avx2",
+	.ctl    = scan_ctl_avx2,
+	.target = scan_target_avx2,
+	.delim  = scan_delim_avx2,
+    },
+#endif
+    { /* end of list */ }
+};
+
+struct SCANNER *scanner = scanners;
+
+/* can we use the kernels in s on this cpu? */
+int
+scan_supported(struct SCANNER *s)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (0 == strcmp(s->name,"sse2"))
+	return __builtin_cpu_supports("sse2");
+    if (0 == strcmp(s->name,"avx2"))
+	return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+void
+init_scan(void)
+{
+    struct SCANNER *s;
+
+    for (s = scanners; NULL != s->name; s++)
+	if (scan_supported(s))
+	    scanner = s;
+    if (debug)
+	fprintf(stderr,"scan: using %s kernels\n",scanner->name);
+}
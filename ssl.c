@@ -85,6 +85,16 @@ int ssl_blk_write(struct REQUEST *req, off_t offset, size_t len)
     return ssl_write(req, buf, rc);
 }
 
+/* handshake statistics: done, or aborted by us with a fatal alert */
+static void info_cb(const SSL *ssl, int where, int ret)
+{
+    if (where & SSL_CB_HANDSHAKE_DONE)
+	stats->tls_ok++;
+    if ((where & SSL_CB_WRITE_ALERT) == SSL_CB_WRITE_ALERT &&
+	SSL3_AL_FATAL == (ret >> 8) && SSL_in_init(ssl))
+	stats->tls_failed++;
+}
+
 static int password_cb(char *buf, int num, int rwflag, void *userdata)
 {
     if (NULL == password)
@@ -96,6 +106,28 @@ static int password_cb(char *buf, int num, int rwflag, void *userdata)
     return(strlen(buf));
 }
 
+/* offer h2, fall back to http/1.1 */
+static unsigned char alpn_protos[] = "\x02h2\x08http/1.1";
+
+static int alpn_cb(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		   const unsigned char *in, unsigned int inlen, void *arg)
+{
+    unsigned char *protos = alpn_protos;
+    unsigned int  len = sizeof(alpn_protos)-1;
+
+    /* http/2 streams can't take request bodies, CGI and PUT need them */
+    if (no_http2 || cgipath || putpath) {
+	/* skip "h2" */
+	protos += 3;
+	len    -= 3;
+    }
+    if (OPENSSL_NPN_NEGOTIATED !=
+	SSL_select_next_proto((unsigned char**)out, outlen,
+			      protos, len, in, inlen))
+	return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
 void init_ssl(void)
 {
     int rc;
@@ -135,6 +167,8 @@ void init_ssl(void)
     }
 
     SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_cb, NULL);
+    SSL_CTX_set_info_callback(ctx, info_cb);
 }
 
 void open_ssl_session(struct REQUEST *req)
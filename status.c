@@ -0,0 +1,523 @@
+/*
+ * server status page and metrics
+ *
+ * Every mainloop thread counts into its own struct STATS (cache line
+ * aligned, so no locking and no false sharing).  They are summed up
+ * only when the status page (-T, plain text) or the metrics (-E,
+ * OpenMetrics text format) are requested.  Both are allowed from
+ * localhost and the -Q network.  Threads without counters of their own
+ * (listing workers, ...) count into a dummy.
+ *
+ * Latencies go into log-linear histograms: LAT_SUB linear steps per
+ * power of two, in microseconds, so the error is below 1/LAT_SUB.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <syslog.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "httpd.h"
+
+#define STATUS_SIZE  (32*1024)   /* page buffer, from the pool */
+#define METRICS_LE   2*LAT_SUB   /* first histogram bucket: 32 us */
+
+static struct STATS  stats_none;
+static struct STATS  *stats_all;
+static int           stats_threads;
+static time_t        stats_start;
+
+THREAD_LOCAL struct STATS *stats = &stats_none;
+
+/* -Q network, v4 addresses are mapped (::ffff:a.b.c.d) */
+static struct in6_addr status_net;
+static int             status_prefix = -1;
+
+static char *state_name[STATE_MAX+1] = {
+    [ STATE_READ_HEADER  ] = "read-header",
+    [ STATE_PARSE_HEADER ] = "parse-header",
+    [ STATE_WRITE_HEADER ] = "write-header",
+    [ STATE_WRITE_BODY   ] = "write-body",
+    [ STATE_WRITE_FILE   ] = "write-file",
+    [ STATE_WRITE_RANGES ] = "write-ranges",
+    [ STATE_FINISHED     ] = "finished",
+    [ STATE_KEEPALIVE    ] = "keepalive",
+    [ STATE_CLOSE        ] = "close",
+    [ STATE_CGI_HEADER   ] = "cgi-header",
+    [ STATE_CGI_BODY_IN  ] = "cgi-body-in",
+    [ STATE_CGI_BODY_OUT ] = "cgi-body-out",
+    [ STATE_READ_DIR     ] = "read-dir",
+    [ STATE_H2           ] = "h2",
+    [ STATE_CGI_SPLICE   ] = "cgi-splice",
+    [ STATE_READ_BODY    ] = "read-body",
+    [ STATE_CGI_WAIT     ] = "cgi-wait",
+};
+
+/* ---------------------------------------------------------------------- */
+
+static void
+v4mapped(struct in6_addr *addr, struct in_addr *v4)
+{
+    memset(addr,0,sizeof(*addr));
+    addr->s6_addr[10] = 0xff;
+    addr->s6_addr[11] = 0xff;
+    memcpy(addr->s6_addr+12,v4,4);
+}
+
+static int
+parse_net(char *net)
+{
+    char buf[64], *h;
+    struct in_addr v4;
+    int prefix = -1;
+
+    snprintf(buf,sizeof(buf),"%s",net);
+    if (NULL != (h = strchr(buf,'/'))) {
+	*h = 0;
+	prefix = atoi(h+1);
+    }
+    if (1 == inet_pton(AF_INET6,buf,&status_net)) {
+	if (-1 == prefix)
+	    prefix = 128;
+    } else if (1 == inet_pton(AF_INET,buf,&v4)) {
+	v4mapped(&status_net,&v4);
+	prefix = (-1 == prefix) ? 128 : prefix + 96;
+    } else {
+	return -1;
+    }
+    if (prefix < 0 || prefix > 128)
+	return -1;
+    status_prefix = prefix;
+    return 0;
+}
+
+void
+init_status(int threads)
+{
+    stats_threads = threads;
+    stats_start   = time(NULL);
+    if (0 != posix_memalign((void**)&stats_all,64,
+			    threads * sizeof(struct STATS))) {
+	xerror(LOG_ERR,"can't allocate statistics",NULL);
+	exit(1);
+    }
+    memset(stats_all,0,threads * sizeof(struct STATS));
+    if (statusnet && 0 != parse_net(statusnet)) {
+	fprintf(stderr,"invalid network for -Q: %s\n",statusnet);
+	exit(1);
+    }
+}
+
+/* called by each mainloop thread, 0 .. threads-1 */
+void
+status_thread(int n)
+{
+    char *buf;
+
+    stats = stats_all + n;
+    if (NULL == statuspath && NULL == metricspath)
+	return;
+    /* park a page buffer in this thread's pool, scrapes don't malloc */
+    if (NULL != (buf = pool_get(STATUS_SIZE)))
+	pool_put(buf,STATUS_SIZE);
+}
+
+uint64_t
+stats_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+lat_bucket(uint64_t us)
+{
+    int shift = 0, i;
+
+    while ((us >> shift) >= 2*LAT_SUB)
+	shift++;
+    i = shift*LAT_SUB + (us >> shift);
+    return i < LAT_BUCKETS ? i : LAT_BUCKETS-1;
+}
+
+static uint64_t
+lat_value(int i)
+{
+    int shift;
+
+    if (i < 2*LAT_SUB)
+	return i;
+    shift = i/LAT_SUB - 1;
+    return (uint64_t)(i - shift*LAT_SUB) << shift;
+}
+
+/* request done (or aborted), from the mainloop cleanup */
+void
+stats_request(struct REQUEST *req)
+{
+    uint64_t t;
+
+    if (!req->tstart)
+	return;
+    t = stats_us();
+    if (req->status > 0 && req->status < 600) {
+	stats->requests++;
+	if (req->served++)
+	    stats->reused++;
+	stats->status[req->status]++;
+	if (408 == req->status)
+	    goto out; /* nothing answered, no latency */
+	if (req->tfirst) {
+	    stats->ttfb[lat_bucket(req->tfirst - req->tstart)]++;
+	    stats->ttfb_sum += req->tfirst - req->tstart;
+	}
+	stats->total[lat_bucket(t - req->tstart)]++;
+	stats->total_sum += t - req->tstart;
+    }
+ out:
+    /* a pipelined request is waiting in hreq already */
+    req->tstart = (req->hdata > req->lreq) ? t : 0;
+    req->tfirst = 0;
+}
+
+void
+status_done(struct REQUEST *req)
+{
+    if (NULL == req->pbody)
+	return;
+    pool_put(req->pbody,STATUS_SIZE);
+    req->pbody = NULL;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static int
+status_allowed(struct REQUEST *req)
+{
+    static const struct in6_addr lo6 = IN6ADDR_LOOPBACK_INIT;
+    struct sockaddr_in  *sin  = (struct sockaddr_in*)&req->peer;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6*)&req->peer;
+    struct in6_addr addr;
+    int bits, mask;
+
+    switch (req->peer.ss_family) {
+    case AF_INET:
+	v4mapped(&addr,&sin->sin_addr);
+	break;
+    case AF_INET6:
+	addr = sin6->sin6_addr;
+	break;
+    default:
+	return 0;
+    }
+    if (0 == memcmp(&addr,&lo6,sizeof(addr)) ||
+	(IN6_IS_ADDR_V4MAPPED(&addr) && 127 == addr.s6_addr[12]))
+	return 1;
+    if (-1 == status_prefix)
+	return 0;
+    for (bits = status_prefix; bits >= 8; bits -= 8)
+	if (addr.s6_addr[(status_prefix-bits)/8] !=
+	    status_net.s6_addr[(status_prefix-bits)/8])
+	    return 0;
+    if (bits) {
+	mask = (0xff00 >> bits) & 0xff;
+	if ((addr.s6_addr[status_prefix/8] & mask) !=
+	    (status_net.s6_addr[status_prefix/8] & mask))
+	    return 0;
+    }
+    return 1;
+}
+
+static uint64_t
+lat_pct(unsigned long *hist, unsigned long count, double pct)
+{
+    unsigned long want = count * pct / 100, sum = 0;
+    int i;
+
+    if (!count)
+	return 0;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	sum += hist[i];
+	if (sum > want)
+	    break;
+    }
+    return lat_value(i < LAT_BUCKETS ? i : LAT_BUCKETS-1);
+}
+
+static uint64_t
+lat_max(unsigned long *hist)
+{
+    int i;
+
+    for (i = LAT_BUCKETS-1; i > 0; i--)
+	if (hist[i])
+	    break;
+    return lat_value(i);
+}
+
+struct page {
+    char *buf;
+    int  len;
+};
+
+static void __attribute__((format(printf,2,3)))
+add(struct page *p, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (p->len >= STATUS_SIZE - 1)
+	return;
+    va_start(ap,fmt);
+    n = vsnprintf(p->buf + p->len, STATUS_SIZE - p->len, fmt, ap);
+    va_end(ap);
+    p->len += n;
+    if (p->len > STATUS_SIZE - 1)
+	p->len = STATUS_SIZE - 1;
+}
+
+static void
+add_latency(struct page *p, char *name, unsigned long *hist)
+{
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+	count += hist[i];
+    add(p,"%-8s %10lu %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+	" %8" PRIu64 " %8" PRIu64 "\n", name, count,
+	lat_pct(hist,count,50), lat_pct(hist,count,90),
+	lat_pct(hist,count,99), lat_pct(hist,count,99.9),
+	lat_max(hist));
+}
+
+/* sum up the threads */
+static void
+stats_sum(struct STATS *sum)
+{
+    struct STATS *st;
+    int t, i;
+
+    memset(sum,0,sizeof(*sum));
+    for (t = 0; t < stats_threads; t++) {
+	st = stats_all + t;
+	sum->accepted   += st->accepted;
+	sum->closed     += st->closed;
+	sum->timeouts   += st->timeouts;
+	sum->idle       += st->idle;
+	sum->tls_ok     += st->tls_ok;
+	sum->tls_failed += st->tls_failed;
+	sum->requests   += st->requests;
+	sum->reused     += st->reused;
+	sum->ttfb_sum   += st->ttfb_sum;
+	sum->total_sum  += st->total_sum;
+	sum->cgi_spawns += st->cgi_spawns;
+	sum->b_sendfile += st->b_sendfile;
+	sum->b_splice   += st->b_splice;
+	sum->b_write    += st->b_write;
+	sum->dir_hits   += st->dir_hits;
+	sum->dir_misses += st->dir_misses;
+	for (i = 0; i <= STATE_MAX; i++)
+	    sum->conns[i] += st->conns[i];
+	for (i = 0; i < 600; i++)
+	    sum->status[i] += st->status[i];
+	for (i = 0; i < LAT_BUCKETS; i++) {
+	    sum->ttfb[i]  += st->ttfb[i];
+	    sum->total[i] += st->total[i];
+	}
+    }
+}
+
+static int
+active(struct STATS *st)
+{
+    int i, n = 0;
+
+    for (i = 0; i <= STATE_MAX; i++)
+	n += st->conns[i];
+    return n;
+}
+
+void
+status_request(struct REQUEST *req)
+{
+    struct STATS sum;
+    struct page p;
+    int i;
+
+    if (!status_allowed(req)) {
+	mkerror(req,403,1);
+	return;
+    }
+    if (NULL == (p.buf = pool_get(STATUS_SIZE))) {
+	mkerror(req,500,0);
+	return;
+    }
+    p.len = 0;
+    stats_sum(&sum);
+
+    add(&p,"webfsd %s, up %ld seconds, %d thread%s\n\n",
+	WEBFS_VERSION, (long)(now - stats_start),
+	stats_threads, stats_threads > 1 ? "s" : "");
+
+    add(&p,"connections: %d active, %lu accepted, %lu closed\n",
+	active(&sum), sum.accepted, sum.closed);
+    for (i = 0; i <= STATE_MAX; i++)
+	if (sum.conns[i])
+	    add(&p,"  %-14s %d\n", state_name[i] ? state_name[i] : "?",
+		sum.conns[i]);
+    add(&p,"timeouts: %lu network, %lu keep-alive\n",
+	sum.timeouts, sum.idle);
+#ifdef USE_SSL
+    if (with_ssl)
+	add(&p,"tls handshakes: %lu ok, %lu failed\n",
+	    sum.tls_ok, sum.tls_failed);
+#endif
+
+    add(&p,"requests: %lu, keep-alive reuse %.1f%%\n",
+	sum.requests, sum.requests ? 100.0 * sum.reused / sum.requests : 0.0);
+    for (i = 0; i < 600; i++)
+	if (sum.status[i])
+	    add(&p,"  %d %14lu\n", i, sum.status[i]);
+
+    add(&p,"bytes: %lu sendfile, %lu splice, %lu write\n",
+	sum.b_sendfile, sum.b_splice, sum.b_write);
+    add(&p,"dircache: %lu hits, %lu misses\n",
+	sum.dir_hits, sum.dir_misses);
+    if (cgipath)
+	add(&p,"cgi: %lu spawned\n", sum.cgi_spawns);
+
+    add(&p,"\nlatency (us)  count      p50      p90      p99    p99.9      max\n");
+    add_latency(&p,"ttfb",sum.ttfb);
+    add_latency(&p,"total",sum.total);
+
+    add(&p,"\nthread   active   accepted   requests\n");
+    for (i = 0; i < stats_threads; i++)
+	add(&p,"%6d %8d %10lu %10lu\n", i, active(stats_all+i),
+	    stats_all[i].accepted, stats_all[i].requests);
+
+    req->pbody = p.buf;
+    req->body  = p.buf;
+    req->lbody = p.len;
+    req->mime  = "text/plain";
+    mkheader(req,200);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static void
+add_counter(struct page *p, char *name, char *help)
+{
+    add(p,"# TYPE webfsd_%s counter\n# HELP webfsd_%s %s\n",name,name,help);
+}
+
+/* the log-linear buckets folded into one per power of two */
+static void
+add_histogram(struct page *p, char *name, char *help,
+	      unsigned long *hist, uint64_t sum)
+{
+    unsigned long count = 0;
+    int i;
+
+    add(p,"# TYPE webfsd_%s_seconds histogram\n"
+	"# UNIT webfsd_%s_seconds seconds\n"
+	"# HELP webfsd_%s_seconds %s\n", name, name, name, help);
+    for (i = 0; i < LAT_BUCKETS; i++) {
+	if (i >= METRICS_LE && 0 == i % LAT_SUB)
+	    add(p,"webfsd_%s_seconds_bucket{le=\"%.6f\"} %lu\n",
+		name, lat_value(i) / 1e6, count);
+	count += hist[i];
+    }
+    add(p,"webfsd_%s_seconds_bucket{le=\"+Inf\"} %lu\n", name, count);
+    add(p,"webfsd_%s_seconds_count %lu\n", name, count);
+    add(p,"webfsd_%s_seconds_sum %.6f\n", name, sum / 1e6);
+}
+
+void
+metrics_request(struct REQUEST *req)
+{
+    struct STATS sum;
+    struct page p;
+    int i;
+
+    if (!status_allowed(req)) {
+	mkerror(req,403,1);
+	return;
+    }
+    if (NULL == (p.buf = pool_get(STATUS_SIZE))) {
+	mkerror(req,500,0);
+	return;
+    }
+    p.len = 0;
+    stats_sum(&sum);
+
+    add(&p,"# TYPE webfsd_start_time_seconds gauge\n"
+	"# UNIT webfsd_start_time_seconds seconds\n"
+	"webfsd_start_time_seconds %ld\n", (long)stats_start);
+    add(&p,"# TYPE webfsd_threads gauge\n"
+	"webfsd_threads %d\n", stats_threads);
+
+    add(&p,"# TYPE webfsd_connections gauge\n"
+	"# HELP webfsd_connections open connections by state\n");
+    for (i = 0; i <= STATE_MAX; i++)
+	if (state_name[i])
+	    add(&p,"webfsd_connections{state=\"%s\"} %d\n",
+		state_name[i], sum.conns[i]);
+    add_counter(&p,"connections_accepted","accepted connections");
+    add(&p,"webfsd_connections_accepted_total %lu\n", sum.accepted);
+    add_counter(&p,"connections_closed","closed connections");
+    add(&p,"webfsd_connections_closed_total %lu\n", sum.closed);
+    add_counter(&p,"timeouts","connections timed out");
+    add(&p,"webfsd_timeouts_total{kind=\"network\"} %lu\n"
+	"webfsd_timeouts_total{kind=\"keepalive\"} %lu\n",
+	sum.timeouts, sum.idle);
+#ifdef USE_SSL
+    if (with_ssl) {
+	add_counter(&p,"tls_handshakes","tls handshakes");
+	add(&p,"webfsd_tls_handshakes_total{result=\"ok\"} %lu\n"
+	    "webfsd_tls_handshakes_total{result=\"failed\"} %lu\n",
+	    sum.tls_ok, sum.tls_failed);
+    }
+#endif
+
+    add_counter(&p,"requests","requests by status code");
+    for (i = 0; i < 600; i++)
+	if (sum.status[i])
+	    add(&p,"webfsd_requests_total{code=\"%d\"} %lu\n",
+		i, sum.status[i]);
+    add_counter(&p,"requests_reused",
+		"requests on a kept-alive or multiplexed connection");
+    add(&p,"webfsd_requests_reused_total %lu\n", sum.reused);
+    add_histogram(&p,"ttfb","time to first byte",sum.ttfb,sum.ttfb_sum);
+    add_histogram(&p,"request","time to last byte",sum.total,sum.total_sum);
+
+    add(&p,"# TYPE webfsd_sent_bytes counter\n"
+	"# UNIT webfsd_sent_bytes bytes\n"
+	"# HELP webfsd_sent_bytes bytes sent, by system call\n"
+	"webfsd_sent_bytes_total{via=\"sendfile\"} %lu\n"
+	"webfsd_sent_bytes_total{via=\"splice\"} %lu\n"
+	"webfsd_sent_bytes_total{via=\"write\"} %lu\n",
+	sum.b_sendfile, sum.b_splice, sum.b_write);
+    add_counter(&p,"dircache_lookups","directory listing cache lookups");
+    add(&p,"webfsd_dircache_lookups_total{result=\"hit\"} %lu\n"
+	"webfsd_dircache_lookups_total{result=\"miss\"} %lu\n",
+	sum.dir_hits, sum.dir_misses);
+    add_counter(&p,"cgi_spawns","cgi processes started");
+    add(&p,"webfsd_cgi_spawns_total %lu\n", sum.cgi_spawns);
+    add(&p,"# EOF\n");
+
+    req->pbody = p.buf;
+    req->body  = p.buf;
+    req->lbody = p.len;
+    req->mime  = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+    mkheader(req,200);
+}
@@ -34,10 +34,19 @@ int     timeout        = 60;
 int     keepalive_time = 5;
 int     tcp_port       = 0;
 int     max_dircache   = 128;
+int     max_header     = 16384;
 char    *cors          = NULL;
 char    *doc_root      = ".";
 char    *indexhtml     = NULL;
 char    *cgipath       = NULL;
+char    *putpath       = NULL;
+char    *statuspath    = NULL;
+char    *statusnet     = NULL;
+char    *metricspath   = NULL;
+char    *fcgi_socket   = NULL;
+char    *fcgi_program  = NULL;
+int     fcgi_workers   = 0;
+int     cgi_cache      = 0;
 char    *listen_ip     = NULL;
 char    *listen_port   = "8000";
 int     virtualhosts   = 0;
@@ -58,6 +67,9 @@ int     have_tty       = 1;
 int     max_conn       = 32;
 int     lifespan       = -1;
 int     no_listing     = 0;
+int     no_owner       = 0;
+int     no_http2       = 0;
+int     preload_names  = 0;
 
 time_t  now;
 int     slisten;
@@ -65,6 +77,7 @@ int     slisten;
 #ifdef USE_THREADS
 pthread_mutex_t lock_logfile = PTHREAD_MUTEX_INITIALIZER;
 int       nthreads = 1;
+int       ls_threads = 4;
 pthread_t *threads;
 #endif
 
@@ -107,6 +120,7 @@ usage(char *name)
 	    "  -h       print this text\n"
 	    "  -4       use ipv4\n"
 	    "  -6       use ipv6\n"
+	    "  -2       disable HTTP/2                      [%s]\n"
 	    "  -d       enable debug output                 [%s]\n"
 	    "  -F       do not fork into background         [%s]\n"
 	    "  -s       enable syslog (start/stop/errors)   [%s]\n"
@@ -114,9 +128,13 @@ usage(char *name)
 	    "  -c n     set max. allowed connections        [%i]\n"
 	    "  -O CORS  set CORS header                     [%s]\n"
 	    "  -a n     set max. cached dirs                [%i]\n"
+	    "  -H n     set max. request header size        [%i]\n"
 	    "  -j       disable directory listings          [%s]\n"
+	    "  -o       no owner/group in listings          [%s]\n"
+	    "  -U       preload user/group names            [%s]\n"
 #ifdef USE_THREADS
 	    "  -y n     startup n threads                   [%i]\n"
+	    "  -Y n     startup n directory listing threads [%i]\n"
 #endif
 	    "  -p port  use tcp-port >port<                 [%s]\n"
 	    "  -r dir   document root is >dir<              [%s]\n"
@@ -141,18 +159,33 @@ usage(char *name)
 #endif
 	    "  -x dir   CGI script directory (relative to\n"
 	    "           document root)                      [%s]\n"
+	    "  -w sock  send CGI requests to the FastCGI\n"
+	    "           application listening on >sock<     [%s]\n"
+	    "  -W n:prog  start n FastCGI workers >prog<\n"
+	    "           listening on the -w socket\n"
+	    "  -M sec   cache CGI responses for GET, default\n"
+	    "           lifetime >sec< seconds (0: off)     [%d]\n"
+	    "  -A dir   allow PUT uploads below >dir<\n"
+	    "           (relative to document root)         [%s]\n"
+	    "  -T url   server status page at >url<         [%s]\n"
+	    "  -E url   OpenMetrics (prometheus) at >url<   [%s]\n"
+	    "  -Q net   allow these from >net< (ip/prefix)\n"
+	    "           too, not just localhost             [%s]\n"
 	    "  -~ dir   user home directory (will expand\n"
 	    "           /~user/path to $HOME/dir/path\n",
 	    h ? h+1 : name,
+	    no_http2 ? "on" : "off",
  	    debug     ?  "on" : "off",
  	    dontdetach ?  "on" : "off",
 	    usesyslog ?  "on" : "off",
 	    timeout, max_conn,
 	    cors ? cors : "none",
-	    max_dircache,
+	    max_dircache, max_header,
 	    no_listing ? "on" : "off",
+	    no_owner ? "on" : "off",
+	    preload_names ? "on" : "off",
 #ifdef USE_THREADS
-	    nthreads,
+	    nthreads, ls_threads,
 #endif
 	    listen_port, doc_root,
 	    indexhtml ? indexhtml : "none",
@@ -165,7 +198,13 @@ usage(char *name)
 #ifdef USE_SSL
 	    certificate,
 #endif
-	    cgipath ? cgipath : "none");
+	    cgipath ? cgipath : "none",
+	    fcgi_socket ? fcgi_socket : "none",
+	    cgi_cache,
+	    putpath ? putpath : "none",
+	    statuspath ? statuspath : "none",
+	    metricspath ? metricspath : "none",
+	    statusnet ? statusnet : "none");
     if (getuid() == 0) {
 	pw = getpwuid(0);
 	gr = getgrgid(getgid());
@@ -175,6 +214,11 @@ usage(char *name)
 		pw ? pw->pw_name : "???",
 		gr ? gr->gr_name : "???");
     }
+    fprintf(stderr,
+	    "\n"
+	    "%s --compile-mime mime.types db\n"
+	    "  compile >mime.types< into a database for -m\n",
+	    h ? h+1 : name);
     exit(0);
 }
 
@@ -218,6 +262,10 @@ fix_ug(void)
 	exit(1);
     }
 
+    /* name maps for directory listings, also needs /etc */
+    if (preload_names && !no_owner)
+	load_names();
+
     /* chroot to $DOCUMENT_ROOT (must be done here as getpwuid needs
        /etc and chroot works as root only) */
     if (do_chroot) {
@@ -255,7 +303,7 @@ fix_ug(void)
 
 /* ---------------------------------------------------------------------- */
 
-static void
+void
 access_log(struct REQUEST *req, time_t now)
 {
     char timestamp[32];
@@ -379,9 +427,16 @@ mainloop(void *thread_arg)
     struct timeval      tv;
     int                 max;
     fd_set              rd,wr;
+    int                 nstate[STATE_MAX+1];
 
+#ifdef USE_THREADS
+    status_thread(thread_arg ? (pthread_t*)thread_arg - threads : 0);
+#else
+    status_thread(0);
+#endif
     for (;!termsig;) {
-	if (got_sighup) {
+	/* all threads look, exactly one handles each SIGHUP */
+	if (__atomic_exchange_n(&got_sighup,0,__ATOMIC_ACQ_REL)) {
 	    if (NULL != logfile && 0 != strcmp(logfile,"-")) {
 		if (debug)
 		    fprintf(stderr,"got SIGHUP, reopen logfile %s\n",logfile);
@@ -394,7 +449,11 @@ mainloop(void *thread_arg)
 		    close_on_exec(fileno(logfh));
 		DO_UNLOCK(lock_logfile);
 	    }
-	    got_sighup = 0;
+	    if (preload_names && !no_owner) {
+		if (debug)
+		    fprintf(stderr,"got SIGHUP, reload user/group names\n");
+		reload_names();
+	    }
 	}
 	FD_ZERO(&rd);
 	FD_ZERO(&wr);
@@ -405,7 +464,9 @@ mainloop(void *thread_arg)
 	    max = slisten;
 	}
 	/* add connection sockets */
+	memset(nstate,0,sizeof(nstate));
 	for (req = conns; req != NULL; req = req->next) {
+	    nstate[req->state]++;
 	    switch (req->state) {
 	    case STATE_KEEPALIVE:
 	    case STATE_READ_HEADER:
@@ -418,6 +479,7 @@ mainloop(void *thread_arg)
 	    case STATE_WRITE_FILE:
 	    case STATE_WRITE_RANGES:
 	    case STATE_CGI_BODY_OUT:
+	    case STATE_CGI_SPLICE:
 		FD_SET(req->fd,&wr);
 #ifdef USE_SSL
 		if (with_ssl)
@@ -432,8 +494,37 @@ mainloop(void *thread_arg)
 		if (req->cgipipe > max)
 		    max = req->cgipipe;
 		break;
+#ifdef USE_THREADS
+	    case STATE_READ_DIR:
+		FD_SET(req->dir->wakeup,&rd);
+		if (req->dir->wakeup > max)
+		    max = req->dir->wakeup;
+		break;
+#endif
+	    case STATE_CGI_WAIT:
+		FD_SET(req->mc->wakeup,&rd);
+		if (req->mc->wakeup > max)
+		    max = req->mc->wakeup;
+		break;
+	    case STATE_H2:
+		h2_fdset(req,&rd,&wr,&max);
+		break;
+	    }
+	    if (req->infd != -1) {
+		/* request body for the cgi script */
+		if (IN_WAIT_SINK == req->inwait) {
+		    FD_SET(req->infd,&wr);
+		    if (req->infd > max)
+			max = req->infd;
+		} else {
+		    FD_SET(req->fd,&rd);
+		    if (req->fd > max)
+			max = req->fd;
+		}
 	    }
 	}
+	memcpy(stats->conns,nstate,sizeof(nstate));
+
 	/* go! */
 	tv.tv_sec  = keepalive_time;
 	tv.tv_usec = 0;
@@ -448,6 +539,8 @@ mainloop(void *thread_arg)
 	    continue;
 	}
 	now = time(NULL);
+	if (fcgi_program && NULL == thread_arg)
+	    fcgi_check();
 
 	/* new connection ? */
 	if (FD_ISSET(slisten,&rd)) {
@@ -468,11 +561,13 @@ mainloop(void *thread_arg)
 		    req->cors = cors;
 		    req->bfd = -1;
 		    req->cgipipe = -1;
+		    req->infd = -1;
 		    req->state = STATE_READ_HEADER;
 		    req->ping = now;
 		    req->next = conns;
 		    conns = req;
 		    curr_conn++;
+		    stats->accepted++;
 		    if (debug)
 			fprintf(stderr,"%03d: new request (%d)\n",req->fd,curr_conn);
 #ifdef USE_SSL
@@ -511,12 +606,14 @@ mainloop(void *thread_arg)
 	    case STATE_WRITE_FILE:
 	    case STATE_WRITE_RANGES:
 	    case STATE_CGI_BODY_OUT:
+	    case STATE_CGI_SPLICE:
 		if (FD_ISSET(req->fd,&wr)) {
 		    write_request(req);
 		    req->ping = now;
 		}
 #ifdef USE_SSL
-		if (with_ssl && FD_ISSET(req->fd,&rd)) {
+		/* not both, the first call may have closed already */
+		else if (with_ssl && FD_ISSET(req->fd,&rd)) {
 		    write_request(req);
 		    req->ping = now;
 		}
@@ -534,19 +631,51 @@ mainloop(void *thread_arg)
 		    req->ping = now;
 		}
 		break;
+#ifdef USE_THREADS
+	    case STATE_READ_DIR:
+		if (FD_ISSET(req->dir->wakeup,&rd)) {
+		    dir_request(req);
+		    if (req->state == STATE_WRITE_HEADER)
+			write_request(req);
+		    req->ping = now;
+		}
+		break;
+#endif
+	    case STATE_CGI_WAIT:
+		if (FD_ISSET(req->mc->wakeup,&rd)) {
+		    mc_wakeup(req);
+		    if (req->state == STATE_WRITE_HEADER)
+			write_request(req);
+		    req->ping = now;
+		}
+		break;
+	    case STATE_H2:
+		if (h2_io(req,&rd,&wr))
+		    req->ping = now;
+		break;
+	    }
+	    if (req->infd != -1 && req->state != STATE_CLOSE &&
+		(FD_ISSET(req->fd,&rd) || FD_ISSET(req->infd,&wr))) {
+		read_body(req);
+		req->ping = now;
 	    }
 
 	    /* check timeouts */
-	    if (req->state == STATE_KEEPALIVE) {
+	    if (req->state == STATE_KEEPALIVE ||
+		(req->state == STATE_H2 && h2_idle(req))) {
 		if (now > req->ping + keepalive_time ||
 		    curr_conn > max_conn * 9 / 10) {
 		    if (debug)
 			fprintf(stderr,"%03d: keepalive timeout\n",req->fd);
 		    req->state = STATE_CLOSE;
+		    stats->idle++;
 		}
 	    } else {
 		if (now > req->ping + timeout) {
+		    stats->timeouts++;
 		    if (req->state == STATE_READ_HEADER) {
+			if (!req->tstart)
+			    req->tstart = stats_us(); /* count the 408 */
 			mkerror(req,408,0);
 		    } else {
 			xerror(LOG_INFO,"network timeout",req->peerhost);
@@ -564,37 +693,44 @@ header_parsing:
 	    }
 
 	    /* handle finished requests */
+	    if (req->state == STATE_FINISHED &&
+		(IN_LENGTH == req->inmode || IN_CHUNKED == req->inmode))
+		/* body not read (completely), next request start unknown */
+		req->keep_alive = 0;
 	    if (req->state == STATE_FINISHED && !req->keep_alive)
 		req->state = STATE_CLOSE;
 	    if (req->state == STATE_FINISHED) {
 		if (logfh)
 		    access_log(req,now);
+		stats_request(req);
 		/* cleanup */
 		req->auth[0]       = 0;
 		req->if_modified   = NULL;
 		req->if_unmodified = NULL;
 		req->if_range      = NULL;
 		req->range_hdr     = NULL;
+		req->ctype         = NULL;
+		req->inmode        = IN_NONE;
 		req->ranges        = 0;
 		if (req->r_start) { free(req->r_start); req->r_start = NULL; }
 		if (req->r_end)   { free(req->r_end);   req->r_end   = NULL; }
 		if (req->r_head)  { free(req->r_head);  req->r_head  = NULL; }
 		if (req->r_hlen)  { free(req->r_hlen);  req->r_hlen  = NULL; }
-		list_free(&req->header);
+		req->hscan         = 0;
+		req->hstate        = 0;
+		req->nhdr          = 0;
 		memset(req->mtime,   0, sizeof(req->mtime));
 
 		if (req->bfd != -1) {
 		    close(req->bfd);
 		    req->bfd  = -1;
 		}
-		if (req->cgipipe != -1) {
-		    close(req->cgipipe);
-		    req->cgipipe  = -1;
-		}
-		if (req->cgipid) {
-		    kill(req->cgipid,SIGTERM);
-		    req->cgipid = 0;
-		}
+		cgi_done(req);
+		put_abort(req);
+		status_done(req);
+		req->cgilen    = 0;
+		req->cgipos    = 0;
+		req->cgimode   = CGI_CLOSE;
 		req->body      = NULL;
 		req->written   = 0;
 		req->head_only = 0;
@@ -615,6 +751,7 @@ header_parsing:
 		    req->state = STATE_KEEPALIVE;
 		    req->hdata = 0;
 		    req->lreq  = 0;
+		    release_hreq(req);
 #ifdef TCP_CORK
 		    if (1 == req->tcp_cork) {
 			req->tcp_cork = 0;
@@ -639,8 +776,10 @@ header_parsing:
 
 	    /* connections to close */
 	    if (req->state == STATE_CLOSE) {
-		if (logfh)
+		if (logfh && !req->h2)
 		    access_log(req,now);
+		stats_request(req);
+		stats->closed++;
 		/* cleanup */
 		close(req->fd);
 #ifdef USE_SSL
@@ -649,12 +788,13 @@ header_parsing:
 #endif
 		if (req->bfd != -1)
 		    close(req->bfd);
-		if (req->cgipipe != -1)
-		    close(req->cgipipe);
-		if (req->cgipid)
-		    kill(req->cgipid,SIGTERM);
+		cgi_done(req);
+		put_abort(req);
+		status_done(req);
 		if (req->dir)
 		    free_dir(req->dir);
+		if (req->h2)
+		    h2_free(req);
 		curr_conn--;
 		if (debug)
 		    fprintf(stderr,"%03d: done (%d)\n",req->fd,curr_conn);
@@ -672,7 +812,9 @@ header_parsing:
 		if (tmp->r_end)   free(tmp->r_end);
 		if (tmp->r_head)  free(tmp->r_head);
 		if (tmp->r_hlen)  free(tmp->r_hlen);
-		list_free(&tmp->header);
+		if (tmp->hdr && tmp->hdr != tmp->hinline)
+		    free(tmp->hdr);
+		release_hreq(tmp);
 		free(tmp);
 	    } else {
 		prev = req;
@@ -701,6 +843,14 @@ main(int argc, char *argv[])
     euid = geteuid();
     if (uid != euid)
 	run_as(uid);
+
+    /* not a server run, just build the mime database */
+    if (argc > 1 && 0 == strcmp(argv[1],"--compile-mime")) {
+	if (argc != 4)
+	    usage(argv[0]);
+	exit(compile_mime(argv[2],argv[3]) ? 1 : 0);
+    }
+
     gethostname(server_host,255);
     memset(&ask,0,sizeof(ask));
     ask.ai_flags = AI_CANONNAME;
@@ -711,8 +861,8 @@ main(int argc, char *argv[])
     
     /* parse options */
     for (;;) {
-	if (-1 == (c = getopt(argc,argv,"hvsdF46jS"
-			      "O:r:R:f:p:n:N:i:t:c:a:u:g:l:L:m:y:b:k:e:x:C:P:~:")))
+	if (-1 == (c = getopt(argc,argv,"hvsdF462jSoU"
+			      "O:r:R:f:p:n:N:i:t:c:a:H:u:g:l:L:m:y:Y:b:k:e:x:w:W:M:A:T:E:Q:C:P:~:")))
 	    break;
 	switch (c) {
 	case 'h':
@@ -771,6 +921,13 @@ main(int argc, char *argv[])
 	case 'a':
 	    max_dircache = atoi(optarg);
 	    break;
+	case 'H':
+	    max_header = atoi(optarg);
+	    if (max_header < POOL_MIN)
+		max_header = POOL_MIN;
+	    if (max_header > POOL_MAX)
+		max_header = POOL_MAX;
+	    break;
 	case 'u':
 	    strncpy(user,optarg,16);
 	    break;
@@ -804,10 +961,45 @@ main(int argc, char *argv[])
 		sprintf(cgipath,"%s/",optarg);
 	    }
 	    break;
+	case 'A':
+	    if (optarg[strlen(optarg)-1] == '/') {
+		putpath = optarg;
+	    } else {
+		putpath = malloc(strlen(optarg)+2);
+		sprintf(putpath,"%s/",optarg);
+	    }
+	    break;
+	case 'T':
+	    statuspath = optarg;
+	    break;
+	case 'E':
+	    metricspath = optarg;
+	    break;
+	case 'Q':
+	    statusnet = optarg;
+	    break;
+	case 'w':
+	    fcgi_socket = optarg;
+	    break;
+	case 'M':
+	    cgi_cache = atoi(optarg);
+	    break;
+	case 'W':
+	    if (NULL != (fcgi_program = strchr(optarg,':'))) {
+		fcgi_workers = atoi(optarg);
+		fcgi_program++;
+	    } else {
+		fcgi_workers = 1;
+		fcgi_program = optarg;
+	    }
+	    break;
 #ifdef USE_THREADS
 	case 'y':
 	    nthreads = atoi(optarg);
 	    break;
+	case 'Y':
+	    ls_threads = atoi(optarg);
+	    break;
 #endif
 #ifdef USE_SSL
 	case 'S':
@@ -824,6 +1016,15 @@ main(int argc, char *argv[])
 	case 'j':
 	    no_listing = 1;
 	    break;
+	case '2':
+	    no_http2 = 1;
+	    break;
+	case 'o':
+	    no_owner = 1;
+	    break;
+	case 'U':
+	    preload_names = 1;
+	    break;
 	case '~':
 	    userdir = optarg;
 	    break;
@@ -831,6 +1032,14 @@ main(int argc, char *argv[])
 	    exit(1);
 	}
     }
+    if (fcgi_socket && !cgipath) {
+	fprintf(stderr,"-w needs a CGI directory (-x)\n");
+	exit(1);
+    }
+    if (fcgi_program && !fcgi_socket) {
+	fprintf(stderr,"-W needs a FastCGI socket (-w)\n");
+	exit(1);
+    }
     if (usesyslog)
 	syslog_init();
 
@@ -923,6 +1132,13 @@ main(int argc, char *argv[])
     /* init misc stuff */
     init_mime(mimetypes,"text/plain");
     init_quote();
+    init_scan();
+    init_http2();
+#ifdef USE_THREADS
+    init_status(nthreads);
+#else
+    init_status(1);
+#endif
 #ifdef USE_SSL
     if (with_ssl)
 	init_ssl();
@@ -932,6 +1148,7 @@ main(int argc, char *argv[])
     if (uid != euid)
 	run_as (euid);
     fix_ug();
+    init_docroot();
 
     if (logfile) {
 	if (0 == strcmp(logfile,"-")) {
@@ -1009,8 +1226,13 @@ main(int argc, char *argv[])
     if (debug || dontdetach)
 	sigaction(SIGINT,&act,&old);
 
+    if (fcgi_program)
+	fcgi_spawn();
+
     /* go! */
 #ifdef USE_THREADS
+    if (ls_threads > 0)
+	init_dirpool();
     if (nthreads > 1) {
 	int i;
 	threads = malloc(sizeof(pthread_t) * nthreads);
@@ -1026,6 +1248,8 @@ main(int argc, char *argv[])
     if (with_ssl)
 	SSL_CTX_free(ctx);
 #endif
+    if (fcgi_program)
+	fcgi_stop();
     if (logfh)
 	fclose(logfh);
     if (pidfile)